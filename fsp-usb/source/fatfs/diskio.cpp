@@ -22,7 +22,8 @@ static u8 GetDriveStatus(u32 mounted_idx) {
 
 	fspusb::impl::DoWithDriveMountedIndex(mounted_idx, [&](fspusb::impl::DrivePointer &drive_ptr) {
 		if (drive_ptr->IsSCSIOk()) {
-			status = 0;
+			/* Lets FatFs refuse anything that would write to the medium before it gets to us */
+			status = (drive_ptr->IsWriteProtected() ? STA_PROTECT : 0);
 		}
 	});
 
@@ -111,18 +112,36 @@ extern "C" DRESULT disk_ioctl (
 	void *buff		/* Buffer to send/receive control data */
 )
 {
+    auto res = RES_OK;
+    
     switch(cmd) {
         case GET_SECTOR_SIZE:
             fspusb::impl::DoWithDriveMountedIndex((u32)pdrv, [&](fspusb::impl::DrivePointer &drive_ptr) {
                 *(WORD*)buff = (WORD)drive_ptr->GetBlockSize();
             });
             
+            break;
+        case CTRL_SYNC:
+            /* Flush the drive's own write cache, so everything FatFs wrote so far is actually on the medium */
+            res = RES_PARERR;
+            fspusb::impl::DoWithDriveMountedIndex((u32)pdrv, [&](fspusb::impl::DrivePointer &drive_ptr) {
+                res = drive_ptr->DoSynchronizeCache();
+            });
+            
+            break;
+        case CTRL_TRIM:
+            /* Freed sector range (both ends included), queued for an UNMAP later on */
+            res = RES_PARERR;
+            fspusb::impl::DoWithDriveMountedIndex((u32)pdrv, [&](fspusb::impl::DrivePointer &drive_ptr) {
+                res = drive_ptr->DoTrim((u64)((LBA_t*)buff)[0], (u64)((LBA_t*)buff)[1]);
+            });
+            
             break;
         default:
             break;
     }
     
-    return RES_OK;
+    return res;
 }
 
 #if !FF_FS_READONLY && !FF_FS_NORTC /* Get system time */
@@ -262,6 +262,20 @@
 #endif
 
 
+/* FAT/bitmap sector cache */
+#if FF_FAT_CACHE && (FF_FAT_CACHE % FF_MAX_SS != 0 || FF_FAT_CACHE < FF_MAX_SS * 2)
+#error Wrong FF_FAT_CACHE setting
+#endif
+
+
+/* Free extent map */
+#if FF_FREE_EXTENTS < 0
+#error Wrong FF_FREE_EXTENTS setting
+#endif
+#define FX_ALL	0x01	/* The map holds every free cluster of the volume */
+#define FX_TOP	0x02	/* The map holds the largest free extents of the volume */
+
+
 /* Timestamp */
 #if FF_NORTC_YEAR < 1980 || FF_NORTC_YEAR > 2107 || FF_NORTC_MON < 1 || FF_NORTC_MON > 12 || FF_NORTC_MDAY < 1 || FF_NORTC_MDAY > 31
 #error Invalid FF_FS_NORTC settings
@@ -1118,6 +1132,132 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT/bitmap sector cache, kept apart from the directory window         */
+/*-----------------------------------------------------------------------*/
+#if FF_FAT_CACHE
+
+static void fat_cache_reset (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_FAT_CACHE / FF_MIN_SS; i++) {
+		fs->fcsect[i] = (LBA_t)0 - 1;
+		fs->fcuse[i] = 0;
+		fs->fcflag[i] = 0;
+	}
+	fs->fcidx = 0; fs->fcstamp = 0;
+}
+
+
+#if !FF_FS_READONLY
+static FRESULT sync_fat_cache (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT i, j, n = FF_FAT_CACHE / SS(fs);
+	BYTE f;
+
+
+	/* 1st pass writes the dirty sectors, 2nd pass reflects them to the 2nd FAT. Each pass goes in
+	   ascending LBA order, so that the lower layer gets runs of adjacent sectors it can merge. */
+	for (f = 1; f <= 2; f++) {
+		for (;;) {
+			for (i = 0, j = n; i < n; i++) {	/* Find the lowest sector to be written in this pass */
+				if ((fs->fcflag[i] & f) && (j == n || fs->fcsect[i] < fs->fcsect[j])) j = i;
+			}
+			if (j == n) break;
+			if (f == 1) {
+				if (disk_write(fs->pdrv, fs->fcbuf + j * SS(fs), fs->fcsect[j], 1) != RES_OK) return FR_DISK_ERR;	/* Left dirty to be retried */
+				fs->fcflag[j] = (fs->n_fats == 2 && fs->fcsect[j] - fs->fatbase < fs->fsize) ? 2 : 0;	/* Is it in the 1st FAT? */
+			} else {
+				disk_write(fs->pdrv, fs->fcbuf + j * SS(fs), fs->fcsect[j] + fs->fsize, 1);	/* Error is ignored as sync_window() does */
+				fs->fcflag[j] = 0;
+			}
+		}
+	}
+	return FR_OK;
+}
+#endif
+
+
+static BYTE* fat_window (	/* Returns pointer to the sector in the cache, null on disk error */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* FAT or allocation bitmap sector to access */
+)
+{
+	UINT i, v, n = FF_FAT_CACHE / SS(fs);
+
+
+	i = fs->fcidx;
+	if (fs->fcsect[i] != sect) {	/* Not the sector accessed last? */
+		for (i = v = 0; i < n && fs->fcsect[i] != sect; i++) {
+			if (fs->fcuse[i] < fs->fcuse[v]) v = i;	/* Track the least recently used slot */
+		}
+		if (i == n) {	/* Not in the cache, load it into the LRU slot */
+			i = v;
+#if !FF_FS_READONLY
+			if (fs->fcflag[i] && sync_fat_cache(fs) != FR_OK) return 0;	/* Write back all dirty sectors at once */
+#endif
+			if (disk_read(fs->pdrv, fs->fcbuf + i * SS(fs), sect, 1) != RES_OK) {
+				fs->fcsect[i] = (LBA_t)0 - 1;	/* Invalidate the slot if read data is not valid */
+				fs->fcuse[i] = 0;
+				return 0;
+			}
+			fs->fcsect[i] = sect;
+		}
+		fs->fcidx = i;
+	}
+	fs->fcuse[i] = ++fs->fcstamp;
+	return fs->fcbuf + i * SS(fs);
+}
+
+#define fat_dirty(fs)	((fs)->fcflag[(fs)->fcidx] |= 1)	/* Mark the sector accessed last dirty */
+
+
+#if !FF_FS_READONLY
+static BYTE* fat_window_run (	/* Returns pointer to the first sector of the run in the cache, null on disk error */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect,		/* First FAT or allocation bitmap sector of the run */
+	UINT* nsect		/* Number of sectors wanted, returns number of sectors loaded */
+)
+{
+	UINT i, n = FF_FAT_CACHE / SS(fs);
+
+
+	if (*nsect > n) *nsect = n;
+	if (*nsect <= 1) {
+		*nsect = 1;
+		return fat_window(fs, sect);
+	}
+	for (i = 0; i < *nsect && fs->fcsect[i] == sect + i; i++) ;
+	if (i < *nsect) {	/* Not loaded as a run yet, replace the whole cache with a single multi-sector read */
+		if (sync_fat_cache(fs) != FR_OK) return 0;
+		fat_cache_reset(fs);
+		if (disk_read(fs->pdrv, fs->fcbuf, sect, *nsect) != RES_OK) return 0;
+		for (i = 0; i < *nsect; i++) {
+			fs->fcsect[i] = sect + i;
+			fs->fcuse[i] = ++fs->fcstamp;
+		}
+	}
+	return fs->fcbuf;
+}
+#endif
+
+#else	/* The FAT goes through the window */
+#define fat_cache_reset(fs)
+#define sync_fat_cache(fs)	FR_OK
+#define fat_window(fs, sect)	(move_window((fs), (sect)) == FR_OK ? (fs)->win : 0)
+#define fat_window_run(fs, sect, nsect)	(*(nsect) = 1, fat_window((fs), (sect)))
+#define fat_dirty(fs)	((fs)->wflag = 1)
+#endif
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Synchronize filesystem and data on the storage                        */
@@ -1130,7 +1270,8 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 	FRESULT res;
 
 
-	res = sync_window(fs);
+	res = sync_fat_cache(fs);	/* Allocation changes go first, then the directory entries referring to them */
+	if (res == FR_OK) res = sync_window(fs);
 	if (res == FR_OK) {
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {	/* FAT32: Update FSInfo sector if needed */
 			/* Create FSInfo structure */
@@ -1184,6 +1325,7 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 {
 	UINT wc, bc;
 	DWORD val;
+	BYTE *p;
 	FATFS *fs = obj->fs;
 
 
@@ -1196,21 +1338,21 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = (UINT)clst; bc += bc / 2;
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc = fs->win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc |= fs->win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
+			if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			wc = p[bc++ % SS(fs)];		/* Get 1st byte of the entry */
+			if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			wc |= p[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
 			val = (clst & 1) ? (wc >> 4) : (wc & 0xFFF);	/* Adjust bit position */
 			break;
 
 		case FS_FAT16 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2))) != FR_OK) break;
-			val = ld_word(fs->win + clst * 2 % SS(fs));		/* Simple WORD array */
+			if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) == 0) break;
+			val = ld_word(p + clst * 2 % SS(fs));		/* Simple WORD array */
 			break;
 
 		case FS_FAT32 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-			val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
+			if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+			val = ld_dword(p + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
 			break;
 #if FF_FS_EXFAT
 		case FS_EXFAT :
@@ -1230,8 +1372,8 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 					if (obj->n_frag != 0) {	/* Is it on the growing edge? */
 						val = 0x7FFFFFFF;	/* Generate EOC */
 					} else {
-						if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-						val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x7FFFFFFF;
+						if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+						val = ld_dword(p + clst * 4 % SS(fs)) & 0x7FFFFFFF;
 					}
 					break;
 				}
@@ -1269,36 +1411,38 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = (UINT)clst; bc += bc / 2;	/* bc: byte offset of the entry */
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc++ % SS(fs);
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			p += bc++ % SS(fs);
 			*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;		/* Update 1st byte */
-			fs->wflag = 1;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc % SS(fs);
+			fat_dirty(fs);
+			if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			p += bc % SS(fs);
 			*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));	/* Update 2nd byte */
-			fs->wflag = 1;
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 
 		case FS_FAT16 :
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-			if (res != FR_OK) break;
-			st_word(fs->win + clst * 2 % SS(fs), (WORD)val);	/* Simple WORD array */
-			fs->wflag = 1;
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) == 0) break;
+			st_word(p + clst * 2 % SS(fs), (WORD)val);	/* Simple WORD array */
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 
 		case FS_FAT32 :
 #if FF_FS_EXFAT
 		case FS_EXFAT :
 #endif
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-			if (res != FR_OK) break;
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
 			if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
-				val = (val & 0x0FFFFFFF) | (ld_dword(fs->win + clst * 4 % SS(fs)) & 0xF0000000);
+				val = (val & 0x0FFFFFFF) | (ld_dword(p + clst * 4 % SS(fs)) & 0xF0000000);
 			}
-			st_dword(fs->win + clst * 4 % SS(fs), val);
-			fs->wflag = 1;
+			st_dword(p + clst * 4 % SS(fs), val);
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 		}
 	}
@@ -1310,6 +1454,159 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Scanning kernels for FAT sectors and bitmap sectors    */
+/*-----------------------------------------------------------------------*/
+/* Counting and searching free clusters goes through these a sector at a time. */
+
+
+static UINT pop_dword (	/* Number of bits set */
+	DWORD v
+)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (UINT)((((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+
+static UINT scan_ent (	/* Offset of the first free (or in-use) entry in i..e-1, e if there is none */
+	const BYTE* p,	/* FAT sector */
+	UINT i,			/* Offset to start at (multiple of es) */
+	UINT e,			/* Offset to stop at */
+	UINT es,		/* Size of an entry (2:FAT16, 4:FAT32) */
+	int fr			/* 1:Find a free entry, 0:Find an entry in use */
+)
+{
+	DWORD v;
+
+
+	for (; i < e; i += es) {
+		v = (es == 2) ? ld_word(p + i) : ld_dword(p + i) & 0x0FFFFFFF;
+		if ((v == 0) == (fr != 0)) break;
+	}
+	return i;
+}
+
+
+static UINT count_ent (	/* Number of free entries in i..e-1 */
+	const BYTE* p,	/* FAT sector */
+	UINT i,			/* Offset to start at (multiple of es) */
+	UINT e,			/* Offset to stop at */
+	UINT es			/* Size of an entry (2:FAT16, 4:FAT32) */
+)
+{
+	UINT n = 0;
+
+
+	for (; i < e; i += es) {
+		if (es == 2) {
+			if (ld_word(p + i) == 0) n++;
+		} else {
+			if ((ld_dword(p + i) & 0x0FFFFFFF) == 0) n++;
+		}
+	}
+	return n;
+}
+
+
+#if FF_FS_EXFAT
+static UINT scan_byte (	/* Offset of the first byte not equal to val in i..e-1, e if there is none */
+	const BYTE* p,	/* Bitmap sector */
+	UINT i,			/* Offset to start at */
+	UINT e,			/* Offset to stop at */
+	BYTE val		/* Byte value to skip */
+)
+{
+	while (i < e && p[i] == val) i++;
+	return i;
+}
+
+
+static UINT count_bit (	/* Number of bits with zero in the bytes i..e-1 */
+	const BYTE* p,	/* Bitmap sector */
+	UINT i,			/* Offset to start at */
+	UINT e			/* Offset to stop at */
+)
+{
+	UINT n = 0;
+
+
+	for (; i + 4 <= e; i += 4) {
+		n += 32 - pop_dword(ld_dword(p + i));
+	}
+	for (; i < e; i++) {
+		n += 8 - pop_dword(p[i]);
+	}
+	return n;
+}
+#endif
+
+
+#if FF_FREE_EXTENTS || FF_FS_EXFAT
+static DWORD find_state (	/* Cluster# of the first free (or in-use) cluster in clst..end-1, end:None, 0xFFFFFFFF:Disk error */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst,		/* Cluster# to start at */
+	DWORD end,		/* Cluster# to stop at */
+	int fr			/* 1:Find a free cluster, 0:Find a cluster in use */
+)
+{
+	BYTE *p;
+	UINT i, j, n, es;
+	DWORD val;
+	FFOBJID obj;
+
+
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Test entries one by one */
+		obj.fs = fs;
+		for (; clst < end; clst++) {
+			val = get_fat(&obj, clst);
+			if (val == 0xFFFFFFFF) return val;
+			if ((val == 0) == (fr != 0)) break;
+		}
+		return clst;
+	}
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
+		while (clst < end) {
+			val = clst - 2;	/* The first bit in the bitmap corresponds to cluster #2 */
+			if ((p = fat_window(fs, fs->bitbase + val / 8 / SS(fs))) == 0) return 0xFFFFFFFF;
+			i = val / 8 % SS(fs);
+			if (val % 8 == 0 && end - clst >= 8) {	/* Skip the bytes with no bit in the state to find at once */
+				n = (end - clst) / 8;
+				if (n > SS(fs) - i) n = SS(fs) - i;
+				j = scan_byte(p, i, i + n, fr ? 0xFF : 0x00);
+				clst += (DWORD)(j - i) * 8;
+				if (j == i + n) continue;	/* Next sector or end of the range */
+				i = j;
+			}
+			do {	/* Test the bits up to the byte boundary */
+				if ((((p[i] >> ((clst - 2) % 8)) & 1) == 0) == (fr != 0)) return clst;
+			} while (++clst < end && (clst - 2) % 8 != 0);
+		}
+		return clst;
+	}
+#endif
+	es = (fs->fs_type == FS_FAT16) ? 2 : 4;	/* FAT16/32: Scan WORD/DWORD FAT entries */
+	while (clst < end) {
+		if ((p = fat_window(fs, fs->fatbase + clst / (SS(fs) / es))) == 0) return 0xFFFFFFFF;
+		i = clst % (SS(fs) / es) * es;
+		n = SS(fs) / es - i / es;
+		if (n > end - clst) n = end - clst;
+		j = scan_ent(p, i, i + n * es, es, fr);
+		clst += (j - i) / es;
+		if (j < i + n * es) break;	/* Found? */
+	}
+	return clst;
+}
+#endif
+
+#endif /* !FF_FS_READONLY */
+
+
+
+
 #if FF_FS_EXFAT && !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* exFAT: Accessing FAT and Allocation Bitmap                            */
@@ -1318,6 +1615,7 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 /*--------------------------------------*/
 /* Find a contiguous free cluster block */
 /*--------------------------------------*/
+#if !FF_FREE_EXTENTS || FF_USE_EXPAND	/* (the free extent map takes over otherwise) */
 
 static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk error */
 	FATFS* fs,	/* Filesystem object */
@@ -1325,34 +1623,26 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	DWORD ncl	/* Number of contiguous clusters to find (1..) */
 )
 {
-	BYTE bm, bv;
-	UINT i;
-	DWORD val, scl, ctr;
+	DWORD scl, ecl, end;
+	UINT pass;
 
 
-	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
-	if (clst >= fs->n_fatent - 2) clst = 0;
-	scl = val = clst; ctr = 0;
-	for (;;) {
-		if (move_window(fs, fs->bitbase + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
-		i = val / 8 % SS(fs); bm = 1 << (val % 8);
-		do {
-			do {
-				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
-				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
-					val = 0; bm = 0; i = SS(fs);
-				}
-				if (bv == 0) {	/* Is it a free cluster? */
-					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
-				} else {
-					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
-				}
-				if (val == clst) return 0;	/* All cluster scanned? */
-			} while (bm != 0);
-			bm = 1;
-		} while (++i < SS(fs));
+	if (clst < 2 || clst >= fs->n_fatent) clst = 2;
+	for (pass = 0; pass < 2; pass++) {	/* From there to the end, then from the top with wrap-around */
+		scl = pass ? 2 : clst; end = pass ? clst : fs->n_fatent;
+		while (scl < end) {
+			scl = find_state(fs, scl, end, 1);	/* Next free cluster */
+			if (scl == 0xFFFFFFFF) return scl;
+			if (scl == end) break;
+			ecl = find_state(fs, scl, (ncl < fs->n_fatent - scl) ? scl + ncl : fs->n_fatent, 0);	/* End of the free block (as far as needed) */
+			if (ecl == 0xFFFFFFFF) return ecl;
+			if (ecl - scl >= ncl) return scl;	/* Check if run length is sufficient for required */
+			scl = ecl;
+		}
 	}
+	return 0;	/* All cluster scanned */
 }
+#endif
 
 
 /*----------------------------------------*/
@@ -1366,7 +1656,7 @@ static FRESULT change_bitmap (
 	int bv		/* bit value to be set (0 or 1) */
 )
 {
-	BYTE bm;
+	BYTE bm, *p;
 	UINT i;
 	LBA_t sect;
 
@@ -1376,12 +1666,12 @@ static FRESULT change_bitmap (
 	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
 	bm = 1 << (clst % 8);					/* Bit mask in the byte */
 	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
+		if ((p = fat_window(fs, sect++)) == 0) return FR_DISK_ERR;
 		do {
 			do {
-				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
-				fs->win[i] ^= bm;	/* Flip the bit */
-				fs->wflag = 1;
+				if (bv == (int)((p[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
+				p[i] ^= bm;	/* Flip the bit */
+				fat_dirty(fs);
 				if (--ncl == 0) return FR_OK;	/* All bits processed? */
 			} while (bm <<= 1);		/* Next bit */
 			bm = 1;
@@ -1439,6 +1729,336 @@ static FRESULT fill_last_frag (
 
 
 
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free extent map                                        */
+/*-----------------------------------------------------------------------*/
+
+static int test_free (	/* 1:Free, 0:In use, -1:Disk error */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst		/* Cluster# to test */
+)
+{
+	FFOBJID obj;
+	DWORD val;
+#if FF_FS_EXFAT
+	BYTE *p;
+
+
+	if (fs->fs_type == FS_EXFAT) {	/* The allocation bitmap tells it */
+		clst -= 2;
+		if ((p = fat_window(fs, fs->bitbase + clst / 8 / SS(fs))) == 0) return -1;
+		return (p[clst / 8 % SS(fs)] & (1 << (clst % 8))) ? 0 : 1;
+	}
+#endif
+	obj.fs = fs;
+	val = get_fat(&obj, clst);
+	if (val == 0xFFFFFFFF) return -1;
+	return (val == 0) ? 1 : 0;
+}
+
+
+#if FF_FREE_EXTENTS
+
+static void reset_extents (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	fs->fxstat = 0; fs->fxcnt = 0; fs->fxscan = 0;
+}
+
+
+static UINT index_extent (	/* Number of extents starting at or before the cluster */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst		/* Cluster# to look up */
+)
+{
+	UINT lo = 0, hi = fs->fxcnt, i;
+
+
+	while (lo < hi) {	/* Binary search on the start clusters */
+		i = (lo + hi) / 2;
+		if (fs->fxs[i] <= clst) lo = i + 1; else hi = i;
+	}
+	return lo;
+}
+
+
+static void insert_extent (
+	FATFS* fs,		/* Filesystem object */
+	UINT i,			/* Index to insert at (the map must not be full) */
+	DWORD scl,		/* Start cluster */
+	DWORD ncl		/* Number of clusters */
+)
+{
+	UINT j;
+
+
+	for (j = fs->fxcnt; j > i; j--) {
+		fs->fxs[j] = fs->fxs[j - 1]; fs->fxn[j] = fs->fxn[j - 1];
+	}
+	fs->fxs[i] = scl; fs->fxn[i] = ncl;
+	fs->fxcnt++;
+}
+
+
+static void delete_extent (
+	FATFS* fs,		/* Filesystem object */
+	UINT i			/* Index of the extent to delete */
+)
+{
+	for (fs->fxcnt--; i < fs->fxcnt; i++) {
+		fs->fxs[i] = fs->fxs[i + 1]; fs->fxn[i] = fs->fxn[i + 1];
+	}
+}
+
+
+static UINT fit_extent (	/* Index of the smallest extent with at least want clusters, fxcnt if there is none */
+	FATFS* fs,		/* Filesystem object */
+	DWORD want		/* Number of clusters wanted */
+)
+{
+	UINT i, b = fs->fxcnt;
+
+
+	for (i = 0; i < fs->fxcnt; i++) {
+		if (fs->fxn[i] >= want && (b == fs->fxcnt || fs->fxn[i] < fs->fxn[b])) b = i;
+	}
+	return b;
+}
+
+
+static UINT largest_extent (	/* Index of the largest extent, fxcnt if the map is empty */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT i, b = fs->fxcnt;
+
+
+	for (i = 0; i < fs->fxcnt; i++) {
+		if (b == fs->fxcnt || fs->fxn[i] > fs->fxn[b]) b = i;
+	}
+	return b;
+}
+
+
+static void add_extent (
+	FATFS* fs,		/* Filesystem object */
+	DWORD scl,		/* Start cluster of the free block */
+	DWORD ncl		/* Number of clusters in the free block */
+)
+{
+	UINT i, j, k;
+	DWORD ecl = scl + ncl;
+
+
+	if (ncl == 0) return;
+	i = index_extent(fs, scl);
+	if (i > 0 && fs->fxs[i - 1] + fs->fxn[i - 1] >= scl) {	/* Does it overlap or touch the previous extent? */
+		i--;
+		scl = fs->fxs[i];
+		if (fs->fxs[i] + fs->fxn[i] > ecl) ecl = fs->fxs[i] + fs->fxn[i];
+	}
+	for (j = i; j < fs->fxcnt && fs->fxs[j] <= ecl; j++) {	/* Absorb the following extents it overlaps or touches */
+		if (fs->fxs[j] + fs->fxn[j] > ecl) ecl = fs->fxs[j] + fs->fxn[j];
+	}
+	if (j > i) {	/* Merged into existing extents */
+		fs->fxs[i] = scl; fs->fxn[i] = ecl - scl;
+		while (--j > i) delete_extent(fs, i + 1);
+		return;
+	}
+	if (fs->fxcnt == FF_FREE_EXTENTS) {	/* The map is full, the smallest extent gets forgotten */
+		fs->fxstat &= ~FX_ALL;
+		k = 0;
+		for (j = 1; j < fs->fxcnt; j++) {
+			if (fs->fxn[j] < fs->fxn[k]) k = j;
+		}
+		if (fs->fxn[k] >= ecl - scl) return;	/* Is the new one the smallest? */
+		delete_extent(fs, k);
+		if (k < i) i--;
+	}
+	insert_extent(fs, i, scl, ecl - scl);
+}
+
+
+static void remove_extent (
+	FATFS* fs,		/* Filesystem object */
+	DWORD scl,		/* Start cluster of the block which is not free anymore */
+	DWORD ncl		/* Number of clusters in the block */
+)
+{
+	UINT i;
+	DWORD ecl = scl + ncl, s, e;
+
+
+	i = index_extent(fs, scl);
+	if (i > 0) i--;	/* The previous extent can overlap it */
+	while (i < fs->fxcnt && fs->fxs[i] < ecl) {
+		s = fs->fxs[i]; e = s + fs->fxn[i];
+		if (e <= scl) {	/* Not overlapped */
+			i++; continue;
+		}
+		if (s < scl && e > ecl) {	/* Split the extent in two */
+			fs->fxn[i] = scl - s;
+			if (fs->fxcnt < FF_FREE_EXTENTS) {
+				insert_extent(fs, i + 1, ecl, e - ecl);
+			} else {	/* No room for the second one, keep the larger piece */
+				fs->fxstat &= ~FX_ALL;
+				if (e - ecl > scl - s) {
+					fs->fxs[i] = ecl; fs->fxn[i] = e - ecl;
+				}
+			}
+			return;
+		}
+		if (s < scl) {	/* Clip the tail */
+			fs->fxn[i] = scl - s;
+			i++; continue;
+		}
+		if (e > ecl) {	/* Clip the head */
+			fs->fxs[i] = ecl; fs->fxn[i] = e - ecl;
+			return;
+		}
+		delete_extent(fs, i);	/* Entirely allocated */
+	}
+}
+
+
+static FRESULT fill_extents (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	DWORD want		/* Number of clusters wanted, the scan stops when a free block this large is found */
+)
+{
+	DWORD clst, scl, ecl, end;
+	UINT pass;
+
+
+	clst = fs->fxscan;
+	if (clst < 2 || clst >= fs->n_fatent) {	/* First scan after mount starts around the last allocation */
+		clst = fs->last_clst;
+		if (clst < 2 || clst >= fs->n_fatent) clst = 2;
+	}
+	fs->fxstat |= FX_ALL;	/* Tentatively, it gets cleared by any extent forgotten during the scan */
+	for (pass = 0; pass < 2; pass++) {	/* Up to one full pass, from there to the end and then from the top */
+		scl = pass ? 2 : clst; end = pass ? clst : fs->n_fatent;
+		while (scl < end) {
+			scl = find_state(fs, scl, end, 1);	/* Start of the next free block */
+			if (scl == 0xFFFFFFFF) return FR_DISK_ERR;
+			if (scl == end) break;
+			ecl = find_state(fs, scl, (want < end - scl) ? scl + want : end, 0);	/* End of the block (a fitting one needs not be followed further) */
+			if (ecl == 0xFFFFFFFF) return FR_DISK_ERR;
+			add_extent(fs, scl, ecl - scl);
+			if (ecl - scl >= want) {	/* Found one, leave the rest of the volume for later */
+				fs->fxscan = ecl;
+				fs->fxstat &= ~FX_ALL;
+				return FR_OK;
+			}
+			scl = ecl;
+		}
+	}
+	fs->fxscan = clst;
+	fs->fxstat |= FX_TOP;	/* Only the smallest extents get forgotten, the largest ones are all in the map now */
+	return FR_OK;
+}
+
+
+static DWORD find_free (	/* 0:No free cluster, 0xFFFFFFFF:Disk error, 2..:Free cluster (taken from the map) */
+	FFOBJID* obj,	/* Corresponding object */
+	DWORD clst,		/* Cluster# to stretch, 0:Create a new chain */
+	DWORD want		/* Number of clusters wanted */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD ncl;
+	UINT i;
+	int st;
+
+
+	if (want == 0) want = 1;
+	if (clst != 0 && clst + 1 < fs->n_fatent) {	/* Keep the chain contiguous if the next cluster is free */
+		st = test_free(fs, clst + 1);
+		if (st < 0) return 0xFFFFFFFF;
+		if (st) {
+			remove_extent(fs, clst + 1, 1);
+			return clst + 1;
+		}
+	}
+	for (;;) {
+		i = fit_extent(fs, want);	/* Best fit */
+		if ((i == fs->fxcnt && !(fs->fxstat & FX_TOP)) || (fs->fxcnt == 0 && !(fs->fxstat & FX_ALL))) {	/* Could the volume have better? */
+			if (fill_extents(fs, want) != FR_OK) return 0xFFFFFFFF;
+			i = fit_extent(fs, want);
+		}
+		if (i == fs->fxcnt) i = largest_extent(fs);	/* Nothing fits, take as much as can be contiguous */
+		if (i == fs->fxcnt) return 0;	/* No free cluster */
+		ncl = fs->fxs[i];
+		remove_extent(fs, ncl, 1);
+		st = test_free(fs, ncl);	/* The map is only a hint, the FAT has the final say */
+		if (st < 0) return 0xFFFFFFFF;
+		if (st) return ncl;
+	}
+}
+
+#else	/* The FAT is scanned for every new cluster */
+
+#define reset_extents(fs)
+
+static DWORD find_free (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, 2..:Free cluster */
+	FFOBJID* obj,	/* Corresponding object */
+	DWORD clst,		/* Cluster# to stretch, 0:Create a new chain */
+	DWORD want		/* Number of clusters wanted (not used) */
+)
+{
+	DWORD cs, ncl, scl;
+	FATFS *fs = obj->fs;
+
+
+	(void)want;
+	if (clst == 0) {	/* Create a new chain */
+		scl = fs->last_clst;				/* Suggested cluster to start to find */
+		if (scl == 0 || scl >= fs->n_fatent) scl = 1;
+	} else {			/* Stretch a chain */
+		scl = clst;							/* Cluster to start to find */
+	}
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		return find_bitmap(fs, scl, 1);
+	}
+#endif
+	ncl = 0;
+	if (scl == clst) {						/* Stretching an existing chain? */
+		ncl = scl + 1;						/* Test if next cluster is free */
+		if (ncl >= fs->n_fatent) ncl = 2;
+		cs = get_fat(obj, ncl);				/* Get next cluster status */
+		if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+		if (cs != 0) {						/* Not free? */
+			cs = fs->last_clst;				/* Start at suggested cluster if it is valid */
+			if (cs >= 2 && cs < fs->n_fatent) scl = cs;
+			ncl = 0;
+		}
+	}
+	if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
+		ncl = scl;	/* Start cluster */
+		for (;;) {
+			ncl++;							/* Next cluster */
+			if (ncl >= fs->n_fatent) {		/* Check wrap-around */
+				ncl = 2;
+				if (ncl > scl) return 0;	/* No free cluster found? */
+			}
+			cs = get_fat(obj, ncl);			/* Get the cluster status */
+			if (cs == 0) break;				/* Found a free cluster? */
+			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+			if (ncl == scl) return 0;		/* No free cluster found? */
+		}
+	}
+	return ncl;
+}
+
+#endif	/* FF_FREE_EXTENTS */
+#endif	/* !FF_FS_READONLY */
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
@@ -1453,7 +2073,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res = FR_OK;
 	DWORD nxt;
 	FATFS *fs = obj->fs;
-#if FF_FS_EXFAT || FF_USE_TRIM
+#if FF_FS_EXFAT || FF_USE_TRIM || FF_FREE_EXTENTS
 	DWORD scl = clst, ecl = clst;
 #endif
 #if FF_USE_TRIM
@@ -1481,8 +2101,10 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 		if (fs->free_clst < fs->n_fatent - 2) {	/* Update FSINFO */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
+		} else if (fs->free_clst > fs->n_fatent - 2 && clst < fs->scan_clst) {	/* Keep the count in progress in step */
+			fs->scan_free++;
 		}
-#if FF_FS_EXFAT || FF_USE_TRIM
+#if FF_FS_EXFAT || FF_USE_TRIM || FF_FREE_EXTENTS
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
 		} else {				/* End of contiguous cluster block */
@@ -1492,6 +2114,9 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 				if (res != FR_OK) return res;
 			}
 #endif
+#if FF_FREE_EXTENTS
+			add_extent(fs, scl, ecl - scl + 1);	/* The block can be allocated from the map again */
+#endif
 #if FF_USE_TRIM
 			rt[0] = clst2sect(fs, scl);					/* Start of data area to be freed */
 			rt[1] = clst2sect(fs, ecl) + fs->csize - 1;	/* End of data area to be freed */
@@ -1541,39 +2166,36 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
 	FFOBJID* obj,		/* Corresponding object */
-	DWORD clst			/* Cluster# to stretch, 0:Create a new chain */
+	DWORD clst,			/* Cluster# to stretch, 0:Create a new chain */
+	DWORD want			/* Number of clusters the caller is going to need from here (placement hint) */
 )
 {
-	DWORD cs, ncl, scl;
+	DWORD cs, ncl;
 	FRESULT res;
 	FATFS *fs = obj->fs;
 
 
-	if (clst == 0) {	/* Create a new chain */
-		scl = fs->last_clst;				/* Suggested cluster to start to find */
-		if (scl == 0 || scl >= fs->n_fatent) scl = 1;
-	}
-	else {				/* Stretch a chain */
+	if (clst != 0) {	/* Stretch a chain */
 		cs = get_fat(obj, clst);			/* Check the cluster status */
 		if (cs < 2) return 1;				/* Test for insanity */
 		if (cs == 0xFFFFFFFF) return cs;	/* Test for disk error */
 		if (cs < fs->n_fatent) return cs;	/* It is already followed by next cluster */
-		scl = clst;							/* Cluster to start to find */
 	}
 	if (fs->free_clst == 0) return 0;		/* No free cluster */
 
+	ncl = find_free(obj, clst, want);		/* Find a free cluster */
+	if (ncl < 2 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or error? */
+
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		ncl = find_bitmap(fs, scl, 1);				/* Find a free cluster */
-		if (ncl == 0 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or hard error? */
 		res = change_bitmap(fs, ncl, 1, 1);			/* Mark the cluster 'in use' */
 		if (res == FR_INT_ERR) return 1;
 		if (res == FR_DISK_ERR) return 0xFFFFFFFF;
 		if (clst == 0) {							/* Is it a new chain? */
 			obj->stat = 2;							/* Set status 'contiguous' */
 		} else {									/* It is a stretched chain */
-			if (obj->stat == 2 && ncl != scl + 1) {	/* Is the chain got fragmented? */
-				obj->n_cont = scl - obj->sclust;	/* Set size of the contiguous part */
+			if (obj->stat == 2 && ncl != clst + 1) {	/* Is the chain got fragmented? */
+				obj->n_cont = clst - obj->sclust;	/* Set size of the contiguous part */
 				obj->stat = 3;						/* Change status 'just fragmented' */
 			}
 		}
@@ -1589,32 +2211,6 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	} else
 #endif
 	{	/* On the FAT/FAT32 volume */
-		ncl = 0;
-		if (scl == clst) {						/* Stretching an existing chain? */
-			ncl = scl + 1;						/* Test if next cluster is free */
-			if (ncl >= fs->n_fatent) ncl = 2;
-			cs = get_fat(obj, ncl);				/* Get next cluster status */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
-			if (cs != 0) {						/* Not free? */
-				cs = fs->last_clst;				/* Start at suggested cluster if it is valid */
-				if (cs >= 2 && cs < fs->n_fatent) scl = cs;
-				ncl = 0;
-			}
-		}
-		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
-			ncl = scl;	/* Start cluster */
-			for (;;) {
-				ncl++;							/* Next cluster */
-				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-					ncl = 2;
-					if (ncl > scl) return 0;	/* No free cluster found? */
-				}
-				cs = get_fat(obj, ncl);			/* Get the cluster status */
-				if (cs == 0) break;				/* Found a free cluster? */
-				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
-				if (ncl == scl) return 0;		/* No free cluster found? */
-			}
-		}
 		res = put_fat(fs, ncl, 0xFFFFFFFF);		/* Mark the new cluster 'EOC' */
 		if (res == FR_OK && clst != 0) {
 			res = put_fat(fs, clst, ncl);		/* Link it from the previous one if needed */
@@ -1623,7 +2219,11 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 
 	if (res == FR_OK) {			/* Update FSINFO if function succeeded. */
 		fs->last_clst = ncl;
-		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
+		if (fs->free_clst <= fs->n_fatent - 2) {
+			fs->free_clst--;
+		} else if (ncl < fs->scan_clst) {	/* Keep the count in progress in step */
+			fs->scan_free--;
+		}
 		fs->fsi_flag |= 1;
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
@@ -1667,6 +2267,85 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Get length of the cluster run at the current cluster   */
+/*-----------------------------------------------------------------------*/
+
+static DWORD follow_run (	/* Number of clusters following the current one in a row */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD ncl		/* Maximum number of clusters to look ahead */
+)
+{
+	DWORD clst = fp->clust, nxt, n;
+#if FF_FS_EXFAT
+	FATFS *fs = fp->obj.fs;
+	DWORD cofs, clen;
+
+
+	if (fp->obj.stat == 2) {	/* Contiguous file? (no need to look at the FAT) */
+		cofs = clst - fp->obj.sclust;	/* Offset from start cluster */
+		clen = (DWORD)((LBA_t)((fp->obj.objsize - 1) / SS(fs)) / fs->csize);	/* Number of clusters - 1 */
+		n = (cofs < clen) ? clen - cofs : 0;
+		return (n < ncl) ? n : ncl;
+	}
+#endif
+#if FF_USE_FASTSEEK
+	if (fp->cltbl) return 0;	/* The CLMT is looked up per cluster */
+#endif
+	for (n = 0; n < ncl; n++) {
+		nxt = get_fat(&fp->obj, clst);
+		if (nxt != clst + 1) break;	/* End of run, end of chain or error (caught by the next get_fat of the caller) */
+		clst = nxt;
+	}
+	return n;
+}
+
+
+
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch the cluster run from the current cluster       */
+/*-----------------------------------------------------------------------*/
+
+static DWORD stretch_run (	/* Number of clusters following the current one in a row */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD ncl		/* Number of clusters needed after the current one */
+)
+{
+	DWORD clst = fp->clust, nxt, n;
+	FSIZE_t objsize = fp->obj.objsize;
+	FATFS *fs = fp->obj.fs;
+#if FF_FS_EXFAT
+	FSIZE_t cofs = fp->fptr - fp->fptr % ((FSIZE_t)fs->csize * SS(fs));	/* Offset of the current cluster */
+#endif
+
+
+#if FF_USE_FASTSEEK
+	if (fp->cltbl) return 0;	/* The CLMT is looked up per cluster */
+#endif
+	for (n = 0; n < ncl; n++) {
+#if FF_FS_EXFAT
+		/* The end of a contiguous exFAT chain is told by the file size, which has to cover the cluster to stretch */
+		cofs += (FSIZE_t)fs->csize * SS(fs);
+		if (fp->obj.objsize < cofs) fp->obj.objsize = cofs;
+#endif
+		nxt = get_fat(&fp->obj, clst);	/* Next cluster in the chain */
+		if (nxt < 2 || nxt == 0xFFFFFFFF) break;	/* Error (caught by the next create_chain of the caller) */
+		if (nxt >= fs->n_fatent) {	/* End of the chain, it is stretched only onto a free neighbour */
+			if (clst + 1 >= fs->n_fatent || test_free(fs, clst + 1) != 1) break;	/* (a cluster elsewhere would be lost when the caller allocates the next one) */
+			nxt = create_chain(&fp->obj, clst, ncl - n);
+		}
+		if (nxt != clst + 1) break;	/* End of run, disk full or error */
+		clst = nxt;
+	}
+	fp->obj.objsize = objsize;	/* Restored, every cluster allocated here gets written by the caller */
+	return n;
+}
+#endif	/* !FF_FS_READONLY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Fill a cluster with zeros                        */
 /*-----------------------------------------------------------------------*/
@@ -1790,7 +2469,7 @@ static FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DEN
 					if (!stretch) {								/* If no stretch, report EOT */
 						dp->sect = 0; return FR_NO_FILE;
 					}
-					clst = create_chain(&dp->obj, dp->clust);	/* Allocate a cluster */
+					clst = create_chain(&dp->obj, dp->clust, 1);	/* Allocate a cluster */
 					if (clst == 0) return FR_DENIED;			/* No free cluster */
 					if (clst == 1) return FR_INT_ERR;			/* Internal error */
 					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
@@ -3297,6 +3976,10 @@ static UINT check_fs (	/* 0:FAT VBR, 1:exFAT VBR, 2:Valid BS but not FAT, 3:Inva
 )
 {
 	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+	fat_cache_reset(fs);							/* and the FAT cache */
+#if !FF_FS_READONLY
+	reset_extents(fs);								/* and the free extent map */
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot signature (always here regardless of the sector size) */
@@ -3436,6 +4119,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	if (fmt == 1) {
 		QWORD maxlba;
 		DWORD so, cv, bcl, i;
+		BYTE *fb;
 
 		for (i = BPB_ZeroedEx; i < BPB_ZeroedEx + 53 && fs->win[i] == 0; i++) ;	/* Check zero filler */
 		if (i < BPB_ZeroedEx + 53) return FR_NO_FILESYSTEM;
@@ -3483,8 +4167,8 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 		if (bcl < 2 || bcl >= fs->n_fatent) return FR_NO_FILESYSTEM;
 		fs->bitbase = fs->database + fs->csize * (bcl - 2);	/* Bitmap sector */
 		for (;;) {	/* Check if bitmap is contiguous */
-			if (move_window(fs, fs->fatbase + bcl / (SS(fs) / 4)) != FR_OK) return FR_DISK_ERR;
-			cv = ld_dword(fs->win + bcl % (SS(fs) / 4) * 4);
+			if ((fb = fat_window(fs, fs->fatbase + bcl / (SS(fs) / 4))) == 0) return FR_DISK_ERR;
+			cv = ld_dword(fb + bcl % (SS(fs) / 4) * 4);
 			if (cv == 0xFFFFFFFF) break;				/* Last link? */
 			if (cv != ++bcl) return FR_NO_FILESYSTEM;	/* Fragmented? */
 		}
@@ -3574,6 +4258,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	}
 
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type */
+#if !FF_FS_READONLY
+	fs->scan_clst = 2; fs->scan_free = 0;	/* Free clusters are not counted yet */
+#endif
 	fs->id = ++Fsid;		/* Volume mount ID */
 #if FF_USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
@@ -3894,6 +4581,7 @@ FRESULT f_read (
 	LBA_t sect;
 	FSIZE_t remain;
 	UINT rcnt, cc, csect;
+	DWORD ncl;
 	BYTE *rbuff = (BYTE*)buff;
 
 
@@ -3930,10 +4618,12 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Clip at the end of the cluster run */
+					ncl = follow_run(fp, (DWORD)((csect + cc - 1) / fs->csize));
+					if (csect + cc > (ncl + 1) * fs->csize) cc = (ncl + 1) * fs->csize - csect;
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				fp->clust += (csect + cc - 1) / fs->csize;	/* Cluster of the last sector read */
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if FF_FS_TINY
 				if (fs->wflag && fs->winsect - sect < cc) {
@@ -3994,6 +4684,7 @@ FRESULT f_write (
 	DWORD clst;
 	LBA_t sect;
 	UINT wcnt, cc, csect;
+	DWORD ncl;
 	const BYTE *wbuff = (const BYTE*)buff;
 
 
@@ -4015,7 +4706,7 @@ FRESULT f_write (
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
-						clst = create_chain(&fp->obj, 0);	/* create a new cluster chain */
+						clst = create_chain(&fp->obj, 0, (DWORD)((btw - 1) / ((DWORD)fs->csize * SS(fs))) + 1);	/* create a new cluster chain */
 					}
 				} else {					/* On the middle or end of the file */
 #if FF_USE_FASTSEEK
@@ -4024,7 +4715,7 @@ FRESULT f_write (
 					} else
 #endif
 					{
-						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+						clst = create_chain(&fp->obj, fp->clust, (DWORD)((btw - 1) / ((DWORD)fs->csize * SS(fs))) + 1);	/* Follow or stretch cluster chain on the FAT */
 					}
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
@@ -4046,10 +4737,12 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
 			if (cc > 0) {					/* Write maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Clip at the end of the cluster run (allocated as needed) */
+					ncl = stretch_run(fp, (DWORD)((csect + cc - 1) / fs->csize));
+					if (csect + cc > (ncl + 1) * fs->csize) cc = (ncl + 1) * fs->csize - csect;
 				}
 				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				fp->clust += (csect + cc - 1) / fs->csize;	/* Cluster of the last sector written */
 #if FF_FS_MINIMIZE <= 2
 #if FF_FS_TINY
 				if (fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -4176,6 +4869,29 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize the Volume                                                */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_syncvol (
+	const TCHAR* path	/* Logical drive number */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = mount_volume(&path, &fs, 0);	/* Get logical drive */
+	if (res == FR_OK) {
+		res = sync_fs(fs);	/* Write back the window and FSInfo, then flush the lower layer */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -4497,7 +5213,7 @@ FRESULT f_lseek (
 				clst = fp->obj.sclust;					/* start from the first cluster */
 #if !FF_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
-					clst = create_chain(&fp->obj, 0);
+					clst = create_chain(&fp->obj, 0, (DWORD)((ofs - 1) / bcs) + 1);
 					if (clst == 1) ABORT(fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					fp->obj.sclust = clst;
@@ -4514,7 +5230,7 @@ FRESULT f_lseek (
 							fp->obj.objsize = fp->fptr;
 							fp->flag |= FA_MODIFIED;
 						}
-						clst = create_chain(&fp->obj, clst);	/* Follow chain with forceed stretch */
+						clst = create_chain(&fp->obj, clst, (DWORD)((ofs - 1) / bcs) + 1);	/* Follow chain with forceed stretch */
 						if (clst == 0) {				/* Clip file size in case of disk full */
 							ofs = 0; break;
 						}
@@ -4782,6 +5498,80 @@ FRESULT f_stat (
 /* Get Number of Free Clusters                                           */
 /*-----------------------------------------------------------------------*/
 
+static FRESULT count_free (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* Filesystem object */
+	DWORD ncl		/* Number of clusters to count from fs->scan_clst at most, 0:all the rest */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD nfree, clst, stat;
+	UINT i, n, ns;
+	BYTE *p;
+	FFOBJID obj;
+
+
+	clst = fs->scan_clst;
+	if (clst < 2 || clst > fs->n_fatent) clst = 2;
+	if (ncl == 0 || ncl > fs->n_fatent - clst) ncl = fs->n_fatent - clst;
+	nfree = 0;
+	if (ncl != 0) {
+		if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
+			obj.fs = fs;
+			do {
+				stat = get_fat(&obj, clst);
+				if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (stat == 1) { res = FR_INT_ERR; break; }
+				if (stat == 0) nfree++;
+				clst++;
+			} while (--ncl);
+		} else {
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
+				while (ncl) {	/* Counts numbuer of bits with zero in the bitmap */
+					i = (clst - 2) / 8 % SS(fs);	/* Offset in the sector */
+					ns = (UINT)((i + (ncl + 7) / 8 + SS(fs) - 1) / SS(fs));	/* Sectors the rest of the count spans */
+					if ((p = fat_window_run(fs, fs->bitbase + (clst - 2) / 8 / SS(fs), &ns)) == 0) { res = FR_DISK_ERR; break; }
+					if ((clst - 2) % 8 == 0 && ncl >= 8) {	/* Whole bytes up to the end of the loaded sectors */
+						n = ncl / 8;
+						if (n > ns * SS(fs) - i) n = ns * SS(fs) - i;
+						nfree += count_bit(p, i, i + n);
+						clst += n * 8; ncl -= n * 8;
+					} else {	/* Bits up to the byte boundary */
+						do {
+							if (!((p[i] >> ((clst - 2) % 8)) & 1)) nfree++;
+							clst++;
+						} while (--ncl && (clst - 2) % 8 != 0);
+					}
+				}
+			} else
+#endif
+			{	/* FAT16/32: Scan WORD/DWORD FAT entries */
+				UINT es = (fs->fs_type == FS_FAT16) ? 2 : 4;	/* Size of an entry */
+
+				while (ncl) {	/* Counts numbuer of entries with zero in the FAT */
+					i = clst % (SS(fs) / es) * es;	/* Offset in the sector */
+					ns = (UINT)((i / es + ncl + SS(fs) / es - 1) / (SS(fs) / es));	/* Sectors the rest of the count spans */
+					if ((p = fat_window_run(fs, fs->fatbase + clst / (SS(fs) / es), &ns)) == 0) { res = FR_DISK_ERR; break; }
+					n = ns * (SS(fs) / es) - i / es;	/* Entries up to the end of the loaded sectors */
+					if (n > ncl) n = ncl;
+					nfree += count_ent(p, i, i + n * es, es);
+					clst += n; ncl -= n;
+				}
+			}
+		}
+	}
+	if (res == FR_OK) {
+		fs->scan_free += nfree;
+		fs->scan_clst = clst;
+		if (clst >= fs->n_fatent) {	/* Has the whole volume been counted? */
+			fs->free_clst = fs->scan_free;	/* Now free_clst is valid */
+			fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
+		}
+	}
+	return res;
+}
+
+
 FRESULT f_getfree (
 	const TCHAR* path,	/* Logical drive number */
 	DWORD* nclst,		/* Pointer to a variable to return number of free clusters */
@@ -4790,75 +5580,46 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD nfree, clst, stat;
-	LBA_t sect;
-	UINT i;
-	FFOBJID obj;
 
 
 	/* Get logical drive */
 	res = mount_volume(&path, &fs, 0);
 	if (res == FR_OK) {
 		*fatfs = fs;				/* Return ptr to the fs object */
-		/* If free_clst is valid, return it without full FAT scan */
-		if (fs->free_clst <= fs->n_fatent - 2) {
-			*nclst = fs->free_clst;
-		} else {
-			/* Scan FAT to obtain number of free clusters */
-			nfree = 0;
-			if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
-				clst = 2; obj.fs = fs;
-				do {
-					stat = get_fat(&obj, clst);
-					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) nfree++;
-				} while (++clst < fs->n_fatent);
-			} else {
-#if FF_FS_EXFAT
-				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
-					BYTE bm;
-					UINT b;
-
-					clst = fs->n_fatent - 2;	/* Number of clusters */
-					sect = fs->bitbase;			/* Bitmap sector */
-					i = 0;						/* Offset in the sector */
-					do {	/* Counts numbuer of bits with zero in the bitmap */
-						if (i == 0) {
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
-							if (!(bm & 1)) nfree++;
-							bm >>= 1;
-						}
-						i = (i + 1) % SS(fs);
-					} while (clst);
-				} else
-#endif
-				{	/* FAT16/32: Scan WORD/DWORD FAT entries */
-					clst = fs->n_fatent;	/* Number of entries */
-					sect = fs->fatbase;		/* Top of the FAT */
-					i = 0;					/* Offset in the sector */
-					do {	/* Counts numbuer of entries with zero in the FAT */
-						if (i == 0) {
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						if (fs->fs_type == FS_FAT16) {
-							if (ld_word(fs->win + i) == 0) nfree++;
-							i += 2;
-						} else {
-							if ((ld_dword(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;
-							i += 4;
-						}
-						i %= SS(fs);
-					} while (--clst);
-				}
+		/* If free_clst is not valid, count the rest of the volume (picking up where f_scanfree left off) */
+		if (fs->free_clst > fs->n_fatent - 2) res = count_free(fs, 0);
+		if (res == FR_OK) *nclst = fs->free_clst;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+FRESULT f_scanfree (
+	const TCHAR* path,	/* Logical drive number */
+	DWORD ncl,			/* Number of clusters to count at most in this call, 0:count all the rest */
+	DWORD* nclst,		/* Pointer to return number of free clusters, estimated from the part counted so far if the count is not complete */
+	BYTE* exact			/* Pointer to return 1 if *nclst is exact, 0 if it is an estimation */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD done;
+
+
+	/* Get logical drive */
+	res = mount_volume(&path, &fs, 0);
+	if (res == FR_OK) {
+		if (fs->free_clst > fs->n_fatent - 2) res = count_free(fs, ncl);	/* Count another part */
+		if (res == FR_OK) {
+			if (fs->free_clst <= fs->n_fatent - 2) {	/* Exact number is known */
+				*nclst = fs->free_clst; *exact = 1;
+			} else {	/* Extrapolate the part counted so far to the rest of the volume */
+				done = fs->scan_clst - 2;
+				*nclst = fs->scan_free;
+				if (done != 0) *nclst += (DWORD)((QWORD)fs->scan_free * (fs->n_fatent - fs->scan_clst) / done);
+				*exact = 0;
 			}
-			*nclst = nfree;			/* Return the free clusters */
-			fs->free_clst = nfree;	/* Now free_clst is valid */
-			fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
 		}
 	}
 
@@ -5039,7 +5800,7 @@ FRESULT f_mkdir (
 		}
 		if (res == FR_NO_FILE) {				/* It is clear to create a new directory */
 			sobj.fs = fs;						/* New object id to create a new chain */
-			dcl = create_chain(&sobj, 0);		/* Allocate a cluster for the new directory */
+			dcl = create_chain(&sobj, 0, 1);		/* Allocate a cluster for the new directory */
 			res = FR_OK;
 			if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster? */
 			if (dcl == 1) res = FR_INT_ERR;		/* Any insanity? */
@@ -5586,6 +6347,9 @@ FRESULT f_expand (
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
+#if FF_FREE_EXTENTS
+			remove_extent(fs, scl, tcl);	/* Not free anymore */
+#endif
 			fp->obj.sclust = scl;		/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
@@ -5593,6 +6357,8 @@ FRESULT f_expand (
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
+			} else if (scl < fs->scan_clst) {	/* Keep the count in progress in step */
+				fs->scan_free -= ((scl + tcl < fs->scan_clst) ? scl + tcl : fs->scan_clst) - scl;
 			}
 		}
 	}
@@ -153,6 +153,15 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+	DWORD	scan_clst;		/* Next cluster to be counted while free_clst is not valid yet */
+	DWORD	scan_free;		/* Number of free clusters counted below scan_clst */
+#if FF_FREE_EXTENTS
+	BYTE	fxstat;			/* Free extent map status (b0:holds every free cluster, b1:holds the largest free extents) */
+	UINT	fxcnt;			/* Number of extents in the free extent map */
+	DWORD	fxscan;			/* Cluster to resume scanning for free extents from (0:not started) */
+	DWORD	fxs[FF_FREE_EXTENTS];	/* Start cluster of each free extent (ascending order) */
+	DWORD	fxn[FF_FREE_EXTENTS];	/* Number of clusters in each free extent */
+#endif
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -173,6 +182,14 @@ typedef struct {
 #endif
 	LBA_t	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
+#if FF_FAT_CACHE
+	UINT	fcidx;			/* FAT cache slot accessed last */
+	DWORD	fcstamp;		/* FAT cache access counter */
+	LBA_t	fcsect[FF_FAT_CACHE / FF_MIN_SS];	/* Sector held in each FAT cache slot (-1:empty) */
+	DWORD	fcuse[FF_FAT_CACHE / FF_MIN_SS];	/* Last access of each FAT cache slot (0:empty) */
+	BYTE	fcflag[FF_FAT_CACHE / FF_MIN_SS];	/* FAT cache slot flags (b0:dirty, b1:2nd FAT copy pending) */
+	BYTE	fcbuf[FF_FAT_CACHE];	/* FAT/bitmap sector cache */
+#endif
 } FATFS;
 
 
@@ -308,6 +325,7 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_syncvol (const TCHAR* path);								/* Flush cached data of the volume */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
@@ -323,6 +341,7 @@ FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT f_scanfree (const TCHAR* path, DWORD ncl, DWORD* nclst, BYTE* exact);	/* Count free clusters a part at a time and get the number so far */
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
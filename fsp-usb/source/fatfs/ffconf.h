@@ -210,7 +210,7 @@
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -260,6 +260,28 @@
 */
 
 
+#define FF_FAT_CACHE	16384
+/* This option sets the size of a sector cache, in bytes, which holds the FAT and
+/  allocation bitmap sectors apart from the directory window in the filesystem
+/  object, so that cluster chain walks and allocations do not keep evicting the
+/  directory sector and vice versa. Dirty sectors are written back together in
+/  ascending order, followed by their copies in the 2nd FAT. It must be a
+/  multiple of FF_MAX_SS and at least twice of it. 0 disables the cache and the
+/  FAT is accessed through the window as before.
+*/
+
+
+#define FF_FREE_EXTENTS	64
+/* This option sets the number of free cluster extents kept in memory per volume
+/  to allocate clusters from, instead of scanning the FAT or allocation bitmap
+/  for every new cluster chain. The map is filled lazily by a resumable scan and
+/  allocations take the smallest extent that fits the size the caller is going
+/  to write, so the time to allocate does not depend on how full or fragmented
+/  the volume is. 0 disables the map and the FAT is scanned as before. This
+/  option has no effect in read-only configuration (FF_FS_READONLY = 1).
+*/
+
+
 #define FF_FS_LOCK		64
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
@@ -14,11 +14,18 @@ namespace fspusb {
                 return impl::IsDriveInterfaceIdValid(this->usb_iface_id);
             }
 
+            /* Same as DriveFile, FatFs calls must not run alongside the drive's background work */
+            void DoWithDriveFATFS(std::function<void(FATFS*)> fn) {
+                impl::DoWithDriveFATFS(this->usb_iface_id, fn);
+            }
+
         public:
             DriveDirectory(s32 iface_id, DIR dir) : usb_iface_id(iface_id), directory(dir) {}
 
             ~DriveDirectory() {
-                f_closedir(&this->directory);
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    f_closedir(&this->directory);
+                });
             }
 
             virtual ams::Result ReadImpl(s64 *out_count, ams::fs::DirectoryEntry *out_entries, s64 max_entries) override final {
@@ -32,7 +39,10 @@ namespace fspusb {
                     if(count >= max_entries) {
                         break;
                     }
-                    ffrc = f_readdir(&this->directory, &info);
+                    ffrc = FR_NOT_READY;
+                    this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                        ffrc = f_readdir(&this->directory, &info);
+                    });
                     if((ffrc != FR_OK) || (info.fname[0] == '\0')) {
                         break;
                     }
@@ -61,7 +71,10 @@ namespace fspusb {
                 auto ffrc = FR_OK;
                 FILINFO info = {};
                 while(true) {
-                    ffrc = f_readdir(&this->directory, &info);
+                    ffrc = FR_NOT_READY;
+                    this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                        ffrc = f_readdir(&this->directory, &info);
+                    });
                     if((ffrc != FR_OK) || (info.fname[0] == '\0')) {
                         break;
                     }
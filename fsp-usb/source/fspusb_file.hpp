@@ -9,27 +9,38 @@ namespace fspusb {
         private:
             s32 usb_iface_id;
             FIL file;
+            impl::ReadAheadCache read_ahead;
 
             bool IsDriveInterfaceIdValid() {
                 return impl::IsDriveInterfaceIdValid(this->usb_iface_id);
             }
 
+            /* FatFs isn't reentrant, and the drive's background work (e.g. counting free clusters) uses the same volume from another thread */
+            void DoWithDriveFATFS(std::function<void(FATFS*)> fn) {
+                impl::DoWithDriveFATFS(this->usb_iface_id, fn);
+            }
+
         public:
-            DriveFile(s32 iface_id, FIL fil) : usb_iface_id(iface_id), file(fil) {}
+            DriveFile(s32 iface_id, FIL fil, u32 read_ahead_size) : usb_iface_id(iface_id), file(fil), read_ahead(read_ahead_size) {}
 
             ~DriveFile() {
-                f_close(&this->file);
+                auto &counters = this->read_ahead.GetCounters();
+                FSP_USB_LOG("%s (interface ID %d): read-ahead hit bytes -> %lu | direct bytes -> %lu | read-ahead bytes -> %lu (%lu reads) | stream resets -> %lu.", __func__, this->usb_iface_id, counters.hit_bytes, counters.direct_bytes, counters.read_ahead_bytes, counters.read_aheads, counters.stream_resets);
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    f_close(&this->file);
+                });
             }
 
             virtual ams::Result ReadImpl(size_t *out, s64 offset, void *buffer, size_t size, const ams::fs::ReadOption &option) override final {
                 R_UNLESS(this->IsDriveInterfaceIdValid(), ResultDriveUnavailable());
 
-                auto ffrc = f_lseek(&this->file, (u64)offset);
-                if (ffrc == FR_OK) {
-                    UINT btr = (UINT)size, br = 0;
-                    ffrc = f_read(&this->file, buffer, btr, &br);
-                    if (ffrc == FR_OK) *out = (size_t)br;
-                }
+                // Sequential reads are served from a read-ahead window once they're detected
+                u32 br = 0;
+                auto ffrc = FR_NOT_READY;
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    ffrc = this->read_ahead.Read(&this->file, (u64)offset, (u8*)buffer, (u32)size, &br);
+                });
+                if (ffrc == FR_OK) *out = (size_t)br;
 
                 return result::CreateFromFRESULT(ffrc);
             }
@@ -44,19 +55,32 @@ namespace fspusb {
 
             virtual ams::Result FlushImpl() override final {
                 R_UNLESS(this->IsDriveInterfaceIdValid(), ResultDriveUnavailable());
-                return ams::ResultSuccess();
+
+                // Writes back FatFs' cached data and the directory entry, then flushes the drive's write cache
+                auto ffrc = FR_NOT_READY;
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    ffrc = f_sync(&this->file);
+                });
+
+                return result::CreateFromFRESULT(ffrc);
             }
 
             virtual ams::Result WriteImpl(s64 offset, const void *buffer, size_t size, const ams::fs::WriteOption &option) override final {
                 R_UNLESS(this->IsDriveInterfaceIdValid(), ResultDriveUnavailable());
 
-                auto ffrc = f_lseek(&this->file, (u64)offset);
-                if (ffrc == FR_OK) {
-                    UINT btw = (UINT)size, bw = 0;
-                    ffrc = f_write(&this->file, buffer, btw, &bw);
-                }
+                this->read_ahead.Invalidate();
+                
+                auto ffrc = FR_NOT_READY;
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    ffrc = f_lseek(&this->file, (u64)offset);
+                    if (ffrc == FR_OK) {
+                        UINT btw = (UINT)size, bw = 0;
+                        ffrc = f_write(&this->file, buffer, btw, &bw);
+                    }
+
+                    if (ffrc == FR_OK && option.HasFlushFlag()) ffrc = f_sync(&this->file);
+                });
 
-                // We ignore the flush flag since everything is written right away
                 return result::CreateFromFRESULT(ffrc);
             }
 
@@ -65,12 +89,17 @@ namespace fspusb {
 
                 u64 new_size = (u64)size;
                 u64 cur_size = f_size(&this->file);
+                
+                this->read_ahead.Invalidate();
 
-                auto ffrc = f_lseek(&this->file, new_size);
+                auto ffrc = FR_NOT_READY;
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    ffrc = f_lseek(&this->file, new_size);
 
-                // f_lseek takes care of expanding the file if new_size > cur_size
-                // However, if new_size < cur_size, we must also call f_truncate
-                if (ffrc == FR_OK && new_size < cur_size) ffrc = f_truncate(&this->file);
+                    // f_lseek takes care of expanding the file if new_size > cur_size
+                    // However, if new_size < cur_size, we must also call f_truncate
+                    if (ffrc == FR_OK && new_size < cur_size) ffrc = f_truncate(&this->file);
+                });
 
                 return result::CreateFromFRESULT(ffrc);
             }
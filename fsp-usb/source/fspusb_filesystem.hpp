@@ -76,25 +76,28 @@ namespace fspusb {
             FRESULT GetSpaceImpl(s64 *out, bool totalSpace) {
                 u32 block_size = 0;
                 auto ffrc = FR_OK;
-                FATFS *fs = nullptr;
                 DWORD clstrs = 0;
+                DWORD csize = 0;
+                BYTE exact = 1;
                 
                 this->DoWithDrive([&](impl::DrivePointer &drive_ptr) {
                     block_size = drive_ptr->GetBlockSize();
                 });
                 
                 this->DoWithDriveFATFS([&](FATFS *fatfs) {
-                    ffrc = f_getfree(this->mount_name, &clstrs, &fs);
-                });
-                
-                if (ffrc == FR_OK && fs) {
+                    csize = fatfs->csize;
                     if (totalSpace) {
-                        // Calculate total space
-                        *out = ((s64)((fs->n_fatent - 2) * fs->csize) * (s64)block_size);
+                        // The total doesn't depend on what's allocated
+                        clstrs = fatfs->n_fatent - 2;
                     } else {
-                        // Calculate free space
-                        *out = ((s64)(clstrs * fs->csize) * (s64)block_size);
+                        // Counted in the background after mounting and kept up to date on every allocation, so this is O(1) once done (and an estimate before)
+                        ffrc = f_scanfree(this->mount_name, impl::DriveFreeSpaceScanClustersPerRound, &clstrs, &exact);
                     }
+                });
+                
+                if (ffrc == FR_OK) {
+                    if (!exact) FSP_USB_LOG("%s (interface ID %d): free cluster count not finished yet, reporting an estimate of %u clusters.", __func__, this->usb_iface_id, clstrs);
+                    *out = ((s64)clstrs * (s64)csize * (s64)block_size);
                 }
                 
                 return ffrc;
@@ -242,7 +245,12 @@ namespace fspusb {
                 });
 
                 if(ffrc == FR_OK) {
-                    *out_file = std::make_unique<DriveFile>(this->usb_iface_id, fil);
+                    u32 read_ahead_size = 0;
+                    this->DoWithDrive([&](impl::DrivePointer &drive_ptr) {
+                        read_ahead_size = drive_ptr->GetReadAheadSize();
+                    });
+                    
+                    *out_file = std::make_unique<DriveFile>(this->usb_iface_id, fil, read_ahead_size);
                 }
 
                 return result::CreateFromFRESULT(ffrc);
@@ -269,7 +277,14 @@ namespace fspusb {
 
             virtual ams::Result CommitImpl() override final {
                 R_UNLESS(this->IsDriveInterfaceIdValid(), ResultDriveUnavailable());
-                return ams::ResultSuccess();
+
+                auto ffrc = FR_OK;
+
+                this->DoWithDriveFATFS([&](FATFS *fatfs) {
+                    ffrc = f_syncvol(this->mount_name);
+                });
+
+                return result::CreateFromFRESULT(ffrc);
             }
 
             virtual ams::Result GetFreeSpaceSizeImpl(s64 *out, const char *path) override final {
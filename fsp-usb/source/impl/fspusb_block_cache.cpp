@@ -0,0 +1,182 @@
+#include "fspusb_block_cache.hpp"
+
+namespace fspusb::impl {
+
+    BlockCache::BlockCache() : buffer(nullptr), block_size(0), line_sectors(0), block_count(0), lru(), lines(), counters() {}
+
+    BlockCache::~BlockCache() {
+        this->Finalize();
+    }
+
+    bool BlockCache::Initialize(u32 block_sz, u64 block_cnt, u32 cache_size) {
+        this->Finalize();
+
+        u32 line_count = (cache_size / BlockCacheLineSize);
+        if(block_sz == 0 || block_sz > BlockCacheLineSize || (BlockCacheLineSize % block_sz) != 0 || block_cnt == 0 || line_count == 0) {
+            return false;
+        }
+
+        /* Not having a cache isn't fatal, the drive just gets every read */
+        this->buffer = new (std::nothrow) u8[(size_t)line_count * BlockCacheLineSize];
+        if(this->buffer == nullptr) {
+            return false;
+        }
+
+        this->block_size = block_sz;
+        this->line_sectors = (BlockCacheLineSize / block_sz);
+        this->block_count = block_cnt;
+        this->counters = {};
+
+        for(u32 i = 0; i < line_count; i++) {
+            this->lru.push_back({ UINT64_MAX, 0, this->buffer + ((size_t)i * BlockCacheLineSize) });
+        }
+
+        return true;
+    }
+
+    void BlockCache::Finalize() {
+        this->lines.clear();
+        this->lru.clear();
+
+        if(this->buffer != nullptr) {
+            delete[] this->buffer;
+            this->buffer = nullptr;
+        }
+    }
+
+    BlockCache::Line *BlockCache::Lookup(u64 index) {
+        auto it = this->lines.find(index);
+        if(it == this->lines.end()) {
+            return nullptr;
+        }
+
+        this->lru.splice(this->lru.begin(), this->lru, it->second);
+        return &*it->second;
+    }
+
+    BlockCache::Line *BlockCache::Fill(u64 index, const ReadFunction &read_fn) {
+        /* A line which is there but too short can't be anything but the last one, so it just gets read again */
+        auto it = this->lines.find(index);
+        if(it == this->lines.end()) {
+            it = this->lines.emplace(index, std::prev(this->lru.end())).first;
+
+            auto &victim = *it->second;
+            if(victim.index != UINT64_MAX) {
+                this->lines.erase(victim.index);
+                this->counters.evictions++;
+            }
+            victim.index = index;
+        }
+
+        auto line_it = it->second;
+        u64 first_sector = (index * this->line_sectors);
+        line_it->valid_sectors = (u32)std::min((u64)this->line_sectors, this->block_count - first_sector);
+
+        if(!read_fn(line_it->data, first_sector, line_it->valid_sectors)) {
+            this->Drop(line_it);
+            return nullptr;
+        }
+
+        this->lru.splice(this->lru.begin(), this->lru, line_it);
+        return &*line_it;
+    }
+
+    void BlockCache::Drop(std::list<Line>::iterator it) {
+        this->lines.erase(it->index);
+        it->index = UINT64_MAX;
+        it->valid_sectors = 0;
+        this->lru.splice(this->lru.end(), this->lru, it);
+    }
+
+    bool BlockCache::Read(u8 *out, u64 sector, u32 count, const ReadFunction &read_fn) {
+        /* Big reads and anything past the end (which the drive is going to refuse anyway) go straight through */
+        if(!this->IsEnabled() || count >= (this->line_sectors * BlockCacheBypassLines) || sector >= this->block_count || count > (this->block_count - sector)) {
+            this->counters.bypasses++;
+            return read_fn(out, sector, count);
+        }
+
+        while(count > 0) {
+            u64 index = (sector / this->line_sectors);
+            u32 offset = (u32)(sector % this->line_sectors);
+            u32 cur_count = std::min(count, this->line_sectors - offset);
+
+            Line *line = this->Lookup(index);
+            if(line != nullptr && (offset + cur_count) <= line->valid_sectors) {
+                this->counters.hits++;
+            } else {
+                this->counters.misses++;
+                line = this->Fill(index, read_fn);
+                if(line == nullptr) {
+                    return false;
+                }
+            }
+
+            memcpy(out, line->data + ((size_t)offset * this->block_size), (size_t)cur_count * this->block_size);
+
+            out += ((size_t)cur_count * this->block_size);
+            sector += cur_count;
+            count -= cur_count;
+        }
+
+        return true;
+    }
+
+    void BlockCache::Update(const u8 *data, u64 sector, u32 count) {
+        if(!this->IsEnabled()) {
+            return;
+        }
+
+        /* Written sectors which are cached get the new data, the rest isn't worth reading in */
+        while(count > 0) {
+            u64 index = (sector / this->line_sectors);
+            u32 offset = (u32)(sector % this->line_sectors);
+            u32 cur_count = std::min(count, this->line_sectors - offset);
+
+            auto it = this->lines.find(index);
+            if(it != this->lines.end() && offset < it->second->valid_sectors) {
+                u32 copy_count = std::min(cur_count, it->second->valid_sectors - offset);
+                memcpy(it->second->data + ((size_t)offset * this->block_size), data, (size_t)copy_count * this->block_size);
+            }
+
+            data += ((size_t)cur_count * this->block_size);
+            sector += cur_count;
+            count -= cur_count;
+        }
+    }
+
+    void BlockCache::Invalidate(u64 sector, u32 count) {
+        if(!this->IsEnabled() || count == 0) {
+            return;
+        }
+
+        u64 first = (sector / this->line_sectors);
+        u64 last = ((sector + count - 1) / this->line_sectors);
+
+        /* Huge ranges are cheaper to handle by going through the (small) cache instead */
+        if((last - first) >= this->lines.size()) {
+            for(auto it = this->lru.begin(); it != this->lru.end();) {
+                auto cur = it++;
+                if(cur->index != UINT64_MAX && cur->index >= first && cur->index <= last) {
+                    this->Drop(cur);
+                }
+            }
+            return;
+        }
+
+        for(u64 index = first; index <= last; index++) {
+            auto it = this->lines.find(index);
+            if(it != this->lines.end()) {
+                this->Drop(it->second);
+            }
+        }
+    }
+
+    void BlockCache::Clear() {
+        for(auto &line: this->lru) {
+            line.index = UINT64_MAX;
+            line.valid_sectors = 0;
+        }
+        this->lines.clear();
+    }
+
+}
@@ -0,0 +1,73 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+#include <list>
+#include <unordered_map>
+#include <functional>
+
+namespace fspusb::impl {
+
+    /* Lines are always this big, so they hold 8 sectors on 512-byte drives and a single one on 4Kn drives */
+    constexpr u32 BlockCacheLineSize = 0x1000;
+
+    /* Per drive, the whole sysmodule heap is only 1 MiB (and every USB interface has a 128 KiB transfer buffer already) */
+    constexpr u32 BlockCacheDefaultSize = 0x10000;
+
+    /* Reads spanning this many lines or more are file data, which would only push metadata out of the cache */
+    constexpr u32 BlockCacheBypassLines = 4;
+
+    struct BlockCacheCounters {
+        u64 hits;
+        u64 misses;
+        u64 bypasses;
+        u64 evictions;
+    };
+
+    /* Read cache in front of a drive, made of line-aligned groups of sectors with LRU replacement */
+    class BlockCache {
+
+        public:
+            /* Reads sectors straight from the drive */
+            using ReadFunction = std::function<bool(u8*, u64, u32)>;
+
+        private:
+            struct Line {
+                u64 index;
+                u32 valid_sectors; // Only less than a full line at the very end of the drive
+                u8 *data;
+            };
+
+            u8 *buffer;
+            u32 block_size;
+            u32 line_sectors;
+            u64 block_count;
+            std::list<Line> lru; // Most recently used first, unused lines at the back
+            std::unordered_map<u64, std::list<Line>::iterator> lines;
+            BlockCacheCounters counters;
+
+            Line *Lookup(u64 index);
+            Line *Fill(u64 index, const ReadFunction &read_fn);
+            void Drop(std::list<Line>::iterator it);
+
+        public:
+            BlockCache();
+            ~BlockCache();
+
+            bool Initialize(u32 block_sz, u64 block_cnt, u32 cache_size);
+            void Finalize();
+
+            bool Read(u8 *out, u64 sector, u32 count, const ReadFunction &read_fn);
+            void Update(const u8 *data, u64 sector, u32 count);
+            void Invalidate(u64 sector, u32 count);
+            void Clear();
+
+            bool IsEnabled() {
+                return this->buffer != nullptr;
+            }
+
+            const BlockCacheCounters &GetCounters() {
+                return this->counters;
+            }
+    };
+
+}
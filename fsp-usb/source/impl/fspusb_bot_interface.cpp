@@ -0,0 +1,23 @@
+#include "fspusb_bot_interface.hpp"
+#include "fspusb_request.hpp"
+
+namespace fspusb::impl {
+
+    BulkOnlyInterface::BulkOnlyInterface(UsbHsClientIfSession iface, UsbHsClientEpSession in_ep, UsbHsClientEpSession out_ep) : usb_interface(iface), usb_in_endpoint(in_ep), usb_out_endpoint(out_ep), buf_a(nullptr), buf_b(nullptr), buf_c(nullptr) {
+        this->buf_a = (u8*)AllocUSBTransferMemoryBlock(1);
+        this->buf_b = (u8*)AllocUSBTransferMemoryBlock(USB_TRANSFER_MEMORY_MAX_MULTIPLIER);
+        this->buf_c = (u8*)AllocUSBTransferMemoryBlock(1);
+    }
+
+    BulkOnlyInterface::~BulkOnlyInterface() {
+        FSP_USB_LOG("%s (interface ID %d): closing interface.", __func__, this->usb_interface.ID);
+        usbHsEpClose(&this->usb_in_endpoint);
+        usbHsEpClose(&this->usb_out_endpoint);
+        usbHsIfClose(&this->usb_interface);
+        
+        FreeUSBTransferMemoryBlock(this->buf_a);
+        FreeUSBTransferMemoryBlock(this->buf_b);
+        FreeUSBTransferMemoryBlock(this->buf_c);
+    }
+
+}
@@ -0,0 +1,52 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+
+namespace fspusb::impl {
+
+    /* A claimed Bulk-Only interface and its pipes, shared by the drives of every LUN behind it */
+    /* The usb:hs objects get closed along with the last drive using them */
+    /* Drive commands all run under the manager lock, so LUNs take turns per filesystem operation and there's a single CBW / data / CSW sequence on the pipes at any time */
+    /* That's also why the transfer buffers can be shared by every LUN instead of each drive having its own */
+    class BulkOnlyInterface {
+            NON_COPYABLE(BulkOnlyInterface);
+            NON_MOVEABLE(BulkOnlyInterface);
+
+        private:
+            UsbHsClientIfSession usb_interface;
+            UsbHsClientEpSession usb_in_endpoint;
+            UsbHsClientEpSession usb_out_endpoint;
+            u8 *buf_a; // Used to send SCSI commands
+            u8 *buf_b; // Used to send/receive data (split in SCSI_DATA_PIPELINE_DEPTH bounce slots)
+            u8 *buf_c; // Used to receive SCSI status
+
+        public:
+            BulkOnlyInterface(UsbHsClientIfSession iface, UsbHsClientEpSession in_ep, UsbHsClientEpSession out_ep);
+            ~BulkOnlyInterface();
+
+            UsbHsClientIfSession *GetInterface() {
+                return &this->usb_interface;
+            }
+
+            UsbHsClientEpSession *GetInEndpoint() {
+                return &this->usb_in_endpoint;
+            }
+
+            UsbHsClientEpSession *GetOutEndpoint() {
+                return &this->usb_out_endpoint;
+            }
+
+            u8 *GetCommandBuffer() {
+                return this->buf_a;
+            }
+
+            u8 *GetDataBuffer() {
+                return this->buf_b;
+            }
+
+            u8 *GetStatusBuffer() {
+                return this->buf_c;
+            }
+    };
+
+}
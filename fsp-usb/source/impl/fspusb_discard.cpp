@@ -0,0 +1,92 @@
+#include "fspusb_discard.hpp"
+
+namespace fspusb::impl {
+
+    DiscardQueue::DiscardQueue() : extents(), pending_blocks(0) {}
+
+    void DiscardQueue::Add(u64 lba, u64 blocks) {
+        if (blocks == 0) return;
+
+        u64 start = lba;
+        u64 end = (lba + blocks);
+
+        /* Swallow every extent overlapping or touching the new one, starting with the one right before it */
+        auto it = this->extents.upper_bound(start);
+        if (it != this->extents.begin()) {
+            auto prev = std::prev(it);
+            if ((prev->first + prev->second) >= start) {
+                it = prev;
+            }
+        }
+
+        while(it != this->extents.end() && it->first <= end) {
+            start = std::min(start, it->first);
+            end = std::max(end, it->first + it->second);
+            this->pending_blocks -= it->second;
+            it = this->extents.erase(it);
+        }
+
+        this->extents[start] = (end - start);
+        this->pending_blocks += (end - start);
+    }
+
+    void DiscardQueue::Remove(u64 lba, u64 blocks) {
+        if (blocks == 0 || this->extents.empty()) return;
+
+        u64 start = lba;
+        u64 end = (lba + blocks);
+
+        auto it = this->extents.upper_bound(start);
+        if (it != this->extents.begin()) {
+            it = std::prev(it);
+        }
+
+        /* These blocks are about to be written, so they must not be unmapped afterwards */
+        while(it != this->extents.end() && it->first < end) {
+            u64 ext_start = it->first;
+            u64 ext_end = (it->first + it->second);
+
+            if (ext_end <= start) {
+                it++;
+                continue;
+            }
+
+            this->pending_blocks -= it->second;
+            it = this->extents.erase(it);
+
+            if (ext_start < start) {
+                this->extents[ext_start] = (start - ext_start);
+                this->pending_blocks += (start - ext_start);
+            }
+            if (ext_end > end) {
+                it = this->extents.emplace(end, ext_end - end).first;
+                this->pending_blocks += (ext_end - end);
+                break;
+            }
+        }
+    }
+
+    bool DiscardQueue::Pop(DiscardExtent *out, u64 max_blocks) {
+        if (this->extents.empty() || max_blocks == 0) return false;
+
+        auto it = this->extents.begin();
+        out->lba = it->first;
+        out->blocks = std::min(it->second, max_blocks);
+
+        /* Whatever doesn't fit stays queued */
+        u64 left = (it->second - out->blocks);
+        this->extents.erase(it);
+        if (left > 0) {
+            this->extents.emplace(out->lba + out->blocks, left);
+        }
+
+        this->pending_blocks -= out->blocks;
+        return true;
+    }
+
+    void DiscardQueue::Clear() {
+        this->extents.clear();
+        this->pending_blocks = 0;
+    }
+
+}
@@ -0,0 +1,49 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+#include <map>
+#include <algorithm>
+
+namespace fspusb::impl {
+
+    /* Amount of separate extents we keep around before some of them have to be issued right away */
+    constexpr size_t DiscardQueueMaxExtents = 0x400;
+
+    struct DiscardExtent {
+        u64 lba;
+        u64 blocks;
+    };
+
+    /* Freed block ranges waiting to be unmapped, kept sorted and merged with adjacent ones */
+    class DiscardQueue {
+
+        private:
+            std::map<u64, u64> extents; // Start LBA -> block count
+            u64 pending_blocks;
+
+        public:
+            DiscardQueue();
+
+            void Add(u64 lba, u64 blocks);
+            void Remove(u64 lba, u64 blocks);
+            bool Pop(DiscardExtent *out, u64 max_blocks);
+            void Clear();
+
+            bool IsEmpty() {
+                return this->extents.empty();
+            }
+
+            bool IsFull() {
+                return this->extents.size() >= DiscardQueueMaxExtents;
+            }
+
+            size_t GetExtentCount() {
+                return this->extents.size();
+            }
+
+            u64 GetPendingBlocks() {
+                return this->pending_blocks;
+            }
+    };
+
+}
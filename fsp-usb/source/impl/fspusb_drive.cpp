@@ -3,8 +3,13 @@
 
 namespace fspusb::impl {
 
-    Drive::Drive(UsbHsClientIfSession interface, UsbHsClientEpSession in_ep, UsbHsClientEpSession out_ep, u8 lun) : usb_interface(interface), usb_in_endpoint(in_ep), usb_out_endpoint(out_ep), mounted_idx(0xFF), scsi_context(nullptr), mounted(false) {
-        this->scsi_context = new SCSIDriveContext(&this->usb_interface, &this->usb_in_endpoint, &this->usb_out_endpoint, lun);
+    Drive::Drive(std::shared_ptr<BulkOnlyInterface> bot_iface, u8 lun, const DeviceQuirks &quirks) : usb_interface(*bot_iface->GetInterface()), usb_in_endpoint(), usb_out_endpoint(), usb_cmd_endpoint(), usb_status_endpoint(), uas(false), lun(lun), mounted_idx(0xFF), scsi_context(nullptr), mounted(false), discard_queue(), last_io_tick(0), block_cache(), block_cache_size(quirks.GetBlockCacheSize(BlockCacheDefaultSize)), write_back(), write_back_size(quirks.GetWriteBackSize(WriteBackDefaultSize)), read_ahead_size(quirks.GetReadAheadSize(ReadAheadDefaultMaxSize)) {
+        this->scsi_context = new SCSIDriveContext(new SCSIDevice(bot_iface, lun, quirks), quirks);
+    }
+
+    /* Data endpoints keep the Bulk-Only naming: in_endpoint is host -> device (data-out pipe), out_endpoint is device -> host (data-in pipe) */
+    Drive::Drive(UsbHsClientIfSession interface, UsbHsClientEpSession cmd_ep, UsbHsClientEpSession status_ep, UsbHsClientEpSession data_in_ep, UsbHsClientEpSession data_out_ep, u8 lun, const DeviceQuirks &quirks) : usb_interface(interface), usb_in_endpoint(data_out_ep), usb_out_endpoint(data_in_ep), usb_cmd_endpoint(cmd_ep), usb_status_endpoint(status_ep), uas(true), lun(lun), mounted_idx(0xFF), scsi_context(nullptr), mounted(false), discard_queue(), last_io_tick(0), block_cache(), block_cache_size(quirks.GetBlockCacheSize(BlockCacheDefaultSize)), write_back(), write_back_size(quirks.GetWriteBackSize(WriteBackDefaultSize)), read_ahead_size(quirks.GetReadAheadSize(ReadAheadDefaultMaxSize)) {
+        this->scsi_context = new SCSIDriveContext(new UASDevice(&this->usb_interface, &this->usb_cmd_endpoint, &this->usb_status_endpoint, &this->usb_out_endpoint, &this->usb_in_endpoint, lun), quirks);
     }
 
     Result Drive::Mount() {
@@ -17,7 +22,14 @@ namespace fspusb::impl {
             /* Try to find a mountable index */
             if (FindAndMountAtIndex(&this->mounted_idx)) {
                 FormatDriveMountName(this->mount_name, this->mounted_idx);
-                FSP_USB_LOG("%s (interface ID %d): drive mount name -> \"%s\".", __func__, this->GetInterfaceId(), this->mount_name);
+                FSP_USB_LOG("%s (interface ID %d): LUN %u mount name -> \"%s\"%s.", __func__, this->GetInterfaceId(), this->lun, this->mount_name, (this->IsWriteProtected() ? " (read-only)" : ""));
+                
+                /* Set up before f_mount, which already reads the boot sector and (on FAT32) FSINFO */
+                auto block = this->scsi_context->GetBlock();
+                bool cache_ok = this->block_cache.Initialize(block->GetBlockSize(), block->GetBlockCount(), this->block_cache_size);
+                FSP_USB_LOG("%s (interface ID %d): block cache %s (0x%X bytes).", __func__, this->GetInterfaceId(), (cache_ok ? "enabled" : "disabled"), (cache_ok ? this->block_cache_size : 0));
+                bool write_back_ok = this->write_back.Initialize(block->GetBlockSize(), this->write_back_size);
+                FSP_USB_LOG("%s (interface ID %d): write-back buffer %s (0x%X bytes).", __func__, this->GetInterfaceId(), (write_back_ok ? "enabled" : "disabled"), (write_back_ok ? this->write_back_size : 0));
                 
                 auto ffrc = f_mount(&this->fat_fs, this->mount_name, 1);
                 FSP_USB_LOG("%s (interface ID %d): f_mount returned %u.", __func__, this->GetInterfaceId(), ffrc);
@@ -25,6 +37,14 @@ namespace fspusb::impl {
                 rc = fspusb::result::CreateFromFRESULT(ffrc).GetValue();
                 if (R_SUCCEEDED(rc)) {
                     this->mounted = true;
+                } else {
+                    this->block_cache.Finalize();
+                    this->write_back.Finalize();
+                    /* Neither the FatFs volume slot nor the mount index stay taken by a drive that didn't mount */
+                    f_mount(nullptr, this->mount_name, 1);
+                    memset(this->mount_name, 0, 0x10);
+                    UnmountAtIndex(this->mounted_idx);
+                    this->mounted_idx = InvalidMountedIndex;
                 }
             }
         }
@@ -32,6 +52,19 @@ namespace fspusb::impl {
     }
 
     void Drive::Unmount() {
+        /* Last chance for held back writes, which only works if the drive is still there (e.g. when we're exiting) */
+        if(this->scsi_context != nullptr && !this->write_back.IsEmpty()) {
+            size_t pending = this->write_back.GetPendingSize();
+            DRESULT res = this->FlushWriteBack();
+            FSP_USB_LOG("%s (interface ID %d): flushing 0x%lX pending bytes %s.", __func__, this->GetInterfaceId(), pending, (res == RES_OK ? "succeeded" : "failed, dropping them"));
+        }
+        
+        if(this->write_back.IsEnabled()) {
+            auto &wb_counters = this->write_back.GetCounters();
+            FSP_USB_LOG("%s (interface ID %d): write-back buffered writes -> %lu | absorbed sectors -> %lu | flushed commands -> %lu | flushed sectors -> %lu.", __func__, this->GetInterfaceId(), wb_counters.buffered_writes, wb_counters.absorbed_sectors, wb_counters.flushed_commands, wb_counters.flushed_sectors);
+        }
+        this->write_back.Finalize();
+        
         if(this->mounted) {
             UnmountAtIndex(this->mounted_idx);
             f_mount(nullptr, this->mount_name, 1);
@@ -39,6 +72,71 @@ namespace fspusb::impl {
             memset(this->mount_name, 0, 0x10);
             this->mounted = false;
         }
+        
+        /* Whatever is still queued or cached refers to the volume we just unmounted */
+        this->discard_queue.Clear();
+        
+        if(this->block_cache.IsEnabled()) {
+            auto &counters = this->block_cache.GetCounters();
+            FSP_USB_LOG("%s (interface ID %d): block cache hits -> %lu | misses -> %lu | bypasses -> %lu | evictions -> %lu.", __func__, this->GetInterfaceId(), counters.hits, counters.misses, counters.bypasses, counters.evictions);
+        }
+        this->block_cache.Finalize();
+    }
+
+    DRESULT Drive::DoTrim(u64 start_sector, u64 end_sector) {
+        if(this->scsi_context == nullptr) {
+            return RES_PARERR;
+        }
+        
+        auto block = this->scsi_context->GetBlock();
+        if(!block->IsUnmapSupported() || end_sector < start_sector) {
+            /* Trimming is only a hint, so there's nothing to fail here */
+            return RES_OK;
+        }
+        
+        /* Freed ranges are only queued, they get merged with their neighbours and unmapped once the drive is idle */
+        this->discard_queue.Add(start_sector, (end_sector - start_sector) + 1);
+        if(this->discard_queue.IsFull()) {
+            FSP_USB_LOG("%s (interface ID %d): discard queue full, issuing some right away.", __func__, this->GetInterfaceId());
+            block->Discard(this->discard_queue, DriveDiscardCommandsPerRound);
+        }
+        
+        return RES_OK;
+    }
+
+    void Drive::DoIdleWork() {
+        if(this->scsi_context == nullptr || !this->mounted) {
+            return;
+        }
+        
+        if(armTicksToNs(armGetSystemTick() - this->last_io_tick) < DriveIdleTimeNs) {
+            return;
+        }
+        
+        /* The free cluster count (unless FSINFO had a valid one) is worked out a part at a time after mounting, so free space queries never have to wait for a full FAT/bitmap scan */
+        /* Its reads aren't I/O anyone asked for, so they don't keep the drive from being idle */
+        u64 io_tick = this->last_io_tick;
+        this->DoWithFATFS([&](FATFS *fs) {
+            if(fs->free_clst > fs->n_fatent - 2) {
+                DWORD clstrs = 0;
+                BYTE exact = 0;
+                auto ffrc = f_scanfree(this->mount_name, DriveFreeSpaceScanClustersPerRound, &clstrs, &exact);
+                if(ffrc != FR_OK || exact) {
+                    FSP_USB_LOG("%s (interface ID %d): free cluster count %s (f_scanfree returned %u, %u free clusters).", __func__, this->GetInterfaceId(), (exact ? "finished" : "failed"), ffrc, clstrs);
+                }
+            }
+        });
+        this->last_io_tick = io_tick;
+        
+        /* Held back writes don't wait for a sync forever, e.g. when a file is left open */
+        if(!this->write_back.IsEmpty()) {
+            DRESULT res = this->FlushWriteBack();
+            FSP_USB_LOG("%s (interface ID %d): flushing held back writes on idle returned %u.", __func__, this->GetInterfaceId(), res);
+        }
+        
+        if(!this->discard_queue.IsEmpty()) {
+            this->scsi_context->GetBlock()->Discard(this->discard_queue, DriveDiscardCommandsPerRound);
+        }
     }
 
     void Drive::Dispose(bool close_usbhs) {
@@ -47,9 +145,12 @@ namespace fspusb::impl {
             this->scsi_context = nullptr;
         }
         
-        if (close_usbhs) {
+        /* Bulk-Only drives just dropped their reference to the shared interface above */
+        if (close_usbhs && this->uas) {
             usbHsEpClose(&this->usb_in_endpoint);
             usbHsEpClose(&this->usb_out_endpoint);
+            usbHsEpClose(&this->usb_cmd_endpoint);
+            usbHsEpClose(&this->usb_status_endpoint);
             usbHsIfClose(&this->usb_interface);
         }
     }
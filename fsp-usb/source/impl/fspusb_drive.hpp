@@ -6,12 +6,25 @@
 #include "../fatfs/diskio.h"
 #include "fspusb_utils.hpp"
 #include "fspusb_scsi.hpp"
+#include "fspusb_uas.hpp"
+#include "fspusb_block_cache.hpp"
+#include "fspusb_write_back.hpp"
+#include "fspusb_read_ahead.hpp"
 
 namespace fspusb::impl {
 
     /* Maximum amount of drives, basically FATFS's volume number */
     constexpr u32 DriveMax = FF_VOLUMES;
 
+    /* How long a drive has to go without I/O before background work (e.g. queued discards) is done on it */
+    constexpr u64 DriveIdleTimeNs = 2'000'000'000;
+
+    /* UNMAP commands issued per idle check, or when the discard queue fills up */
+    constexpr u32 DriveDiscardCommandsPerRound = 4;
+
+    /* FAT entries / bitmap bits counted per idle check (or per free space query) until the free cluster count is known, 1MB of FAT32 */
+    constexpr u32 DriveFreeSpaceScanClustersPerRound = 0x40000;
+
     class Drive {
             NON_COPYABLE(Drive);
             NON_MOVEABLE(Drive);
@@ -19,24 +32,90 @@ namespace fspusb::impl {
         private:
             ams::os::Mutex fs_lock;
             UsbHsClientIfSession usb_interface;
-            UsbHsClientEpSession usb_in_endpoint;
-            UsbHsClientEpSession usb_out_endpoint;
+            UsbHsClientEpSession usb_in_endpoint; // UAS only, Bulk-Only pipes are shared between LUNs
+            UsbHsClientEpSession usb_out_endpoint; // UAS only
+            UsbHsClientEpSession usb_cmd_endpoint; // UAS only
+            UsbHsClientEpSession usb_status_endpoint; // UAS only
+            bool uas;
+            u8 lun;
             FATFS fat_fs;
             u32 mounted_idx;
             char mount_name[0x10];
             SCSIDriveContext *scsi_context;
             bool mounted;
+            DiscardQueue discard_queue;
+            u64 last_io_tick;
+            BlockCache block_cache;
+            u32 block_cache_size;
+            WriteBackBuffer write_back;
+            u32 write_back_size;
+            u32 read_ahead_size;
+
+            DRESULT ReadSectorsUncached(u8 *buffer, u64 sector_offset, u32 num_sectors) {
+                u32 block_size = this->GetBlockSize();
+                u32 done = 0;
+                /* Short transfers report how far they got, so just carry on from there as long as we're making progress */
+                while(done < num_sectors) {
+                    int res = this->scsi_context->GetBlock()->ReadSectors(buffer + ((u64)done * block_size), sector_offset + done, num_sectors - done);
+                    if(res <= 0) {
+                        break;
+                    }
+                    done += (u32)res;
+                }
+                if(done == num_sectors) {
+                    return RES_OK;
+                }
+                FSP_USB_LOG("%s: only read %u of %u sectors at 0x%016lX.", __func__, done, num_sectors, sector_offset);
+                return RES_ERROR;
+            }
+
+            DRESULT WriteSectorsUncached(const u8 *buffer, u64 sector_offset, u32 num_sectors) {
+                u32 block_size = this->GetBlockSize();
+                u32 done = 0;
+                while(done < num_sectors) {
+                    int res = this->scsi_context->GetBlock()->WriteSectors(buffer + ((u64)done * block_size), sector_offset + done, num_sectors - done);
+                    if(res <= 0) {
+                        break;
+                    }
+                    done += (u32)res;
+                }
+                if(done == num_sectors) {
+                    return RES_OK;
+                }
+                FSP_USB_LOG("%s: only wrote %u of %u sectors at 0x%016lX.", __func__, done, num_sectors, sector_offset);
+                return RES_ERROR;
+            }
 
         public:
-            Drive(UsbHsClientIfSession interface, UsbHsClientEpSession in_ep, UsbHsClientEpSession out_ep, u8 lun);
+            Drive(std::shared_ptr<BulkOnlyInterface> bot_iface, u8 lun, const DeviceQuirks &quirks);
+            Drive(UsbHsClientIfSession interface, UsbHsClientEpSession cmd_ep, UsbHsClientEpSession status_ep, UsbHsClientEpSession data_in_ep, UsbHsClientEpSession data_out_ep, u8 lun, const DeviceQuirks &quirks);
             Result Mount();
             void Unmount();
             void Dispose(bool close_usbhs);
+            DRESULT DoTrim(u64 start_sector, u64 end_sector);
+            void DoIdleWork();
 
             s32 GetInterfaceId() {
                 return this->usb_interface.ID;
             }
 
+            /* What drives are known as outside: the interface ID for LUN 0 (like before), with the LUN in the upper byte for the others */
+            s32 GetDriveId() {
+                return (s32)(((u32)this->lun << 24) | ((u32)this->usb_interface.ID & 0xFFFFFF));
+            }
+
+            u8 GetLUN() {
+                return this->lun;
+            }
+
+            bool IsUAS() {
+                return this->uas;
+            }
+
+            u32 GetReadAheadSize() {
+                return this->read_ahead_size;
+            }
+
             SCSIDriveContext *GetSCSIContext() {
                 return this->scsi_context;
             }
@@ -53,6 +132,20 @@ namespace fspusb::impl {
                 return 0;
             }
 
+            SCSIDriveCapabilities *GetCapabilities() {
+                if(this->scsi_context != nullptr) {
+                    return &this->scsi_context->GetBlock()->GetCapabilities();
+                }
+                return nullptr;
+            }
+
+            bool IsWriteProtected() {
+                if(this->scsi_context != nullptr) {
+                    return this->scsi_context->GetBlock()->IsWriteProtected();
+                }
+                return false;
+            }
+
             bool IsSCSIOk() {
                 if(this->scsi_context != nullptr) {
                     return this->scsi_context->Ok();
@@ -62,20 +155,71 @@ namespace fspusb::impl {
 
             DRESULT DoReadSectors(u8 *buffer, u64 sector_offset, u32 num_sectors) {
                 if(this->scsi_context != nullptr) {
-                    int res = this->scsi_context->GetBlock()->ReadSectors(buffer, sector_offset, num_sectors);
-                    if(res != 0) {
-                        return RES_OK;
-                    }
+                    this->last_io_tick = armGetSystemTick();
+                    /* FAT, directory and boot sectors get read over and over, so small reads go through the cache */
+                    bool ok = this->block_cache.Read(buffer, sector_offset, num_sectors, [&](u8 *out, u64 sector, u32 count) {
+                        if(this->ReadSectorsUncached(out, sector, count) != RES_OK) {
+                            return false;
+                        }
+                        /* Sectors still held back by the write-back buffer are newer than what's on the medium */
+                        this->write_back.Overlay(out, sector, count);
+                        return true;
+                    });
+                    return (ok ? RES_OK : RES_ERROR);
                 }
                 return RES_PARERR;
             }
 
             DRESULT DoWriteSectors(const u8 *buffer, u64 sector_offset, u32 num_sectors) {
                 if(this->scsi_context != nullptr) {
-                    int res = this->scsi_context->GetBlock()->WriteSectors(buffer, sector_offset, num_sectors);
-                    if(res != 0) {
+                    this->last_io_tick = armGetSystemTick();
+                    /* Reallocated blocks must not get unmapped after we write them */
+                    this->discard_queue.Remove(sector_offset, num_sectors);
+                    /* Reads have to see the new data right away, whether it's held back or not */
+                    this->block_cache.Update(buffer, sector_offset, num_sectors);
+                    
+                    /* Small writes (FAT, directory and FSINFO sectors, partial clusters) are held back to be merged with their neighbours */
+                    if(this->write_back.IsEnabled() && ((u64)num_sectors * this->GetBlockSize()) < WriteBackBypassSize) {
+                        if(this->write_back.Add(buffer, sector_offset, num_sectors)) {
+                            return RES_OK;
+                        }
+                        if(this->FlushWriteBack() == RES_OK && this->write_back.Add(buffer, sector_offset, num_sectors)) {
+                            return RES_OK;
+                        }
+                    }
+                    
+                    /* Anything still buffered for these sectors is older than what we're writing now */
+                    this->write_back.Remove(sector_offset, num_sectors);
+                    DRESULT res = this->WriteSectorsUncached(buffer, sector_offset, num_sectors);
+                    if(res != RES_OK) {
+                        /* No telling what actually made it to the medium */
+                        this->block_cache.Invalidate(sector_offset, num_sectors);
+                    }
+                    return res;
+                }
+                return RES_PARERR;
+            }
+
+            DRESULT FlushWriteBack() {
+                if(this->write_back.IsEmpty()) {
+                    return RES_OK;
+                }
+                bool ok = this->write_back.Flush([&](const u8 *data, u64 sector, u32 count) {
+                    return (this->WriteSectorsUncached(data, sector, count) == RES_OK);
+                });
+                return (ok ? RES_OK : RES_ERROR);
+            }
+
+            DRESULT DoSynchronizeCache() {
+                if(this->scsi_context != nullptr) {
+                    /* Held back writes first, so the drive's cache flush covers them too */
+                    if(this->FlushWriteBack() != RES_OK) {
+                        return RES_ERROR;
+                    }
+                    if(this->scsi_context->GetBlock()->SynchronizeCache()) {
                         return RES_OK;
                     }
+                    return RES_ERROR;
                 }
                 return RES_PARERR;
             }
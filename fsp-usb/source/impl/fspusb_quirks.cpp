@@ -0,0 +1,168 @@
+#include "fspusb_quirks.hpp"
+#include <array>
+#include <cctype>
+
+namespace fspusb::impl {
+
+    namespace {
+
+        struct DeviceQuirksEntry {
+            u16 vid;
+            u16 pid;
+            DeviceQuirks quirks;
+        };
+
+        /* Known devices, mostly the same quirks Linux ships for them. Keep it sorted by VID/PID */
+        constexpr DeviceQuirksEntry DeviceQuirksTable[] = {
+            { 0x174C, 0x5106, { DeviceQuirkFlags_NoUAS, 0, -1, -1, -1, -1 } },  // ASMedia ASM1051 SATA bridge
+            { 0x2109, 0x0711, { DeviceQuirkFlags_NoUAS, 0, -1, -1, -1, -1 } },  // VIA VL711 SATA bridge
+        };
+
+        constexpr DeviceQuirks DefaultDeviceQuirks = { DeviceQuirkFlags_None, 0, -1, -1, -1, -1 };
+
+        struct DeviceQuirksOption {
+            const char *name;
+            DeviceQuirkFlags flag;
+        };
+
+        constexpr DeviceQuirksOption DeviceQuirksOptions[] = {
+            { "no_read_capacity_16", DeviceQuirkFlags_NoReadCapacity16 },
+            { "no_get_max_lun", DeviceQuirkFlags_NoGetMaxLUN },
+            { "no_vpd", DeviceQuirkFlags_NoVPD },
+            { "no_mode_sense", DeviceQuirkFlags_NoModeSense },
+            { "no_sync_cache", DeviceQuirkFlags_NoSyncCache },
+            { "no_unmap", DeviceQuirkFlags_NoUnmap },
+            { "no_uas", DeviceQuirkFlags_NoUAS },
+            { "always_reset_recovery", DeviceQuirkFlags_AlwaysResetRecovery },
+            { "enable_write_cache", DeviceQuirkFlags_EnableWriteCache },
+        };
+
+        ams::os::Mutex g_device_quirks_lock;
+        std::array<DeviceQuirksEntry, DeviceQuirksOverrideMax> g_device_quirks_overrides = {};
+        u32 g_device_quirks_override_count = 0;
+
+        bool ParseQuirksOption(const char *opt, DeviceQuirks *quirks) {
+            for(auto &option: DeviceQuirksOptions) {
+                if(strcmp(opt, option.name) == 0) {
+                    quirks->flags |= option.flag;
+                    return true;
+                }
+            }
+            
+            const char *value = strchr(opt, '=');
+            if(value == nullptr) {
+                return false;
+            }
+            
+            value++;
+            if(strncmp(opt, "max_transfer=", (size_t)(value - opt)) == 0) {
+                quirks->max_transfer_size = (u32)strtoul(value, nullptr, 0);
+                return true;
+            }
+            if(strncmp(opt, "settle_delay_ms=", (size_t)(value - opt)) == 0) {
+                quirks->settle_delay_ns = ((s64)strtoul(value, nullptr, 0) * 1000000);
+                return true;
+            }
+            if(strncmp(opt, "block_cache=", (size_t)(value - opt)) == 0) {
+                quirks->block_cache_size = (s32)std::min(strtoul(value, nullptr, 0), (unsigned long)INT32_MAX);
+                return true;
+            }
+            if(strncmp(opt, "write_back=", (size_t)(value - opt)) == 0) {
+                quirks->write_back_size = (s32)std::min(strtoul(value, nullptr, 0), (unsigned long)INT32_MAX);
+                return true;
+            }
+            if(strncmp(opt, "read_ahead=", (size_t)(value - opt)) == 0) {
+                quirks->read_ahead_size = (s32)std::min(strtoul(value, nullptr, 0), (unsigned long)INT32_MAX);
+                return true;
+            }
+            
+            return false;
+        }
+
+        /* "VVVV:PPPP option[,option...]", '#' starts a comment */
+        bool ParseQuirksLine(char *line, DeviceQuirksEntry *out_entry) {
+            char *comment = strchr(line, '#');
+            if(comment != nullptr) *comment = '\0';
+            
+            unsigned int vid = 0, pid = 0;
+            int opts_offset = 0;
+            if(sscanf(line, " %x:%x %n", &vid, &pid, &opts_offset) != 2) {
+                return false;
+            }
+            
+            out_entry->vid = (u16)vid;
+            out_entry->pid = (u16)pid;
+            out_entry->quirks = DefaultDeviceQuirks;
+            
+            char *save = nullptr;
+            for(char *opt = strtok_r(line + opts_offset, ", \t\r\n", &save); opt != nullptr; opt = strtok_r(nullptr, ", \t\r\n", &save)) {
+                if(!ParseQuirksOption(opt, &out_entry->quirks)) {
+                    FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): ignoring unknown option \"%s\".", __func__, vid, pid, opt);
+                }
+            }
+            
+            return true;
+        }
+
+        void ReadDeviceQuirksConfig() {
+            FILE *config = fopen(DEVICE_QUIRKS_CONFIG_PATH, "r");
+            if(config == nullptr) {
+                FSP_USB_LOG("%s: no quirks config at \"%s\", using the built-in table only.", __func__, DEVICE_QUIRKS_CONFIG_PATH);
+                return;
+            }
+            
+            char line[0x100];
+            while(g_device_quirks_override_count < DeviceQuirksOverrideMax && fgets(line, sizeof(line), config) != nullptr) {
+                auto &entry = g_device_quirks_overrides[g_device_quirks_override_count];
+                if(ParseQuirksLine(line, &entry)) {
+                    FSP_USB_LOG("%s: override for VID 0x%04X, PID 0x%04X -> flags 0x%08X | max transfer 0x%X | settle delay %ld nS | block cache %d | write-back %d | read-ahead %d.", __func__, entry.vid, entry.pid, entry.quirks.flags, entry.quirks.max_transfer_size, entry.quirks.settle_delay_ns, entry.quirks.block_cache_size, entry.quirks.write_back_size, entry.quirks.read_ahead_size);
+                    g_device_quirks_override_count++;
+                }
+            }
+            
+            fclose(config);
+        }
+
+    }
+
+    void LoadDeviceQuirks() {
+        std::scoped_lock lk(g_device_quirks_lock);
+        
+        g_device_quirks_override_count = 0;
+        
+#ifdef FSP_USB_DEBUG
+        /* Debug builds keep the SD card mounted for logging */
+        ReadDeviceQuirksConfig();
+#else
+        /* Release builds only mount the SD card to read the config */
+        if(R_SUCCEEDED(fsInitialize())) {
+            if(R_SUCCEEDED(fsdevMountSdmc())) {
+                ReadDeviceQuirksConfig();
+                fsdevUnmountDevice("sdmc");
+            }
+            fsExit();
+        }
+#endif
+    }
+
+    DeviceQuirks GetDeviceQuirks(u16 vid, u16 pid) {
+        std::scoped_lock lk(g_device_quirks_lock);
+        
+        /* Overrides replace the built-in entry as a whole, so a built-in quirk can be turned off too */
+        for(u32 i = 0; i < g_device_quirks_override_count; i++) {
+            auto &entry = g_device_quirks_overrides[i];
+            if(entry.vid == vid && entry.pid == pid) {
+                return entry.quirks;
+            }
+        }
+        
+        for(auto &entry: DeviceQuirksTable) {
+            if(entry.vid == vid && entry.pid == pid) {
+                return entry.quirks;
+            }
+        }
+        
+        return DefaultDeviceQuirks;
+    }
+
+}
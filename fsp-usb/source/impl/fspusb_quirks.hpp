@@ -0,0 +1,61 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+
+/* Overrides for the compiled-in table, one device per line: "VVVV:PPPP option[,option...]" (see fspusb_quirks.cpp) */
+#define DEVICE_QUIRKS_CONFIG_PATH   "sdmc:/config/fsp-usb/quirks.ini"
+
+namespace fspusb::impl {
+
+    /* Amount of devices the SD card config can list */
+    constexpr u32 DeviceQuirksOverrideMax = 0x20;
+
+    enum DeviceQuirkFlags : u32 {
+        DeviceQuirkFlags_None                   = 0,
+        DeviceQuirkFlags_NoReadCapacity16       = BIT(0),   // Hangs on READ CAPACITY(16), so only the 10-byte variant is sent
+        DeviceQuirkFlags_NoGetMaxLUN            = BIT(1),   // Stalls or hangs on GET MAX LUN, just assume a single LUN
+        DeviceQuirkFlags_NoVPD                  = BIT(2),   // Doesn't survive VPD page requests
+        DeviceQuirkFlags_NoModeSense            = BIT(3),   // Doesn't survive MODE SENSE
+        DeviceQuirkFlags_NoSyncCache            = BIT(4),   // Chokes on SYNCHRONIZE CACHE
+        DeviceQuirkFlags_NoUnmap                = BIT(5),   // Advertises UNMAP but mishandles it
+        DeviceQuirkFlags_NoUAS                  = BIT(6),   // Broken UAS implementation, stick to its Bulk-Only interface
+        DeviceQuirkFlags_AlwaysResetRecovery    = BIT(7),   // Clearing halts alone doesn't get it back in sync, always do a full reset recovery
+        DeviceQuirkFlags_EnableWriteCache       = BIT(8),   // Turn on its disabled (but changeable) write cache at attach, data then only reaches the medium on SYNCHRONIZE CACHE
+    };
+
+    struct DeviceQuirks {
+        u32 flags;
+        u32 max_transfer_size;  // Bytes per SCSI command and per USB transfer, 0 = default
+        s64 settle_delay_ns;    // After SET CONFIGURATION / SET INTERFACE, negative = default
+        s32 block_cache_size;   // Bytes of sector cache, 0 = no cache, negative = default
+        s32 write_back_size;    // Bytes of dirty sectors held back, 0 = write-through, negative = default
+        s32 read_ahead_size;    // Maximum read-ahead window per open file, 0 = no read-ahead, negative = default
+        
+        bool Has(DeviceQuirkFlags flag) const {
+            return (this->flags & flag);
+        }
+        
+        u64 GetSettleDelay(u64 default_delay) const {
+            return ((this->settle_delay_ns < 0) ? default_delay : (u64)this->settle_delay_ns);
+        }
+        
+        u32 GetBlockCacheSize(u32 default_size) const {
+            return ((this->block_cache_size < 0) ? default_size : (u32)this->block_cache_size);
+        }
+        
+        u32 GetWriteBackSize(u32 default_size) const {
+            return ((this->write_back_size < 0) ? default_size : (u32)this->write_back_size);
+        }
+        
+        u32 GetReadAheadSize(u32 default_size) const {
+            return ((this->read_ahead_size < 0) ? default_size : (u32)this->read_ahead_size);
+        }
+    };
+
+    /* Reads the SD card overrides, called once when the manager starts */
+    void LoadDeviceQuirks();
+
+    /* SD card overrides first, then the compiled-in table, then defaults */
+    DeviceQuirks GetDeviceQuirks(u16 vid, u16 pid);
+
+}
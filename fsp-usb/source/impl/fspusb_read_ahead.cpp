@@ -0,0 +1,120 @@
+#include "fspusb_read_ahead.hpp"
+
+namespace fspusb::impl {
+
+    ReadAheadCache::ReadAheadCache(u32 max_sz) : buffer(nullptr), max_size(max_sz), window(std::min(ReadAheadMinSize, max_sz)), buffer_offset(0), buffer_size(0), next_offset(0), sequential_count(0), counters() {}
+
+    ReadAheadCache::~ReadAheadCache() {
+        this->Release();
+    }
+
+    void ReadAheadCache::Release() {
+        if(this->buffer != nullptr) {
+            operator delete[](this->buffer, std::align_val_t(USB_TRANSFER_MEMORY_BLOCK_SIZE));
+            this->buffer = nullptr;
+        }
+        this->buffer_size = 0;
+    }
+
+    void ReadAheadCache::Invalidate() {
+        /* The stream itself goes on, only the data is stale */
+        this->buffer_size = 0;
+    }
+
+    FRESULT ReadAheadCache::ReadDirect(FIL *file, u64 offset, u8 *out, u32 size, u32 *out_read) {
+        UINT br = 0;
+        auto ffrc = f_lseek(file, (FSIZE_t)offset);
+        if(ffrc == FR_OK) {
+            ffrc = f_read(file, out, (UINT)size, &br);
+        }
+        *out_read = (u32)br;
+        return ffrc;
+    }
+
+    FRESULT ReadAheadCache::Read(FIL *file, u64 offset, u8 *out, u32 size, u32 *out_read) {
+        *out_read = 0;
+
+        bool sequential = (offset == this->next_offset);
+        this->next_offset = (offset + size);
+        if(sequential) {
+            this->sequential_count++;
+        } else if(this->sequential_count > 0) {
+            this->sequential_count = 0;
+            this->window = std::min(ReadAheadMinSize, this->max_size);
+            this->counters.stream_resets++;
+        }
+
+        /* Whatever is already buffered is served first, even for a read going back a bit */
+        if(this->buffer_size > 0 && offset >= this->buffer_offset && offset < (this->buffer_offset + this->buffer_size)) {
+            u32 hit_size = (u32)std::min((u64)size, (this->buffer_offset + this->buffer_size) - offset);
+            memcpy(out, this->buffer + (offset - this->buffer_offset), hit_size);
+            this->counters.hit_bytes += hit_size;
+
+            offset += hit_size;
+            out += hit_size;
+            size -= hit_size;
+            *out_read += hit_size;
+            if(size == 0) {
+                return FR_OK;
+            }
+        } else if(!sequential) {
+            /* Random access, don't keep the buffer around for nothing */
+            this->Release();
+        }
+
+        /* Reads as big as the window don't gain anything from going through the buffer */
+        if(this->max_size == 0 || this->sequential_count < ReadAheadTriggerCount || size >= this->window) {
+            u32 br = 0;
+            auto ffrc = this->ReadDirect(file, offset, out, size, &br);
+            this->counters.direct_bytes += br;
+            *out_read += br;
+            return ffrc;
+        }
+
+        if(this->buffer == nullptr) {
+            /* Page-aligned, so the drive can transfer straight into it */
+            this->buffer = new (std::align_val_t(USB_TRANSFER_MEMORY_BLOCK_SIZE), std::nothrow) u8[this->max_size];
+            if(this->buffer == nullptr) {
+                u32 br = 0;
+                auto ffrc = this->ReadDirect(file, offset, out, size, &br);
+                this->counters.direct_bytes += br;
+                *out_read += br;
+                return ffrc;
+            }
+        }
+
+        /* Starting on a page boundary keeps sector-aligned data page-aligned in the buffer too */
+        u64 fetch_offset = (offset & ~((u64)USB_TRANSFER_MEMORY_BLOCK_SIZE - 1));
+        u32 fetch_size = std::min(this->window + (u32)(offset - fetch_offset), this->max_size);
+
+        u32 br = 0;
+        this->buffer_size = 0;
+        auto ffrc = this->ReadDirect(file, fetch_offset, this->buffer, fetch_size, &br);
+        if(ffrc != FR_OK) {
+            return ffrc;
+        }
+
+        this->buffer_offset = fetch_offset;
+        this->buffer_size = br;
+        this->counters.read_aheads++;
+        this->counters.read_ahead_bytes += br;
+        this->window = std::min(this->window * 2, this->max_size);
+
+        /* Less than asked for means we hit the end of the file */
+        u32 avail = ((br > (u32)(offset - fetch_offset)) ? (br - (u32)(offset - fetch_offset)) : 0);
+        u32 copy_size = std::min(size, avail);
+        memcpy(out, this->buffer + (offset - fetch_offset), copy_size);
+        *out_read += copy_size;
+
+        /* A full window can still come up short of an unaligned read */
+        if(copy_size < size && br == fetch_size) {
+            u32 rest = 0;
+            ffrc = this->ReadDirect(file, offset + copy_size, out + copy_size, size - copy_size, &rest);
+            this->counters.direct_bytes += rest;
+            *out_read += rest;
+        }
+
+        return ffrc;
+    }
+
+}
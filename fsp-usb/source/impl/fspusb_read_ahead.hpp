@@ -0,0 +1,53 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+#include "../fatfs/ff.h"
+
+namespace fspusb::impl {
+
+    /* Maximum read-ahead window per open file, the buffer is only allocated while the file is being streamed */
+    constexpr u32 ReadAheadDefaultMaxSize = 0x20000;
+
+    /* First window once a stream is detected, doubled on every read-ahead after that */
+    constexpr u32 ReadAheadMinSize = 0x8000;
+
+    /* Back-to-back sequential reads needed before reading ahead */
+    constexpr u32 ReadAheadTriggerCount = 2;
+
+    struct ReadAheadCounters {
+        u64 hit_bytes;
+        u64 direct_bytes;
+        u64 read_ahead_bytes;
+        u64 read_aheads;
+        u64 stream_resets;
+    };
+
+    /* Detects sequential reads on a file and serves them from a growing read-ahead window */
+    class ReadAheadCache {
+
+        private:
+            u8 *buffer;
+            u32 max_size;
+            u32 window;
+            u64 buffer_offset;
+            u32 buffer_size;
+            u64 next_offset;
+            u32 sequential_count;
+            ReadAheadCounters counters;
+
+            void Release();
+            FRESULT ReadDirect(FIL *file, u64 offset, u8 *out, u32 size, u32 *out_read);
+
+        public:
+            ReadAheadCache(u32 max_sz);
+            ~ReadAheadCache();
+
+            FRESULT Read(FIL *file, u64 offset, u8 *out, u32 size, u32 *out_read);
+            void Invalidate();
+
+            const ReadAheadCounters &GetCounters() {
+                return this->counters;
+            }
+    };
+
+}
@@ -0,0 +1,86 @@
+#include "fspusb_recovery.hpp"
+#include "fspusb_request.hpp"
+
+namespace fspusb::impl {
+
+    BOTRecovery::BOTRecovery(UsbHsClientIfSession *iface, UsbHsClientEpSession *in_ep, UsbHsClientEpSession *out_ep, bool reset_only) : client(iface), in_endpoint(in_ep), out_endpoint(out_ep), counters(), always_reset(reset_only) {}
+
+    void BOTRecovery::CountError(BOTError err) {
+        switch(err) {
+            case BOTError::Stall:
+                this->counters.stalls++;
+                break;
+            case BOTError::Babble:
+                this->counters.babbles++;
+                break;
+            case BOTError::Timeout:
+                this->counters.timeouts++;
+                break;
+            case BOTError::PhaseError:
+                this->counters.phase_errors++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool BOTRecovery::ClearHalt(UsbHsClientEpSession *endpoint) {
+        /* We already know the endpoint is halted, so there's no need to query its status again */
+        this->counters.halt_clears++;
+        Result rc = ClearEndpointHalt(this->client, endpoint, false);
+        FSP_USB_LOG("%s (interface ID %d): ClearEndpointHalt returned 0x%08X on endpoint 0x%02X.", __func__, this->client->ID, rc, endpoint->desc.bEndpointAddress);
+        return R_SUCCEEDED(rc);
+    }
+
+    BOTError BOTRecovery::Classify(Result rc, UsbHsClientEpSession *endpoint) {
+        if (R_SUCCEEDED(rc)) return BOTError::None;
+        if (rc == MAKERESULT(Module_Libnx, LibnxError_Timeout) || rc == KERNELRESULT(TimedOut)) return BOTError::Timeout;
+
+        /* A failed transfer on an endpoint which isn't halted means the transaction itself went wrong */
+        return (GetEndpointStatus(this->client, endpoint) ? BOTError::Stall : BOTError::Babble);
+    }
+
+    bool BOTRecovery::Recover(BOTError err, BOTStage stage, UsbHsClientEpSession *endpoint, bool *out_device_ok) {
+        *out_device_ok = true;
+        if (err == BOTError::None) return true;
+
+        this->CountError(err);
+        FSP_USB_LOG("%s (interface ID %d): error %u during stage %u on endpoint 0x%02X.", __func__, this->client->ID, (u32)err, (u32)stage, endpoint->desc.bEndpointAddress);
+
+        /* A stalled data or status stage only needs the halt cleared, after which the CSW is (re)read (BOT 6.7.2 / 6.7.3) */
+        /* A stalled CBW means the device didn't like it, and everything else leaves host and device out of sync: both need a reset recovery (BOT 5.3.4) */
+        if (!this->always_reset && err == BOTError::Stall && (stage == BOTStage::Data || stage == BOTStage::Status) && this->ClearHalt(endpoint)) {
+            return true;
+        }
+
+        *out_device_ok = this->ResetRecovery();
+        return false;
+    }
+
+    bool BOTRecovery::ResetRecovery() {
+        this->counters.reset_recoveries++;
+        FSP_USB_LOG("%s (interface ID %d): performing bulk-only mass storage reset recovery.", __func__, this->client->ID);
+
+        Result rc = ResetBulkStorage(this->client, this->in_endpoint, this->out_endpoint);
+        if (R_FAILED(rc)) {
+            this->counters.failed_recoveries++;
+            FSP_USB_LOG("%s (interface ID %d): ResetBulkStorage returned 0x%08X.", __func__, this->client->ID, rc);
+            return false;
+        }
+
+        return true;
+    }
+
+    void BOTRecovery::NotifyStaleStatus() {
+        this->counters.stale_statuses++;
+    }
+
+    void BOTRecovery::Backoff(u32 attempt) {
+        if (attempt == 0) return;
+
+        u64 delay = std::min((u64)SCSI_RECOVERY_BACKOFF_BASE_NS << std::min(attempt - 1, (u32)16), (u64)SCSI_RECOVERY_BACKOFF_MAX_NS);
+        FSP_USB_LOG("%s (interface ID %d): waiting %lu uS before attempt #%u.", __func__, this->client->ID, delay / 1000, attempt + 1);
+        svcSleepThread(delay);
+    }
+
+}
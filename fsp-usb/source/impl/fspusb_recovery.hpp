@@ -0,0 +1,68 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+
+#define SCSI_RECOVERY_BACKOFF_BASE_NS           1000000     // 1 mS
+#define SCSI_RECOVERY_BACKOFF_MAX_NS            64000000    // 64 mS
+
+namespace fspusb::impl {
+
+    /* What went wrong during a Bulk-Only transfer */
+    enum class BOTError {
+        None,
+        Stall,          // The device halted the endpoint
+        Babble,         // Transaction error with the endpoint still running (babble, CRC, ...)
+        Timeout,        // The transfer didn't complete in time
+        PhaseError      // CSW with phase error status, or an invalid CSW
+    };
+
+    /* Which stage of the command the error happened in */
+    enum class BOTStage {
+        Command,
+        Data,
+        Status,
+        StatusRetry     // Second CSW read, after clearing a stalled status stage
+    };
+
+    struct BOTRecoveryCounters {
+        u32 stalls;
+        u32 babbles;
+        u32 timeouts;
+        u32 phase_errors;
+        u32 halt_clears;
+        u32 reset_recoveries;
+        u32 failed_recoveries;
+        u32 stale_statuses;
+    };
+
+    /* Bulk-Only error handling (USB MSC BOT 1.0, 5.3 and 6.x), always picking the cheapest recovery that is still valid */
+    class BOTRecovery {
+
+        private:
+            UsbHsClientIfSession *client;
+            UsbHsClientEpSession *in_endpoint;
+            UsbHsClientEpSession *out_endpoint;
+            BOTRecoveryCounters counters;
+            bool always_reset;
+
+            void CountError(BOTError err);
+            bool ClearHalt(UsbHsClientEpSession *endpoint);
+
+        public:
+            BOTRecovery(UsbHsClientIfSession *iface, UsbHsClientEpSession *in_ep, UsbHsClientEpSession *out_ep, bool reset_only = false);
+
+            BOTError Classify(Result rc, UsbHsClientEpSession *endpoint);
+
+            /* Returns whether the command can continue with its next stage (a CSW read after a data stall), otherwise it needs to be retried */
+            bool Recover(BOTError err, BOTStage stage, UsbHsClientEpSession *endpoint, bool *out_device_ok);
+
+            bool ResetRecovery();
+            void NotifyStaleStatus();
+            void Backoff(u32 attempt);
+
+            const BOTRecoveryCounters &GetCounters() {
+                return this->counters;
+            }
+    };
+
+}
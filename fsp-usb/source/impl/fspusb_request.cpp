@@ -13,6 +13,23 @@ namespace fspusb::impl {
         operator delete[](buf, std::align_val_t(USB_TRANSFER_MEMORY_BLOCK_SIZE));
     }
 
+    bool IsUSBTransferMemoryUsable(const void *buf, u32 size) {
+        u64 addr = (u64)buf;
+        if (buf == nullptr || size == 0 || (addr & (USB_TRANSFER_MEMORY_BLOCK_SIZE - 1)) != 0) return false;
+        
+        // The whole range must be plain read/write memory owned by us (IPC-mapped client buffers can't be posted directly)
+        u64 end = (addr + size);
+        while(addr < end) {
+            MemoryInfo info = {};
+            u32 page_info = 0;
+            if (R_FAILED(svcQueryMemory(&info, &page_info, addr))) return false;
+            if (info.type == MemType_Unmapped || (info.perm & Perm_Rw) != Perm_Rw || (info.attr & MemAttr_IsIpcMapped)) return false;
+            addr = (info.addr + info.size);
+        }
+        
+        return true;
+    }
+
     // 0 = Not Halted, 1 = Halted
     u8 GetEndpointStatus(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint) {
         u8 *status = (u8*)AllocUSBTransferMemoryBlock(1);
@@ -24,8 +41,6 @@ namespace fspusb::impl {
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_DEVICE2HOST | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_ENDPOINT), USB_REQUEST_EP_GET_STATUS, 0, ep_addr, 2, status, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
-        
         if (R_SUCCEEDED(rc) && transferredSize == 2) {
             ret_status = (*status & 0x01);
         } else {
@@ -37,17 +52,15 @@ namespace fspusb::impl {
         return ret_status;
     }
 
-    Result ClearEndpointHalt(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint) {
+    Result ClearEndpointHalt(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, bool check_status) {
         // First check if this endpoint really is stalled
-        if (!GetEndpointStatus(interface, endpoint)) return 0;
+        if (check_status && !GetEndpointStatus(interface, endpoint)) return 0;
         
         u32 transferredSize = 0;
         u16 ep_addr = (u16)(endpoint->desc.bEndpointAddress);
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_HOST2DEVICE | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_ENDPOINT), USB_REQUEST_EP_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, ep_addr, 0, nullptr, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
-        
         return rc;
     }
 
@@ -57,11 +70,10 @@ namespace fspusb::impl {
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_HOST2DEVICE | USB_CTRLTYPE_TYPE_CLASS | USB_CTRLTYPE_REC_INTERFACE), USB_REQUEST_BULK_RESET, 0, iface_num, 0, nullptr, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
-        
+        // Both endpoints have to be cleared after a reset, even if they aren't halted, so their data toggles get reset too
         if (R_SUCCEEDED(rc)) {
-            ClearEndpointHalt(interface, in_endpoint);
-            ClearEndpointHalt(interface, out_endpoint);
+            ClearEndpointHalt(interface, in_endpoint, false);
+            ClearEndpointHalt(interface, out_endpoint, false);
         }
         
         return rc;
@@ -77,8 +89,6 @@ namespace fspusb::impl {
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_DEVICE2HOST | USB_CTRLTYPE_TYPE_CLASS | USB_CTRLTYPE_REC_INTERFACE), USB_REQUEST_BULK_GET_MAX_LUN, 0, iface_num, 1, max_lun, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
-        
         if (R_SUCCEEDED(rc) && transferredSize == 1 && *max_lun < USB_MAX_LUN) {
             ret_lun = (*max_lun + 1);
         } else {
@@ -100,8 +110,6 @@ namespace fspusb::impl {
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_DEVICE2HOST | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_DEVICE), USB_REQUEST_GET_CONFIG, 0, 0, 1, conf, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
-        
         if (R_SUCCEEDED(rc) && transferredSize == 1) {
             ret_conf = *conf;
         } else {
@@ -113,31 +121,128 @@ namespace fspusb::impl {
         return ret_conf;
     }
     
-    Result SetUSBConfiguration(UsbHsClientIfSession *interface, u8 conf) {
+    Result SetUSBConfiguration(UsbHsClientIfSession *interface, u8 conf, u64 settle_delay_ns) {
         u32 transferredSize = 0;
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_HOST2DEVICE | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_DEVICE), USB_REQUEST_SET_CONFIG, conf, 0, 0, nullptr, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
+        // The request is complete once its status stage is, but give the device's endpoints a moment to come up
+        if (R_SUCCEEDED(rc) && settle_delay_ns > 0) svcSleepThread(settle_delay_ns);
         
         return rc;
     }
 
-    Result SetUSBAlternativeInterface(UsbHsClientIfSession *interface, u8 alt_iface) {
+    Result SetUSBAlternativeInterface(UsbHsClientIfSession *interface, u8 alt_iface, u64 settle_delay_ns) {
         u32 transferredSize = 0;
         u16 iface_num = (u16)(interface->inf.inf.interface_desc.bInterfaceNumber);
         
         Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_HOST2DEVICE | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_INTERFACE), USB_REQUEST_SET_INTERFACE, alt_iface, iface_num, 0, nullptr, &transferredSize);
         
-        svcSleepThread((u64)120000000); // 120 mS
+        if (R_SUCCEEDED(rc) && settle_delay_ns > 0) svcSleepThread(settle_delay_ns);
         
         return rc;
     }
 
-    Result PostUSBBuffer(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferredSize) {
-        Result rc = usbHsEpPostBuffer(endpoint, buffer, size, transferredSize);
-        if (R_FAILED(rc)) ClearEndpointHalt(interface, endpoint);
+    Result GetUSBPipeUsageEndpoints(UsbHsClientIfSession *interface, u8 *out_ep_addrs, u32 max_pipe_id) {
+        u8 *conf = (u8*)AllocUSBTransferMemoryBlock(1);
+        if (conf == nullptr) return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        
+        u32 transferredSize = 0;
+        u16 conf_idx = (u16)((USB_DESCRIPTOR_CONFIG << 8) | 0);
+        
+        Result rc = usbHsIfCtrlXfer(interface, (USB_CTRLTYPE_DIR_DEVICE2HOST | USB_CTRLTYPE_TYPE_STANDARD | USB_CTRLTYPE_REC_DEVICE), USB_REQUEST_GET_DESCRIPTOR, conf_idx, 0, USB_TRANSFER_MEMORY_BLOCK_SIZE, conf, &transferredSize);
+        
+        if (R_SUCCEEDED(rc)) {
+            // Class-specific pipe usage descriptors follow the endpoint descriptor they describe (and its SuperSpeed companion, if any)
+            u8 iface_num = interface->inf.inf.interface_desc.bInterfaceNumber;
+            u8 alt_setting = interface->inf.inf.interface_desc.bAlternateSetting;
+            bool in_iface = false;
+            u8 last_ep_addr = 0;
+            
+            memset(out_ep_addrs, 0, max_pipe_id);
+            
+            for(u32 offset = 0; (offset + 2) <= transferredSize;) {
+                u8 len = conf[offset];
+                u8 type = conf[offset + 1];
+                if (len < 2 || (offset + len) > transferredSize) break;
+                
+                if (type == USB_DESCRIPTOR_INTERFACE && len >= 4) {
+                    in_iface = (conf[offset + 2] == iface_num && conf[offset + 3] == alt_setting);
+                    last_ep_addr = 0;
+                } else if (in_iface && type == USB_DESCRIPTOR_ENDPOINT && len >= 3) {
+                    last_ep_addr = conf[offset + 2];
+                } else if (in_iface && type == USB_DESCRIPTOR_PIPE_USAGE && len >= 3 && last_ep_addr != 0) {
+                    u8 pipe_id = conf[offset + 2];
+                    if (pipe_id > 0 && pipe_id <= max_pipe_id) out_ep_addrs[pipe_id - 1] = last_ep_addr;
+                }
+                
+                offset += len;
+            }
+        }
+        
+        FreeUSBTransferMemoryBlock(conf);
+        
+        return rc;
+    }
+
+    Result PostUSBBuffer(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferredSize, bool clear_halt, u64 timeout_ns) {
+        // Same as usbHsEpPostBuffer, except the wait can give up
+        u32 xfer_id = 0;
+        Result rc = PostUSBBufferAsync(endpoint, buffer, size, &xfer_id);
+        if (R_SUCCEEDED(rc)) rc = WaitUSBBufferAsync(endpoint, buffer, size, xfer_id, transferredSize, timeout_ns);
+        
+        // A timed out transfer is still posted, it's up to the caller to cancel it
+        if (R_FAILED(rc) && rc != KERNELRESULT(TimedOut) && clear_halt) ClearEndpointHalt(interface, endpoint);
         return rc;
     }
 
+    Result PostUSBBufferAsync(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *out_xfer_id) {
+        armDCacheFlush(buffer, size);
+        return usbHsEpPostBufferAsync(endpoint, buffer, size, 0, out_xfer_id);
+    }
+
+    Result WaitUSBBufferAsync(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 xfer_id, u32 *transferredSize, u64 timeout_ns) {
+        Event *xfer_event = usbHsEpGetXferEvent(endpoint);
+        UsbHsXferReport report;
+        u32 count = 0;
+        Result rc = 0;
+        
+        u64 deadline = ((timeout_ns == USB_NO_TIMEOUT) ? 0 : (armGetSystemTick() + armNsToTicks(timeout_ns)));
+        
+        // Several transfers may complete before we get here, so check the report ring before waiting for the event
+        while(true) {
+            eventClear(xfer_event);
+            
+            memset(&report, 0, sizeof(UsbHsXferReport));
+            rc = usbHsEpGetXferReport(endpoint, &report, 1, &count);
+            if (R_FAILED(rc)) return rc;
+            if (count > 0) break;
+            
+            u64 wait_ns = UINT64_MAX;
+            if (deadline != 0) {
+                u64 now = armGetSystemTick();
+                wait_ns = ((now < deadline) ? armTicksToNs(deadline - now) : 0);
+            }
+            
+            rc = eventWait(xfer_event, wait_ns);
+            if (R_FAILED(rc)) return rc;
+        }
+        
+        armDCacheFlush(buffer, size);
+        
+        if (report.xferId != xfer_id) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        
+        *transferredSize = report.transferredSize;
+        return report.res;
+    }
+
+    Result CancelUSBTransfers(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, u16 max_urb_count) {
+        // usb:hs can't cancel a single transfer, but closing the endpoint aborts everything posted on it
+        // Reopening it in place keeps every pointer to the session valid
+        usb_endpoint_descriptor desc = endpoint->desc;
+        usbHsEpClose(endpoint);
+        
+        return usbHsIfOpenUsbEp(interface, endpoint, max_urb_count, desc.wMaxPacketSize, &desc);
+    }
+
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "fspusb_drive.hpp"
 #include <functional>
 
+#define USB_REQUEST_GET_DESCRIPTOR      0x06
 #define USB_REQUEST_GET_CONFIG          0x08
 #define USB_REQUEST_SET_CONFIG          0x09
 #define USB_REQUEST_SET_INTERFACE       0x0B
@@ -24,24 +25,43 @@
 
 #define USB_FEATURE_ENDPOINT_HALT       0
 
+#define USB_DESCRIPTOR_CONFIG           0x02
+#define USB_DESCRIPTOR_INTERFACE        0x04
+#define USB_DESCRIPTOR_ENDPOINT         0x05
+#define USB_DESCRIPTOR_PIPE_USAGE       0x24    // UAS class-specific
+
 #define USB_MAX_LUN                     15
 
+// usbHsIfCtrlXfer only returns once the status stage has completed, so no delay is needed after most requests.
+// These are small settle delays for devices which take a bit to reconfigure their endpoints after a config/interface change.
+#define USB_SET_CONFIG_SETTLE_DELAY_NS      10000000    // 10 mS
+#define USB_SET_INTERFACE_SETTLE_DELAY_NS   10000000    // 10 mS
+
+// Bulk transfers wait forever unless told otherwise
+#define USB_NO_TIMEOUT                      UINT64_MAX
+
 namespace fspusb::impl {
 
     void *AllocUSBTransferMemoryBlock(u8 multiplier);
     void FreeUSBTransferMemoryBlock(void *buf);
+    bool IsUSBTransferMemoryUsable(const void *buf, u32 size);
     
     u8 GetEndpointStatus(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint);
-    Result ClearEndpointHalt(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint);
+    Result ClearEndpointHalt(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, bool check_status = true);
     Result ResetBulkStorage(UsbHsClientIfSession *interface, UsbHsClientEpSession *in_endpoint, UsbHsClientEpSession *out_endpoint);
     
     u8 GetMaxLUN(UsbHsClientIfSession *interface);
     
     u8 GetUSBConfiguration(UsbHsClientIfSession *interface);
-    Result SetUSBConfiguration(UsbHsClientIfSession *interface, u8 conf);
+    Result SetUSBConfiguration(UsbHsClientIfSession *interface, u8 conf, u64 settle_delay_ns = USB_SET_CONFIG_SETTLE_DELAY_NS);
+    
+    Result SetUSBAlternativeInterface(UsbHsClientIfSession *interface, u8 alt_iface, u64 settle_delay_ns = USB_SET_INTERFACE_SETTLE_DELAY_NS);
     
-    Result SetUSBAlternativeInterface(UsbHsClientIfSession *interface, u8 alt_iface);
+    Result GetUSBPipeUsageEndpoints(UsbHsClientIfSession *interface, u8 *out_ep_addrs, u32 max_pipe_id);
     
-    Result PostUSBBuffer(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferredSize);
+    Result PostUSBBuffer(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferredSize, bool clear_halt = true, u64 timeout_ns = USB_NO_TIMEOUT);
+    Result PostUSBBufferAsync(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *out_xfer_id);
+    Result WaitUSBBufferAsync(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 xfer_id, u32 *transferredSize, u64 timeout_ns = USB_NO_TIMEOUT);
+    Result CancelUSBTransfers(UsbHsClientIfSession *interface, UsbHsClientEpSession *endpoint, u16 max_urb_count);
 
 }
\ No newline at end of file
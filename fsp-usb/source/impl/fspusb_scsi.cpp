@@ -1,61 +1,81 @@
 #include "fspusb_scsi.hpp"
 #include "fspusb_request.hpp"
+#include "fspusb_scsi_cdb.hpp"
 
 namespace fspusb::impl {
 
-    SCSIBuffer::SCSIBuffer() {
-        memset(this->storage, 0, BufferSize);
-    }
+    namespace {
 
-    void SCSIBuffer::Write8(u8 val) {
-        memcpy(&this->storage[this->idx], &val, sizeof(u8));
-        this->idx += sizeof(u8);
-    }
+        using TestUnitReadyLayout   = cdb::CommandBlockLayout<SCSI_TEST_UNIT_READY_CMD, SCSI_TEST_UNIT_READY_CB_LEN, 0, 0, 0, 0>;
+        using RequestSenseLayout    = cdb::CommandBlockLayout<SCSI_REQUEST_SENSE_CMD, SCSI_REQUEST_SENSE_CB_LEN, 0, 0, 4, 1>;
+        using InquiryLayout         = cdb::CommandBlockLayout<SCSI_INQUIRY_CMD, SCSI_INQUIRY_CB_LEN, 0, 0, 3, 2>;
+        using ReadCapacity10Layout  = cdb::CommandBlockLayout<SCSI_READ_CAPACITY_10_CMD, SCSI_READ_CAPACITY_10_CB_LEN, 0, 0, 0, 0>;
+        using ReadCapacity16Layout  = cdb::CommandBlockLayout<SCSI_SERVICE_ACTION_IN_CMD, SCSI_READ_CAPACITY_16_CB_LEN, 0, 0, 10, 4, SCSI_SERVICE_ACTION_READ_CAPACITY_16>;
+        using Read10Layout          = cdb::CommandBlockLayout<SCSI_READ_10_CMD, SCSI_READ_10_CB_LEN, 2, 4, 7, 2>;
+        using Read16Layout          = cdb::CommandBlockLayout<SCSI_READ_16_CMD, SCSI_READ_16_CB_LEN, 2, 8, 10, 4>;
+        using Write10Layout         = cdb::CommandBlockLayout<SCSI_WRITE_10_CMD, SCSI_WRITE_10_CB_LEN, 2, 4, 7, 2>;
+        using Write16Layout         = cdb::CommandBlockLayout<SCSI_WRITE_16_CMD, SCSI_WRITE_16_CB_LEN, 2, 8, 10, 4>;
+        using SyncCache10Layout     = cdb::CommandBlockLayout<SCSI_SYNCHRONIZE_CACHE_10_CMD, SCSI_SYNCHRONIZE_CACHE_10_CB_LEN, 2, 4, 7, 2>;
+        using SyncCache16Layout     = cdb::CommandBlockLayout<SCSI_SYNCHRONIZE_CACHE_16_CMD, SCSI_SYNCHRONIZE_CACHE_16_CB_LEN, 2, 8, 10, 4>;
+        using UnmapLayout           = cdb::CommandBlockLayout<SCSI_UNMAP_CMD, SCSI_UNMAP_CB_LEN, 0, 0, 7, 2>;
+        using ModeSense6Layout      = cdb::CommandBlockLayout<SCSI_MODE_SENSE_6_CMD, SCSI_MODE_SENSE_6_CB_LEN, 0, 0, 4, 1>;
+        using ModeSense10Layout     = cdb::CommandBlockLayout<SCSI_MODE_SENSE_10_CMD, SCSI_MODE_SENSE_10_CB_LEN, 0, 0, 7, 2>;
+        using ModeSelect6Layout     = cdb::CommandBlockLayout<SCSI_MODE_SELECT_6_CMD, SCSI_MODE_SELECT_6_CB_LEN, 0, 0, 4, 1>;
+        using ModeSelect10Layout    = cdb::CommandBlockLayout<SCSI_MODE_SELECT_10_CMD, SCSI_MODE_SELECT_10_CB_LEN, 0, 0, 7, 2>;
 
-    void SCSIBuffer::WritePadding(u32 len) {
-        this->idx += len;
-    }
+        /* Layouts checked against the CDB tables in SPC-4 / SBC-3 */
+        static_assert(SCSI_CBW_HEADER_SIZE == SCSI_CBW_CB_OFFSET && (SCSI_CBW_CB_OFFSET + SCSI_CBW_CB_MAX_LEN) == SCSI_CBW_SIZE);
+        static_assert(cdb::Equals(TestUnitReadyLayout::Make(0, 0), std::array<u8, 6>{ 0x00, 0, 0, 0, 0, 0 }));
+        static_assert(cdb::Equals(RequestSenseLayout::Make(0, 0x12), std::array<u8, 6>{ 0x03, 0, 0, 0, 0x12, 0 }));
+        static_assert(cdb::Equals(InquiryLayout::Make(0, 0x1234), std::array<u8, 6>{ 0x12, 0, 0, 0x12, 0x34, 0 }));
+        static_assert(cdb::Equals(ReadCapacity10Layout::Make(0, 0), std::array<u8, 10>{ 0x25, 0, 0, 0, 0, 0, 0, 0, 0, 0 }));
+        static_assert(cdb::Equals(ReadCapacity16Layout::Make(0, 0x20), std::array<u8, 16>{ 0x9E, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x20, 0, 0 }));
+        static_assert(cdb::Equals(Read10Layout::Make(0x12345678, 0xABCD), std::array<u8, 10>{ 0x28, 0, 0x12, 0x34, 0x56, 0x78, 0, 0xAB, 0xCD, 0 }));
+        static_assert(cdb::Equals(Read16Layout::Make(0x0123456789ABCDEF, 0x11223344), std::array<u8, 16>{ 0x88, 0, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x11, 0x22, 0x33, 0x44, 0, 0 }));
+        static_assert(cdb::Equals(Write10Layout::Make(0x12345678, 0xABCD), std::array<u8, 10>{ 0x2A, 0, 0x12, 0x34, 0x56, 0x78, 0, 0xAB, 0xCD, 0 }));
+        static_assert(cdb::Equals(Write16Layout::Make(0x0123456789ABCDEF, 0x11223344), std::array<u8, 16>{ 0x8A, 0, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x11, 0x22, 0x33, 0x44, 0, 0 }));
 
-    void SCSIBuffer::Write16BE(u16 val) {
-        u16 tmpval = __builtin_bswap16(val);
-        memcpy(&this->storage[this->idx], &tmpval, sizeof(u16));
-        this->idx += sizeof(u16);
-    }
+        static_assert(cdb::Equals(SyncCache10Layout::Make(0x12345678, 0xABCD), std::array<u8, 10>{ 0x35, 0, 0x12, 0x34, 0x56, 0x78, 0, 0xAB, 0xCD, 0 }));
+        static_assert(cdb::Equals(SyncCache16Layout::Make(0x0123456789ABCDEF, 0x11223344), std::array<u8, 16>{ 0x91, 0, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x11, 0x22, 0x33, 0x44, 0, 0 }));
 
-    void SCSIBuffer::Write32(u32 val) {
-        memcpy(&this->storage[this->idx], &val, sizeof(u32));
-        this->idx += sizeof(u32);
-    }
+        static_assert(cdb::Equals(UnmapLayout::Make(0, 0x18), std::array<u8, 10>{ 0x42, 0, 0, 0, 0, 0, 0, 0, 0x18, 0 }));
 
-    void SCSIBuffer::Write32BE(u32 val)
-    {
-        u32 tmpval = __builtin_bswap32(val);
-        memcpy(&this->storage[this->idx], &tmpval, sizeof(u32));
-        this->idx += sizeof(u32);
-    }
-    
-    void SCSIBuffer::Write64BE(u64 val)
-    {
-        u64 tmpval = __builtin_bswap64(val);
-        memcpy(&this->storage[this->idx], &tmpval, sizeof(u64));
-        this->idx += sizeof(u64);
-    }
+        static_assert(cdb::Equals(ModeSense6Layout::Make(0, 0xC0), std::array<u8, 6>{ 0x1A, 0, 0, 0, 0xC0, 0 }));
+        static_assert(cdb::Equals(ModeSense10Layout::Make(0, 0x1234), std::array<u8, 10>{ 0x5A, 0, 0, 0, 0, 0, 0, 0x12, 0x34, 0 }));
+        static_assert(cdb::Equals(ModeSelect6Layout::Make(0, 0x18), std::array<u8, 6>{ 0x15, 0, 0, 0, 0x18, 0 }));
+        static_assert(cdb::Equals(ModeSelect10Layout::Make(0, 0x1C), std::array<u8, 10>{ 0x55, 0, 0, 0, 0, 0, 0, 0, 0x1C, 0 }));
+
+        constexpr std::array<u8, SCSI_CBW_HEADER_SIZE> MakeTestCommandBlockWrapper() {
+            std::array<u8, SCSI_CBW_HEADER_SIZE> cbw = {};
+            cdb::EncodeCommandBlockWrapper(cbw.data(), SCSI_CBW_SIGNATURE, 0x11223344, 0x200, SCSI_CBW_IN, 1, SCSI_READ_10_CB_LEN);
+            return cbw;
+        }
+
+        /* USB MSC BOT 1.0, 5.1: little-endian fields */
+        static_assert(cdb::Equals(MakeTestCommandBlockWrapper(), std::array<u8, SCSI_CBW_HEADER_SIZE>{ 0x55, 0x53, 0x42, 0x43, 0x44, 0x33, 0x22, 0x11, 0x00, 0x02, 0, 0, 0x80, 1, 0x0A }));
 
-    u8 *SCSIBuffer::GetStorage() {
-        return this->storage;
     }
 
-    SCSICommand::SCSICommand(u32 data_tr_len, SCSIDirection dir, u8 ln, u8 cb_len) {
-        this->tag = SCSI_TAG;
+    SCSICommand::SCSICommand(u8 op, u32 data_tr_len, SCSIDirection dir, u8 ln, u8 cb_len) {
+        this->tag = 0;
 
         this->data_transfer_length = data_tr_len;
         this->direction = dir;
         this->lun = ln;
         this->cb_length = cb_len;
+        this->opcode = op;
 
         flags = (dir == SCSIDirection::In ? SCSI_CBW_IN : SCSI_CBW_OUT);
     }
 
+    void SCSICommand::PatchCommandBlock(u8 *out) {
+        this->EncodeCommandBlock(out);
+    }
+
+    u64 SCSICommand::GetTimeout() {
+        return (SCSI_COMMAND_TIMEOUT_BASE_NS + (((u64)this->data_transfer_length * 1000000000) / SCSI_COMMAND_TIMEOUT_MIN_RATE));
+    }
+
     u32 SCSICommand::GetDataTransferLength() {
         return this->data_transfer_length;
     }
@@ -68,354 +88,569 @@ namespace fspusb::impl {
         return this->direction;
     }
 
-    void SCSICommand::ToBytes(u8 *out) {
-        auto buffer = this->ProduceBuffer();
-        memcpy(out, buffer.GetStorage(), SCSIBuffer::BufferSize);
+    u8 SCSICommand::GetCommandBlockLength() {
+        return this->cb_length;
     }
 
-    void SCSICommand::WriteHeader(SCSIBuffer &out) {
-        out.Write32(SCSI_CBW_SIGNATURE);
-        out.Write32(this->tag);
-        out.Write32(this->data_transfer_length);
-        out.Write8(this->flags);
-        out.Write8(this->lun);
-        out.Write8(this->cb_length);
-    };
-
-    SCSITestUnitReadyCommand::SCSITestUnitReadyCommand(u8 lun) : SCSICommand(SCSI_TEST_UNIT_READY_REPLY_LEN, SCSIDirection::Out, lun, SCSI_TEST_UNIT_READY_CB_LEN) {
-        this->opcode = SCSI_TEST_UNIT_READY_CMD;
+    u8 SCSICommand::GetOpcode() {
+        return this->opcode;
     }
 
-    SCSIBuffer SCSITestUnitReadyCommand::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    void SCSICommand::SetTag(u32 cmd_tag) {
+        this->tag = cmd_tag;
+    }
 
-        buf.Write8(this->opcode);
-        buf.WritePadding(5);
+    void SCSICommand::ToBytes(u8 *out) {
+        /* Back-to-back commands of the same kind (e.g. READ after READ) only need their changing fields rewritten */
+        bool same_kind = (cdb::GetBE<4>(out + SCSI_CBW_SIGNATURE_OFFSET) == __builtin_bswap32(SCSI_CBW_SIGNATURE) && out[SCSI_CBW_FLAGS_OFFSET] == this->flags && out[SCSI_CBW_LUN_OFFSET] == this->lun && out[SCSI_CBW_CB_LENGTH_OFFSET] == this->cb_length && out[SCSI_CBW_CB_OFFSET] == this->opcode);
+        if (same_kind) {
+            cdb::PatchCommandBlockWrapper(out, this->tag, this->data_transfer_length);
+            this->PatchCommandBlock(out + SCSI_CBW_CB_OFFSET);
+            return;
+        }
 
-        return buf;
+        cdb::EncodeCommandBlockWrapper(out, SCSI_CBW_SIGNATURE, this->tag, this->data_transfer_length, this->flags, this->lun, this->cb_length);
+        this->EncodeCommandBlock(out + SCSI_CBW_CB_OFFSET);
+        memset(out + SCSI_CBW_CB_OFFSET + this->cb_length, 0, SCSI_CBW_CB_MAX_LEN - this->cb_length);
     }
 
-    SCSIRequestSenseCommand::SCSIRequestSenseCommand(u8 alloc_len, u8 lun) : SCSICommand(alloc_len, SCSIDirection::In, lun, SCSI_REQUEST_SENSE_CB_LEN) {
-        this->opcode = SCSI_REQUEST_SENSE_CMD;
-        this->allocation_length = alloc_len;
+    void SCSICommand::ToCommandBlock(u8 *out) {
+        this->EncodeCommandBlock(out);
     }
 
-    SCSIBuffer SCSIRequestSenseCommand::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    SCSITestUnitReadyCommand::SCSITestUnitReadyCommand(u8 lun) : SCSICommand(SCSI_TEST_UNIT_READY_CMD, SCSI_TEST_UNIT_READY_REPLY_LEN, SCSIDirection::Out, lun, SCSI_TEST_UNIT_READY_CB_LEN) {}
 
-        buf.Write8(this->opcode);
-        buf.WritePadding(3);
-        buf.Write8(this->allocation_length);
-        buf.WritePadding(1);
+    void SCSITestUnitReadyCommand::EncodeCommandBlock(u8 *out) {
+        TestUnitReadyLayout::Encode(out, 0, 0);
+    }
 
-        return buf;
+    SCSIRequestSenseCommand::SCSIRequestSenseCommand(u8 alloc_len, u8 lun) : SCSICommand(SCSI_REQUEST_SENSE_CMD, alloc_len, SCSIDirection::In, lun, SCSI_REQUEST_SENSE_CB_LEN) {
+        this->allocation_length = alloc_len;
     }
 
-    SCSIReadCapacity10Command::SCSIReadCapacity10Command(u8 lun) : SCSICommand(SCSI_READ_CAPACITY_10_REPLY_LEN, SCSIDirection::In, lun, SCSI_READ_CAPACITY_10_CB_LEN) {
-        this->opcode = SCSI_READ_CAPACITY_10_CMD;
+    void SCSIRequestSenseCommand::EncodeCommandBlock(u8 *out) {
+        RequestSenseLayout::Encode(out, 0, this->allocation_length);
     }
 
-    SCSIBuffer SCSIReadCapacity10Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    SCSIInquiryCommand::SCSIInquiryCommand(u16 alloc_len, bool vpd, u8 page, u8 lun) : SCSICommand(SCSI_INQUIRY_CMD, alloc_len, SCSIDirection::In, lun, SCSI_INQUIRY_CB_LEN) {
+        this->allocation_length = alloc_len;
+        this->evpd = (vpd ? SCSI_INQUIRY_EVPD : 0);
+        this->page_code = (vpd ? page : 0);
+    }
 
-        buf.Write8(this->opcode);
-        buf.WritePadding(9);
+    void SCSIInquiryCommand::EncodeCommandBlock(u8 *out) {
+        InquiryLayout::Encode(out, 0, this->allocation_length);
+        out[1] = this->evpd;
+        out[2] = this->page_code;
+    }
+
+    SCSIReadCapacity10Command::SCSIReadCapacity10Command(u8 lun) : SCSICommand(SCSI_READ_CAPACITY_10_CMD, SCSI_READ_CAPACITY_10_REPLY_LEN, SCSIDirection::In, lun, SCSI_READ_CAPACITY_10_CB_LEN) {}
 
-        return buf;
+    void SCSIReadCapacity10Command::EncodeCommandBlock(u8 *out) {
+        ReadCapacity10Layout::Encode(out, 0, 0);
     }
 
-    SCSIReadCapacity16Command::SCSIReadCapacity16Command(u8 alloc_len, u8 lun) : SCSICommand(alloc_len, SCSIDirection::In, lun, SCSI_READ_CAPACITY_16_CB_LEN) {
-        this->opcode = SCSI_SERVICE_ACTION_IN_CMD;
+    SCSIReadCapacity16Command::SCSIReadCapacity16Command(u8 alloc_len, u8 lun) : SCSICommand(SCSI_SERVICE_ACTION_IN_CMD, alloc_len, SCSIDirection::In, lun, SCSI_READ_CAPACITY_16_CB_LEN) {
         this->allocation_length = alloc_len;
     }
 
-    SCSIBuffer SCSIReadCapacity16Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    void SCSIReadCapacity16Command::EncodeCommandBlock(u8 *out) {
+        ReadCapacity16Layout::Encode(out, 0, this->allocation_length);
+    }
+
+    SCSIRead10Command::SCSIRead10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun) : SCSICommand(SCSI_READ_10_CMD, block_sz * xfer_blocks, SCSIDirection::In, lun, SCSI_READ_10_CB_LEN) {
+        this->block_address = block_addr;
+        this->transfer_blocks = xfer_blocks;
+    }
 
-        buf.Write8(this->opcode);
-        buf.Write8(SCSI_SERVICE_ACTION_READ_CAPACITY_16);
-        buf.WritePadding(8);
-        buf.Write32BE((u32)this->allocation_length);
-        buf.WritePadding(2);
+    void SCSIRead10Command::EncodeCommandBlock(u8 *out) {
+        Read10Layout::Encode(out, this->block_address, this->transfer_blocks);
+    }
 
-        return buf;
+    void SCSIRead10Command::PatchCommandBlock(u8 *out) {
+        Read10Layout::Patch(out, this->block_address, this->transfer_blocks);
     }
 
-    SCSIRead10Command::SCSIRead10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun) : SCSICommand(block_sz * xfer_blocks, SCSIDirection::In, lun, SCSI_READ_10_CB_LEN) {
-        this->opcode = SCSI_READ_10_CMD;
+    SCSIRead16Command::SCSIRead16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun) : SCSICommand(SCSI_READ_16_CMD, (u32)(block_sz * xfer_blocks), SCSIDirection::In, lun, SCSI_READ_16_CB_LEN) {
         this->block_address = block_addr;
         this->transfer_blocks = xfer_blocks;
     }
 
-    SCSIBuffer SCSIRead10Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
-
-        buf.Write8(this->opcode);
-        buf.WritePadding(1);
-        buf.Write32BE(this->block_address);
-        buf.WritePadding(1);
-        buf.Write16BE(this->transfer_blocks);
-        buf.WritePadding(1);
+    void SCSIRead16Command::EncodeCommandBlock(u8 *out) {
+        Read16Layout::Encode(out, this->block_address, this->transfer_blocks);
+    }
 
-        return buf;
+    void SCSIRead16Command::PatchCommandBlock(u8 *out) {
+        Read16Layout::Patch(out, this->block_address, this->transfer_blocks);
     }
 
-    SCSIRead16Command::SCSIRead16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun) : SCSICommand((u32)(block_sz * xfer_blocks), SCSIDirection::In, lun, SCSI_READ_16_CB_LEN) {
-        this->opcode = SCSI_READ_16_CMD;
+    SCSIWrite10Command::SCSIWrite10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun) : SCSICommand(SCSI_WRITE_10_CMD, block_sz * xfer_blocks, SCSIDirection::Out, lun, SCSI_WRITE_10_CB_LEN) {
         this->block_address = block_addr;
         this->transfer_blocks = xfer_blocks;
     }
 
-    SCSIBuffer SCSIRead16Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
-
-        buf.Write8(this->opcode);
-        buf.WritePadding(1);
-        buf.Write64BE(this->block_address);
-        buf.Write32BE(this->transfer_blocks);
-        buf.WritePadding(2);
+    void SCSIWrite10Command::EncodeCommandBlock(u8 *out) {
+        Write10Layout::Encode(out, this->block_address, this->transfer_blocks);
+    }
 
-        return buf;
+    void SCSIWrite10Command::PatchCommandBlock(u8 *out) {
+        Write10Layout::Patch(out, this->block_address, this->transfer_blocks);
     }
 
-    SCSIWrite10Command::SCSIWrite10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun) : SCSICommand(block_sz * xfer_blocks, SCSIDirection::Out, lun, SCSI_WRITE_10_CB_LEN) {
-        this->opcode = SCSI_WRITE_10_CMD;
+    SCSIWrite16Command::SCSIWrite16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun) : SCSICommand(SCSI_WRITE_16_CMD, (u32)(block_sz * xfer_blocks), SCSIDirection::Out, lun, SCSI_WRITE_16_CB_LEN) {
         this->block_address = block_addr;
         this->transfer_blocks = xfer_blocks;
     }
 
-    SCSIBuffer SCSIWrite10Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    void SCSIWrite16Command::EncodeCommandBlock(u8 *out) {
+        Write16Layout::Encode(out, this->block_address, this->transfer_blocks);
+    }
+
+    void SCSIWrite16Command::PatchCommandBlock(u8 *out) {
+        Write16Layout::Patch(out, this->block_address, this->transfer_blocks);
+    }
 
-        buf.Write8(this->opcode);
-        buf.WritePadding(1);
-        buf.Write32BE(this->block_address);
-        buf.WritePadding(1);
-        buf.Write16BE(this->transfer_blocks);
-        buf.WritePadding(1);
+    SCSISynchronizeCache10Command::SCSISynchronizeCache10Command(u32 block_addr, u16 num_blocks, u8 lun) : SCSICommand(SCSI_SYNCHRONIZE_CACHE_10_CMD, 0, SCSIDirection::None, lun, SCSI_SYNCHRONIZE_CACHE_10_CB_LEN) {
+        this->block_address = block_addr;
+        this->sync_blocks = num_blocks;
+    }
 
-        return buf;
+    void SCSISynchronizeCache10Command::EncodeCommandBlock(u8 *out) {
+        SyncCache10Layout::Encode(out, this->block_address, this->sync_blocks);
     }
 
-    SCSIWrite16Command::SCSIWrite16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun) : SCSICommand((u32)(block_sz * xfer_blocks), SCSIDirection::Out, lun, SCSI_WRITE_16_CB_LEN) {
-        this->opcode = SCSI_WRITE_16_CMD;
+    u64 SCSISynchronizeCache10Command::GetTimeout() {
+        return SCSI_FLUSH_TIMEOUT_NS;
+    }
+
+    SCSISynchronizeCache16Command::SCSISynchronizeCache16Command(u64 block_addr, u32 num_blocks, u8 lun) : SCSICommand(SCSI_SYNCHRONIZE_CACHE_16_CMD, 0, SCSIDirection::None, lun, SCSI_SYNCHRONIZE_CACHE_16_CB_LEN) {
         this->block_address = block_addr;
-        this->transfer_blocks = xfer_blocks;
+        this->sync_blocks = num_blocks;
     }
 
-    SCSIBuffer SCSIWrite16Command::ProduceBuffer() {
-        SCSIBuffer buf;
-        this->WriteHeader(buf);
+    void SCSISynchronizeCache16Command::EncodeCommandBlock(u8 *out) {
+        SyncCache16Layout::Encode(out, this->block_address, this->sync_blocks);
+    }
 
-        buf.Write8(this->opcode);
-        buf.WritePadding(1);
-        buf.Write64BE(this->block_address);
-        buf.Write32BE(this->transfer_blocks);
-        buf.WritePadding(2);
+    u64 SCSISynchronizeCache16Command::GetTimeout() {
+        return SCSI_FLUSH_TIMEOUT_NS;
+    }
 
-        return buf;
+    SCSIUnmapCommand::SCSIUnmapCommand(u16 param_len, u8 lun) : SCSICommand(SCSI_UNMAP_CMD, param_len, SCSIDirection::Out, lun, SCSI_UNMAP_CB_LEN) {
+        this->parameter_list_length = param_len;
     }
 
-    SCSIDevice::SCSIDevice(UsbHsClientIfSession *iface, UsbHsClientEpSession *in_ep, UsbHsClientEpSession *out_ep, u8 lun) : buf_a(nullptr), buf_b(nullptr), buf_c(nullptr), client(iface), in_endpoint(in_ep), out_endpoint(out_ep), ok(true), dev_lun(lun) {
-        this->AllocateBuffers();
+    void SCSIUnmapCommand::EncodeCommandBlock(u8 *out) {
+        UnmapLayout::Encode(out, 0, this->parameter_list_length);
     }
 
-    SCSIDevice::~SCSIDevice() {
-        this->FreeBuffers();
+    u64 SCSIUnmapCommand::GetTimeout() {
+        return SCSI_FLUSH_TIMEOUT_NS;
     }
 
-    void SCSIDevice::AllocateBuffers() {
-        if(this->buf_a == nullptr) {
-            this->buf_a = (u8*)AllocUSBTransferMemoryBlock(1);
+    SCSIModeSense6Command::SCSIModeSense6Command(u8 pc, u8 page, u8 alloc_len, u8 lun) : SCSICommand(SCSI_MODE_SENSE_6_CMD, alloc_len, SCSIDirection::In, lun, SCSI_MODE_SENSE_6_CB_LEN) {
+        this->page_control = pc;
+        this->page_code = page;
+        this->allocation_length = alloc_len;
+    }
+
+    void SCSIModeSense6Command::EncodeCommandBlock(u8 *out) {
+        ModeSense6Layout::Encode(out, 0, this->allocation_length);
+        out[2] = ((this->page_control << 6) | (this->page_code & 0x3F));
+    }
+
+    SCSIModeSense10Command::SCSIModeSense10Command(u8 pc, u8 page, u16 alloc_len, u8 lun) : SCSICommand(SCSI_MODE_SENSE_10_CMD, alloc_len, SCSIDirection::In, lun, SCSI_MODE_SENSE_10_CB_LEN) {
+        this->page_control = pc;
+        this->page_code = page;
+        this->allocation_length = alloc_len;
+    }
+
+    void SCSIModeSense10Command::EncodeCommandBlock(u8 *out) {
+        ModeSense10Layout::Encode(out, 0, this->allocation_length);
+        out[2] = ((this->page_control << 6) | (this->page_code & 0x3F));
+    }
+
+    SCSIModeSelect6Command::SCSIModeSelect6Command(u8 param_len, u8 lun) : SCSICommand(SCSI_MODE_SELECT_6_CMD, param_len, SCSIDirection::Out, lun, SCSI_MODE_SELECT_6_CB_LEN) {
+        this->parameter_list_length = param_len;
+    }
+
+    void SCSIModeSelect6Command::EncodeCommandBlock(u8 *out) {
+        ModeSelect6Layout::Encode(out, 0, this->parameter_list_length);
+        out[1] = SCSI_MODE_SELECT_PF; // Pages are in SPC format, and aren't saved across power cycles
+    }
+
+    SCSIModeSelect10Command::SCSIModeSelect10Command(u16 param_len, u8 lun) : SCSICommand(SCSI_MODE_SELECT_10_CMD, param_len, SCSIDirection::Out, lun, SCSI_MODE_SELECT_10_CB_LEN) {
+        this->parameter_list_length = param_len;
+    }
+
+    void SCSIModeSelect10Command::EncodeCommandBlock(u8 *out) {
+        ModeSelect10Layout::Encode(out, 0, this->parameter_list_length);
+        out[1] = SCSI_MODE_SELECT_PF;
+    }
+
+    u32 GetDefaultMaxTransferSize(UsbHsClientIfSession *iface) {
+        /* Plenty of USB 2.0 flash sticks choke on large commands, so stay conservative there */
+        return ((iface->inf.device_desc.bcdUSB >= 0x0300) ? SCSI_DEFAULT_MAX_TRANSFER_SIZE_SS : SCSI_DEFAULT_MAX_TRANSFER_SIZE);
+    }
+
+    void SCSITransport::TransferCommands(SCSICommand **cmds, u8 **buffers, u32 count, SCSICommandStatus *out_statuses) {
+        /* Transports without command queueing just run them back-to-back */
+        for(u32 i = 0; i < count; i++) {
+            out_statuses[i] = this->TransferCommand(*cmds[i], buffers[i]);
         }
-        if(this->buf_b == nullptr) {
-            this->buf_b = (u8*)AllocUSBTransferMemoryBlock(USB_TRANSFER_MEMORY_MAX_MULTIPLIER);
+    }
+
+    SCSIDevice::SCSIDevice(std::shared_ptr<BulkOnlyInterface> bot_iface, u8 lun, const DeviceQuirks &quirks) : bot_interface(bot_iface), client(bot_iface->GetInterface()), in_endpoint(bot_iface->GetInEndpoint()), out_endpoint(bot_iface->GetOutEndpoint()), buf_a(bot_iface->GetCommandBuffer()), buf_b(bot_iface->GetDataBuffer()), buf_c(bot_iface->GetStatusBuffer()), ok(true), dev_lun(lun), data_bytes_transferred(0), data_bytes_copied(0), transfer_policy(client->inf.device_desc.idVendor, client->inf.device_desc.idProduct), recovery(client, in_endpoint, out_endpoint, quirks.Has(DeviceQuirkFlags_AlwaysResetRecovery)), next_tag(SCSI_TAG_INITIAL + ((u32)lun << SCSI_TAG_LUN_SHIFT)), current_tag(0), deadline_tick(0) {
+        if (quirks.max_transfer_size > 0) this->transfer_policy.SetDeviceLimit(quirks.max_transfer_size);
+    }
+
+    SCSIDevice::~SCSIDevice() {
+        FSP_USB_LOG("%s (interface ID %d): data stage bytes transferred -> %lu | bytes copied through bounce buffer -> %lu.", __func__, this->client->ID, this->data_bytes_transferred, this->data_bytes_copied);
+        
+        auto &counters = this->recovery.GetCounters();
+        FSP_USB_LOG("%s (interface ID %d): stalls -> %u | babbles -> %u | timeouts -> %u | phase errors -> %u | halt clears -> %u | reset recoveries -> %u (%u failed).", __func__, this->client->ID, counters.stalls, counters.babbles, counters.timeouts, counters.phase_errors, counters.halt_clears, counters.reset_recoveries, counters.failed_recoveries);
+        FSP_USB_LOG("%s (interface ID %d): stale CSWs dropped -> %u.", __func__, this->client->ID, counters.stale_statuses);
+    }
+
+    UsbHsClientEpSession *SCSIDevice::GetDataEndpoint(SCSIDirection dir) {
+        /* in_endpoint is the host -> device pipe, out_endpoint is the device -> host one */
+        return ((dir == SCSIDirection::In) ? this->out_endpoint : this->in_endpoint);
+    }
+
+    u64 SCSIDevice::GetRemainingTime() {
+        u64 now = armGetSystemTick();
+        return ((now < this->deadline_tick) ? armTicksToNs(this->deadline_tick - now) : 0);
+    }
+
+    void SCSIDevice::CancelTransfers(UsbHsClientEpSession *endpoint) {
+        /* Whatever is still posted would otherwise complete at some point during the next command */
+        Result rc = CancelUSBTransfers(this->client, endpoint, SCSI_DATA_PIPELINE_DEPTH);
+        FSP_USB_LOG("%s (interface ID %d): CancelUSBTransfers returned 0x%08X on endpoint 0x%02X.", __func__, this->client->ID, rc, endpoint->desc.bEndpointAddress);
+        if (R_FAILED(rc)) this->ok = false;
+    }
+
+    u32 SCSIDevice::GetDataStageChunkSize(SCSIDirection dir, u8 *buffer, u32 remaining, bool *out_direct) {
+        u32 chunk_size = std::min(remaining, this->transfer_policy.GetChunkSize());
+        
+        /* Page-aligned buffers in our own memory can be posted directly, without going through buf_b */
+        /* Client buffers come in IPC-mapped and never qualify, so client I/O effectively moves in chunks of at most BounceSlotSize (64 KiB) */
+        /* The bigger chunk sizes the policy grows to only apply to our own buffers, like the read-ahead and cache ones */
+        if (IsUSBTransferMemoryUsable(buffer, chunk_size)) {
+            *out_direct = true;
+            return chunk_size;
         }
-        if(this->buf_c == nullptr) {
-            this->buf_c = (u8*)AllocUSBTransferMemoryBlock(1);
+        
+        *out_direct = false;
+        chunk_size = std::min(chunk_size, (u32)BounceSlotSize);
+        
+        /* Bounce the unaligned head on its own, so the rest of the transfer can go direct */
+        /* This is only possible if the split lands on a packet boundary, otherwise the device would see a short packet */
+        u32 head_size = (u32)(USB_TRANSFER_MEMORY_BLOCK_SIZE - ((u64)buffer & (USB_TRANSFER_MEMORY_BLOCK_SIZE - 1)));
+        u16 max_packet_size = this->GetDataEndpoint(dir)->desc.wMaxPacketSize;
+        if (head_size < chunk_size && max_packet_size > 0 && (head_size % max_packet_size) == 0 && IsUSBTransferMemoryUsable(buffer + head_size, chunk_size - head_size)) {
+            return head_size;
         }
+        
+        return chunk_size;
     }
 
-    void SCSIDevice::FreeBuffers() {
-        if(this->buf_a != nullptr) {
-            FreeUSBTransferMemoryBlock(this->buf_a);
-        }
-        if(this->buf_b != nullptr) {
-            FreeUSBTransferMemoryBlock(this->buf_b);
+    BOTError SCSIDevice::TransferData(SCSICommand &c, u8 *buffer, u32 *total_transferred, SCSICommandStatus *out_status, bool *out_got_status, u32 *out_stalled_size) {
+        SCSIDirection dir = c.GetDirection();
+        UsbHsClientEpSession *endpoint = this->GetDataEndpoint(dir);
+        u32 transfer_length = c.GetDataTransferLength();
+        u32 posted = *total_transferred;
+        
+        SCSIDataStageTransfer pending[SCSI_DATA_PIPELINE_DEPTH];
+        u32 pending_start = 0, pending_count = 0, bounce_slot = 0, failed_size = 0;
+        bool xfer_ok = true, stale_status = false, short_chunk = false;
+        Result xfer_rc = 0;
+        
+        /* Keep up to SCSI_DATA_PIPELINE_DEPTH chunks posted, so the device never idles while we copy the oldest one */
+        while(pending_count > 0 || (xfer_ok && posted < transfer_length)) {
+            while(xfer_ok && pending_count < SCSI_DATA_PIPELINE_DEPTH && posted < transfer_length) {
+                auto &t = pending[(pending_start + pending_count) % SCSI_DATA_PIPELINE_DEPTH];
+                t.data = (buffer + posted);
+                t.size = this->GetDataStageChunkSize(dir, t.data, transfer_length - posted, &t.direct);
+                
+                /* Bounce slots are reused in order, so the slot we pick now always belongs to an already completed chunk */
+                t.xfer_buffer = t.data;
+                if (!t.direct) {
+                    t.xfer_buffer = (this->buf_b + (bounce_slot * BounceSlotSize));
+                    bounce_slot = ((bounce_slot + 1) % SCSI_DATA_PIPELINE_DEPTH);
+                    if (dir == SCSIDirection::Out) {
+                        memcpy(t.xfer_buffer, t.data, t.size);
+                        this->data_bytes_copied += t.size;
+                    }
+                }
+                
+                Result rc = PostUSBBufferAsync(endpoint, t.xfer_buffer, t.size, &t.xfer_id);
+                FSP_USB_LOG("%s (interface ID %d): posted chunk at offset %u -> size %u (%s) | PostUSBBufferAsync returned 0x%08X.", __func__, this->client->ID, posted, t.size, (t.direct ? "direct" : "bounce"), rc);
+                
+                if (R_FAILED(rc)) {
+                    xfer_ok = false;
+                    xfer_rc = rc;
+                    break;
+                }
+                
+                posted += t.size;
+                pending_count++;
+            }
+            
+            if (pending_count == 0) break;
+            
+            /* Chunks complete in order on the same endpoint, so always wait for the oldest one */
+            auto &t = pending[pending_start];
+            pending_start = ((pending_start + 1) % SCSI_DATA_PIPELINE_DEPTH);
+            pending_count--;
+            
+            u32 transferred = 0;
+            Result rc = WaitUSBBufferAsync(endpoint, t.xfer_buffer, t.size, t.xfer_id, &transferred, this->GetRemainingTime());
+            FSP_USB_LOG("%s (interface ID %d): WaitUSBBufferAsync returned 0x%08X (transferred -> %u) (%s).", __func__, this->client->ID, rc, transferred, (R_SUCCEEDED(rc) && transferred == t.size ? "succeeded" : "failed"));
+            
+            if (rc == KERNELRESULT(TimedOut)) {
+                /* Nothing else is going to complete in time either, so abort every chunk still in flight */
+                this->CancelTransfers(endpoint);
+                pending_count = 0;
+                if (failed_size == 0) failed_size = t.size;
+                xfer_rc = rc;
+                xfer_ok = false;
+                continue;
+            }
+            
+            if (R_FAILED(rc)) {
+                if (failed_size == 0) failed_size = t.size;
+                if (xfer_ok) xfer_rc = rc;
+                xfer_ok = false;
+                continue;
+            }
+            
+            /* Anything still in flight after an error is drained and discarded, but right after a short chunk the device sends its CSW */
+            if (!xfer_ok && !short_chunk) continue;
+            
+            if (dir == SCSIDirection::In && transferred == SCSI_CSW_SIZE) {
+                SCSICommandStatus status = {};
+                memcpy(&status, t.xfer_buffer, SCSI_CSW_SIZE);
+                bool current_status = (status.signature == SCSI_CSW_SIGNATURE && status.tag == this->current_tag);
+                
+                /* A late CSW in the middle of our data means the device is a whole command behind, which only a reset recovery fixes */
+                bool late_status = (status.signature == SCSI_CSW_SIGNATURE && this->IsStaleTag(status.tag));
+                
+                if (current_status || late_status) {
+                    if (current_status) {
+                        *out_status = status;
+                        *out_got_status = true;
+                    } else {
+                        FSP_USB_LOG("%s (interface ID %d): received stale CSW (tag 0x%08X) during data stage.", __func__, this->client->ID, status.tag);
+                        this->recovery.NotifyStaleStatus();
+                        stale_status = true;
+                    }
+                    
+                    /* Nothing else is coming for this command, so whatever is still posted would only complete on the deadline */
+                    if (pending_count > 0) {
+                        this->CancelTransfers(endpoint);
+                        pending_count = 0;
+                    }
+                    xfer_ok = false;
+                    continue;
+                }
+            }
+            
+            if (short_chunk) {
+                /* Data after a short chunk isn't ours anymore, ReadStatus will look for the CSW */
+                if (pending_count > 0) {
+                    this->CancelTransfers(endpoint);
+                    pending_count = 0;
+                }
+                continue;
+            }
+            
+            if (dir == SCSIDirection::In && !t.direct) {
+                memcpy(t.data, t.xfer_buffer, transferred);
+                this->data_bytes_copied += transferred;
+            }
+            
+            *total_transferred += transferred;
+            this->data_bytes_transferred += transferred;
+            
+            if (transferred != t.size) {
+                /* A short IN chunk ends the data stage, and the next chunk already posted gets the CSW */
+                xfer_ok = false;
+                short_chunk = true;
+                if (dir == SCSIDirection::Out && pending_count > 0) {
+                    this->CancelTransfers(endpoint);
+                    pending_count = 0;
+                }
+                continue;
+            }
+            
+            this->transfer_policy.NotifySuccess(t.size, (t.direct ? this->transfer_policy.GetChunkSize() : (u32)BounceSlotSize));
         }
-        if(this->buf_c != nullptr) {
-            FreeUSBTransferMemoryBlock(this->buf_c);
+        
+        /* Recovery is up to the caller, since what to do depends on the kind of error */
+        if (stale_status && R_SUCCEEDED(xfer_rc)) return BOTError::PhaseError;
+        BOTError err = this->recovery.Classify(xfer_rc, endpoint);
+        
+        /* Babble and timeouts hint at an oversized chunk, short transfers don't */
+        /* A stall is also how a device ends the data stage of a command it fails, so only the CSW after it can tell */
+        if (failed_size > 0) {
+            if (err == BOTError::Stall) {
+                *out_stalled_size = failed_size;
+            } else if (err != BOTError::None) {
+                this->transfer_policy.NotifyFailure(failed_size, true);
+            }
         }
+        
+        return err;
     }
 
-    SCSICommandStatus SCSIDevice::ReadStatus() {
+    bool SCSIDevice::IsStaleTag(u32 tag) {
+        /* Tags of the last few commands, which may still have a late CSW on its way */
+        u32 age = (this->current_tag - tag);
+        return (age > 0 && age <= SCSI_STALE_TAG_WINDOW);
+    }
+
+    BOTError SCSIDevice::ReadStatus(SCSICommandStatus *out_status) {
         u32 in_len = 0;
         SCSICommandStatus status;
         memset(&status, 0, sizeof(SCSICommandStatus));
+        BOTError err = BOTError::None;
 
         if (this->ok) {
             FSP_USB_LOG("%s (interface ID %d): OK to proceed.", __func__, this->client->ID);
             
-            Result rc = PostUSBBuffer(this->client, this->out_endpoint, this->buf_c, SCSI_CSW_SIZE, &in_len);
-            
-            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (in_len -> %u) (%s).", __func__, this->client->ID, rc, in_len, (R_SUCCEEDED(rc) && in_len == SCSI_CSW_SIZE ? "succeeded" : "failed"));
-            
-            if (R_SUCCEEDED(rc) && in_len == SCSI_CSW_SIZE) {
+            /* A late CSW for an earlier command is just dropped, and the next one read in its place */
+            for(u32 i = 0; i <= SCSI_STALE_CSW_MAX_SKIP; i++) {
+                Result rc = PostUSBBuffer(this->client, this->out_endpoint, this->buf_c, SCSI_CSW_SIZE, &in_len, false, this->GetRemainingTime());
+                
+                FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (in_len -> %u) (%s).", __func__, this->client->ID, rc, in_len, (R_SUCCEEDED(rc) && in_len == SCSI_CSW_SIZE ? "succeeded" : "failed"));
+                
+                if (R_FAILED(rc)) {
+                    if (rc == KERNELRESULT(TimedOut)) this->CancelTransfers(this->out_endpoint);
+                    err = this->recovery.Classify(rc, this->out_endpoint);
+                    break;
+                }
+                
+                if (in_len != SCSI_CSW_SIZE) {
+                    err = BOTError::PhaseError;
+                    break;
+                }
+                
                 memcpy(&status, this->buf_c, SCSI_CSW_SIZE);
                 
-                FSP_USB_LOG("%s (interface ID %d): CSW signature -> 0x%08X (%s) | CSW tag -> 0x%08X (%s).", __func__, this->client->ID, status.signature, (status.signature == SCSI_CSW_SIGNATURE ? "valid" : "invalid"), status.tag, (status.tag == SCSI_TAG ? "valid" : "invalid"));
+                bool valid_signature = (status.signature == SCSI_CSW_SIGNATURE);
+                FSP_USB_LOG("%s (interface ID %d): CSW signature -> 0x%08X (%s) | CSW tag -> 0x%08X (%s).", __func__, this->client->ID, status.signature, (valid_signature ? "valid" : "invalid"), status.tag, (status.tag == this->current_tag ? "valid" : (this->IsStaleTag(status.tag) ? "stale" : "invalid")));
                 
-                if (status.signature == SCSI_CSW_SIGNATURE && status.tag == SCSI_TAG)
+                if (valid_signature && status.tag == this->current_tag)
                 {
                     FSP_USB_LOG("%s (interface ID %d): CSW status -> 0x%02X (%s).", __func__, this->client->ID, status.status, (status.status == SCSI_CMD_STATUS_SUCCESS ? "success" : (status.status == SCSI_CMD_STATUS_FAILED ? "failed" : (status.status == SCSI_CMD_STATUS_PHASE_ERROR ? "phase error" : "unknown / invalid"))));
                     
-                    if (status.status == SCSI_CMD_STATUS_PHASE_ERROR)
-                    {
-                        // Perform a full bulk-only reset recovery if we got a phase error
-                        FSP_USB_LOG("%s (interface ID %d): performing bulk-only mass storage reset recovery.", __func__, this->client->ID);
-                        ResetBulkStorage(this->client, this->in_endpoint, this->out_endpoint);
-                    }
-                } else {
-                    // Perform a full bulk-only reset recovery if we got an invalid CSW signature or tag
-                    FSP_USB_LOG("%s (interface ID %d): performing bulk-only mass storage reset recovery.", __func__, this->client->ID);
-                    ResetBulkStorage(this->client, this->in_endpoint, this->out_endpoint);
-                    this->ok = false;
+                    err = ((status.status == SCSI_CMD_STATUS_PHASE_ERROR) ? BOTError::PhaseError : BOTError::None);
+                    break;
                 }
-            } else {
-                this->ok = false;
+                
+                // An invalid CSW signature or unknown tag is handled just like a phase error, and so is running out of stale CSW skips
+                err = BOTError::PhaseError;
+                if (!valid_signature || !this->IsStaleTag(status.tag)) {
+                    break;
+                }
+                
+                this->recovery.NotifyStaleStatus();
             }
         } else {
             FSP_USB_LOG("%s (interface ID %d): not OK to proceed.", __func__, this->client->ID);
         }
 
-        return status;
+        *out_status = status;
+        return err;
     }
 
-    void SCSIDevice::PushCommand(SCSICommand &cmd, u32 diff) {
+    BOTError SCSIDevice::PushCommand(SCSICommand &cmd) {
+        BOTError err = BOTError::None;
+
         if(this->ok) {
             FSP_USB_LOG("%s (interface ID %d): OK to proceed.", __func__, this->client->ID);
             
-            memset(this->buf_a, 0, BufferSize);
-
-            if (diff > 0) {
-                FSP_USB_LOG("%s (interface ID %d): data transfer length difference provided -> %u.", __func__, this->client->ID, diff);
-                u32 data_len = cmd.GetDataTransferLength();
-                FSP_USB_LOG("%s (interface ID %d): current data transfer length -> %u.", __func__, this->client->ID, data_len);
-                if (data_len > 0 && diff < data_len) {
-                    // Update data transfer length field
-                    data_len -= diff;
-                    cmd.SetDataTransferLength(data_len);
-                    FSP_USB_LOG("%s (interface ID %d): updated data transfer length -> %u.", __func__, this->client->ID, cmd.GetDataTransferLength());
-                } else {
-                    FSP_USB_LOG("%s (interface ID %d): ignoring data transfer length difference.", __func__, this->client->ID);
-                }
-            }
-
+            /* Every CBW gets a new tag (retries included), so its CSW can't be mistaken for an earlier one */
+            this->current_tag = this->next_tag++;
+            cmd.SetTag(this->current_tag);
             cmd.ToBytes(this->buf_a);
             
             u32 out_len = 0;
-            auto rc = PostUSBBuffer(this->client, this->in_endpoint, this->buf_a, SCSIBuffer::BufferSize, &out_len);
-            this->ok = (R_SUCCEEDED(rc) && out_len == SCSIBuffer::BufferSize);
+            auto rc = PostUSBBuffer(this->client, this->in_endpoint, this->buf_a, SCSI_CBW_SIZE, &out_len, false, this->GetRemainingTime());
             
-            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (out_len -> %u) (%s).", __func__, this->client->ID, rc, out_len, (R_SUCCEEDED(rc) && out_len == SCSIBuffer::BufferSize ? "succeeded" : "failed"));
+            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (out_len -> %u) (%s).", __func__, this->client->ID, rc, out_len, (R_SUCCEEDED(rc) && out_len == SCSI_CBW_SIZE ? "succeeded" : "failed"));
             
             if (R_FAILED(rc)) {
-                // Check if the endpoint is stalled
-                if (GetEndpointStatus(this->client, this->in_endpoint)) {
-                    // Perform a full bulk-only reset recovery
-                    FSP_USB_LOG("%s (interface ID %d): endpoint stalled. Performing bulk-only mass storage reset recovery.", __func__, this->client->ID);
-                    ResetBulkStorage(this->client, this->in_endpoint, this->out_endpoint);
-                }
+                if (rc == KERNELRESULT(TimedOut)) this->CancelTransfers(this->in_endpoint);
+                err = this->recovery.Classify(rc, this->in_endpoint);
+            } else if (out_len != SCSI_CBW_SIZE) {
+                err = BOTError::Babble;
             }
         } else {
             FSP_USB_LOG("%s (interface ID %d): not OK to proceed.", __func__, this->client->ID);
         }
+
+        return err;
     }
 
     SCSICommandStatus SCSIDevice::TransferCommand(SCSICommand &c, u8 *buffer) {
         SCSICommandStatus status;
         memset(&status, 0, sizeof(SCSICommandStatus));
         
-        Result rc = 0;
-        
         if (this->ok) {
             FSP_USB_LOG("%s (interface ID %d): OK to proceed.", __func__, this->client->ID);
             
-            u32 total_transferred = 0;
-            u32 transferred = 0;
-            u32 block_size = (u32)(BufferSize * USB_TRANSFER_MEMORY_MAX_MULTIPLIER);
+            SCSIDirection dir = c.GetDirection();
             u32 transfer_length = c.GetDataTransferLength();
-            u32 cur_transfer_size = 0;
+            u32 total_transferred = 0;
             bool received_status = false;
             
-            FSP_USB_LOG("%s (interface ID %d): block size -> %u | data transfer length -> %u | %s buffer | direction -> %s.", __func__, this->client->ID, block_size, transfer_length, (buffer == nullptr ? "invalid" : "valid"), (c.GetDirection() == SCSIDirection::In ? "in" : "out"));
+            FSP_USB_LOG("%s (interface ID %d): data transfer length -> %u | %s buffer | direction -> %s.", __func__, this->client->ID, transfer_length, (buffer == nullptr ? "invalid" : "valid"), (dir == SCSIDirection::In ? "in" : "out"));
             
-            for(u32 i = 0; i < SCSI_TRANSFER_RETRIES; i++) {
-                this->ok = true;
-                
+            for(u32 i = 0; i < SCSI_TRANSFER_RETRIES && this->ok; i++) {
                 FSP_USB_LOG("%s (interface ID %d): attempt #%u.", __func__, this->client->ID, i + 1);
                 
-                this->PushCommand(c, total_transferred);
-                if (!this->ok) {
+                /* Every attempt resends the whole command, so retries can't get out of sync with the device */
+                this->recovery.Backoff(i);
+                total_transferred = 0;
+                
+                /* Timeouts are handled like any other transport error, which means a reset recovery before the next attempt */
+                this->deadline_tick = (armGetSystemTick() + armNsToTicks(c.GetTimeout()));
+                
+                BOTError err = this->PushCommand(c);
+                if (err != BOTError::None) {
+                    this->recovery.Recover(err, BOTStage::Command, this->in_endpoint, &this->ok);
                     continue;
                 }
                 
+                u32 stalled_size = 0;
                 if (buffer != nullptr && transfer_length > 0) {
-                    if (c.GetDirection() == SCSIDirection::In) {
-                        while(total_transferred < transfer_length) {
-                            cur_transfer_size = ((transfer_length - total_transferred) > block_size ? block_size : (transfer_length - total_transferred));
-                            FSP_USB_LOG("%s (interface ID %d): total transferred data length -> %u | current transfer size -> %u.", __func__, this->client->ID, total_transferred, cur_transfer_size);
-                            
-                            transferred = 0;
-                            rc = PostUSBBuffer(this->client, this->out_endpoint, this->buf_b, cur_transfer_size, &transferred);
-                            
-                            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (transferred -> %u) (%s).", __func__, this->client->ID, rc, transferred, (R_SUCCEEDED(rc) && transferred == cur_transfer_size ? "succeeded" : "failed"));
-                            
-                            if (R_FAILED(rc) || transferred != cur_transfer_size) break;
-                            
-                            if (transferred == SCSI_CSW_SIZE)
-                            {
-                                memcpy(&status, this->buf_b, sizeof(status));
-                                if (status.signature == SCSI_CSW_SIGNATURE && status.tag == SCSI_TAG) {
-                                    /* We weren't expecting a CSW, but we got one anyway */
-                                    FSP_USB_LOG("%s (interface ID %d): received unexpected (but valid) CSW.", __func__, this->client->ID);
-                                    return status;
-                                }
-                            }
-                            
-                            memcpy(buffer + total_transferred, this->buf_b, transferred);
-                            total_transferred += transferred;
-                        }
-                    } else {
-                        while(total_transferred < transfer_length) {
-                            cur_transfer_size = ((transfer_length - total_transferred) > block_size ? block_size : (transfer_length - total_transferred));
-                            FSP_USB_LOG("%s (interface ID %d): total transferred data length -> %u | current transfer size -> %u.", __func__, this->client->ID, total_transferred, cur_transfer_size);
-                            
-                            memcpy(this->buf_b, buffer + total_transferred, cur_transfer_size);
-                            
-                            transferred = 0;
-                            rc = PostUSBBuffer(this->client, this->in_endpoint, this->buf_b, cur_transfer_size, &transferred);
-                            
-                            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (transferred -> %u) (%s).", __func__, this->client->ID, rc, transferred, (R_SUCCEEDED(rc) && transferred == cur_transfer_size ? "succeeded" : "failed"));
-                            
-                            if (R_FAILED(rc) || transferred != cur_transfer_size) break;
-                            
-                            total_transferred += transferred;
-                        }
+                    bool got_status = false;
+                    err = this->TransferData(c, buffer, &total_transferred, &status, &got_status, &stalled_size);
+                    if (got_status) {
+                        /* We weren't expecting a CSW, but we got one anyway */
+                        FSP_USB_LOG("%s (interface ID %d): received unexpected (but valid) CSW.", __func__, this->client->ID);
+                        received_status = true;
+                        break;
                     }
                     
-                    if (total_transferred < transfer_length) continue;
+                    /* After a cleared data stall the device still sends its CSW */
+                    if (err != BOTError::None && !this->recovery.Recover(err, BOTStage::Data, this->GetDataEndpoint(dir), &this->ok)) {
+                        continue;
+                    }
+                }
+                
+                err = this->ReadStatus(&status);
+                
+                /* A stalled CSW read gets exactly one more try once the halt is cleared */
+                if (err != BOTError::None && this->recovery.Recover(err, BOTStage::Status, this->out_endpoint, &this->ok)) {
+                    err = this->ReadStatus(&status);
+                    if (err != BOTError::None) this->recovery.Recover(err, BOTStage::StatusRetry, this->out_endpoint, &this->ok);
                 }
                 
-                status = this->ReadStatus();
-                if (!this->ok) {
+                if (err != BOTError::None) {
+                    /* A failed (or passed, short) command behind the data stall is fine, a device which lost track of it might not like the chunk size */
+                    if (stalled_size > 0) this->transfer_policy.NotifyFailure(stalled_size, false);
                     continue;
                 }
                 
@@ -426,6 +661,15 @@ namespace fspusb::impl {
             
             if (!received_status) {
                 status.status = SCSI_CMD_STATUS_FAILED;
+            } else {
+                /* Short transfers are final, the residue tells the caller how much of the command actually went through */
+                /* Whichever of the device's residue and what we saw on the bus is bigger wins (BOT 6.7.2 / 6.7.3, cases 4 / 5 / 9 / 11) */
+                u32 bus_residue = ((buffer != nullptr) ? (transfer_length - total_transferred) : transfer_length);
+                status.data_residue = std::min(std::max(status.data_residue, bus_residue), transfer_length);
+                
+                if (status.data_residue > 0) {
+                    FSP_USB_LOG("%s (interface ID %d): short transfer -> %u of %u bytes.", __func__, this->client->ID, transfer_length - status.data_residue, transfer_length);
+                }
             }
         } else {
             status.status = SCSI_CMD_STATUS_FAILED;
@@ -435,7 +679,7 @@ namespace fspusb::impl {
         return status;
     }
 
-    SCSIBlock::SCSIBlock(SCSIDevice *dev) : capacity(0), block_size(0), device(dev), ok(true) {
+    SCSIBlock::SCSIBlock(SCSITransport *dev, const DeviceQuirks &dev_quirks) : capacity(0), block_size(0), max_transfer_blocks(0), sync_cache_supported(!dev_quirks.Has(DeviceQuirkFlags_NoSyncCache)), unmap_supported(false), mode_sense_6(false), quirks(dev_quirks), caps(), device(dev), ok(true) {
         SCSICommandStatus status, rs_status;
         u8 lun = this->device->GetDeviceLUN();
         
@@ -453,6 +697,8 @@ namespace fspusb::impl {
         u64 size_lba = 0;
         u32 lba_bytes = 0;
         
+        this->Inquiry();
+        
         FSP_USB_LOG("%s: sending TestUnitReady command.", __func__);
         status = this->device->TransferCommand(test_unit_ready, nullptr);
         if (status.status != SCSI_CMD_STATUS_SUCCESS)
@@ -460,8 +706,16 @@ namespace fspusb::impl {
             FSP_USB_LOG("%s: TestUnitReady command failed (0x%02X).", __func__, status.status);
             
             this->ok = true; // Manually set back to true
-            FSP_USB_LOG("%s: sending RequestSense command.", __func__);
-            rs_status = this->device->TransferCommand(request_sense, request_sense_response);
+            if (status.sense_len > 0) {
+                /* Already got it along with the status */
+                memcpy(request_sense_response, status.sense, status.sense_len);
+                rs_status = status;
+                rs_status.status = SCSI_CMD_STATUS_SUCCESS;
+                rs_status.sense_len = 0;
+            } else {
+                FSP_USB_LOG("%s: sending RequestSense command.", __func__);
+                rs_status = this->device->TransferCommand(request_sense, request_sense_response);
+            }
             if (rs_status.status == SCSI_CMD_STATUS_SUCCESS)
             {
                 u8 sense_key = (request_sense_response[2] & 0x0F);
@@ -479,6 +733,13 @@ namespace fspusb::impl {
                         break;
                     case SCSI_SENSE_ABORTED_COMMAND:
                     case SCSI_SENSE_NOT_READY:
+                        if (sense_key == SCSI_SENSE_NOT_READY && request_sense_response[12] == SCSI_ASC_MEDIUM_NOT_PRESENT) {
+                            // Empty card reader slot, no point in waiting for it
+                            this->ok = false;
+                            FSP_USB_LOG("%s: medium not present.", __func__);
+                            break;
+                        }
+                        
                         if (sense_key == SCSI_SENSE_NOT_READY) {
                             // Wait 3 seconds
                             FSP_USB_LOG("%s: waiting for drive to become ready.", __func__);
@@ -540,6 +801,9 @@ namespace fspusb::impl {
                     
                     this->capacity = (size_lba * (u64)lba_bytes);
                     this->block_size = lba_bytes;
+                } else if (this->quirks.Has(DeviceQuirkFlags_NoReadCapacity16)) {
+                    this->ok = false;
+                    FSP_USB_LOG("%s: invalid or maxed out total block count returned by ReadCapacity10 command, and ReadCapacity16 is disabled for this device.", __func__);
                 } else {
                     // Issue a Read Capacity 16 command
                     FSP_USB_LOG("%s: invalid or maxed out total block count returned by ReadCapacity10 command.", __func__);
@@ -565,6 +829,32 @@ namespace fspusb::impl {
                 FSP_USB_LOG("%s: total block count -> 0x%016lX | block size -> 0x%08X | capacity -> 0x%016lX.", __func__, size_lba, lba_bytes, this->capacity);
                 
                 if (this->ok && (!this->capacity || !this->block_size)) this->ok = false;
+                
+                if (this->ok) {
+                    this->QueryVPDPages();
+                    this->QueryModePages();
+                    
+                    /* Trust the device's own limits if it reports them, otherwise use the transport's default */
+                    u32 max_size = this->device->GetMaxTransferSize();
+                    if (this->caps.max_transfer_blocks > 0) {
+                        max_size = (u32)std::min((u64)this->caps.max_transfer_blocks * this->block_size, (u64)0xFFFFFFFF);
+                    }
+                    
+                    /* Unless we know better */
+                    if (this->quirks.max_transfer_size > 0) {
+                        max_size = std::min(max_size, this->quirks.max_transfer_size);
+                    }
+                    
+                    /* The CBW data transfer length is 32-bit, so that's a hard limit too */
+                    this->max_transfer_blocks = std::max(max_size / this->block_size, (u32)1);
+                    
+                    /* Going past the optimal transfer length may incur delays, per SBC */
+                    if (this->caps.optimal_transfer_blocks > 0) {
+                        this->max_transfer_blocks = std::min(this->max_transfer_blocks, this->caps.optimal_transfer_blocks);
+                    }
+                    
+                    FSP_USB_LOG("%s: max transfer blocks -> 0x%08X | granularity -> 0x%04X | %s medium.", __func__, this->max_transfer_blocks, this->caps.optimal_transfer_granularity, (this->caps.IsRotational() ? "rotational" : "non-rotational / unknown"));
+                }
             } else {
                 this->ok = false;
                 FSP_USB_LOG("%s: ReadCapacity10 command failed (0x%02X).", __func__, status.status);
@@ -572,43 +862,512 @@ namespace fspusb::impl {
         }
     }
 
-    int SCSIBlock::ReadSectors(u8 *buffer, u64 sector_offset, u32 num_sectors) {
+    void SCSIBlock::Inquiry() {
+        SCSIInquiryCommand inquiry(SCSI_INQUIRY_REPLY_LEN, false, 0, this->device->GetDeviceLUN());
+        u8 inquiry_response[SCSI_INQUIRY_REPLY_LEN] = {0};
+        
+        FSP_USB_LOG("%s: sending Inquiry command.", __func__);
+        auto status = this->device->TransferCommand(inquiry, inquiry_response);
+        if (status.status != SCSI_CMD_STATUS_SUCCESS) {
+            /* Not fatal, we just won't know anything about the device */
+            FSP_USB_LOG("%s: Inquiry command failed (0x%02X).", __func__, status.status);
+            return;
+        }
+        
+        this->caps.device_type = (inquiry_response[0] & 0x1F);
+        this->caps.removable = (inquiry_response[1] & 0x80);
+        this->caps.version = inquiry_response[2];
+        memcpy(this->caps.vendor_id, &inquiry_response[8], 8);
+        memcpy(this->caps.product_id, &inquiry_response[16], 16);
+        memcpy(this->caps.product_revision, &inquiry_response[32], 4);
+        
+        FSP_USB_LOG("%s: \"%s\" \"%s\" \"%s\" | device type -> 0x%02X | version -> 0x%02X | %s.", __func__, this->caps.vendor_id, this->caps.product_id, this->caps.product_revision, this->caps.device_type, this->caps.version, (this->caps.removable ? "removable" : "fixed"));
+    }
+
+    bool SCSIBlock::ReadVPDPage(u8 page, u8 *out, u16 *out_len) {
+        u8 lun = this->device->GetDeviceLUN();
+        
+        /* Read the header first, then exactly the page length, so the device never has to end the data phase early */
+        SCSIInquiryCommand header_inquiry(SCSI_VPD_HEADER_LEN, true, page, lun);
+        auto status = this->device->TransferCommand(header_inquiry, out);
+        if (status.status != SCSI_CMD_STATUS_SUCCESS || out[1] != page) {
+            FSP_USB_LOG("%s: VPD page 0x%02X header read failed (0x%02X).", __func__, page, status.status);
+            return false;
+        }
+        
+        u16 page_len = std::min((u16)(SCSI_VPD_HEADER_LEN + ((out[2] << 8) | out[3])), (u16)SCSI_VPD_MAX_LEN);
+        SCSIInquiryCommand inquiry(page_len, true, page, lun);
+        status = this->device->TransferCommand(inquiry, out);
+        if (status.status != SCSI_CMD_STATUS_SUCCESS) {
+            FSP_USB_LOG("%s: VPD page 0x%02X read failed (0x%02X).", __func__, page, status.status);
+            return false;
+        }
+        
+        *out_len = page_len;
+        return true;
+    }
+
+    void SCSIBlock::QueryVPDPages() {
+        /* Plenty of USB bridges hang on VPD requests, so only ask devices claiming SPC-3 or newer */
+        if (this->caps.version < SCSI_VERSION_SPC_3 || this->quirks.Has(DeviceQuirkFlags_NoVPD)) {
+            FSP_USB_LOG("%s: skipping VPD pages (version 0x%02X).", __func__, this->caps.version);
+            return;
+        }
+        
+        u8 vpd[SCSI_VPD_MAX_LEN] = {0};
+        u16 vpd_len = 0;
+        bool has_block_limits = false, has_characteristics = false;
+        
+        if (!this->ReadVPDPage(SCSI_VPD_SUPPORTED_PAGES, vpd, &vpd_len)) return;
+        
+        for(u16 i = SCSI_VPD_HEADER_LEN; i < vpd_len; i++) {
+            if (vpd[i] == SCSI_VPD_BLOCK_LIMITS) has_block_limits = true;
+            if (vpd[i] == SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS) has_characteristics = true;
+        }
+        
+        if (has_block_limits && this->ReadVPDPage(SCSI_VPD_BLOCK_LIMITS, vpd, &vpd_len) && vpd_len >= 0x10) {
+            this->caps.has_block_limits = true;
+            this->caps.optimal_transfer_granularity = (u16)((vpd[6] << 8) | vpd[7]);
+            this->caps.max_transfer_blocks = __builtin_bswap32(*(u32*)&vpd[8]);
+            this->caps.optimal_transfer_blocks = __builtin_bswap32(*(u32*)&vpd[12]);
+            if (vpd_len >= 0x24) {
+                this->caps.max_unmap_blocks = __builtin_bswap32(*(u32*)&vpd[20]);
+                this->caps.max_unmap_descriptors = __builtin_bswap32(*(u32*)&vpd[24]);
+                this->caps.unmap_granularity = __builtin_bswap32(*(u32*)&vpd[28]);
+                u32 alignment = __builtin_bswap32(*(u32*)&vpd[32]);
+                if (alignment & 0x80000000) this->caps.unmap_granularity_alignment = (alignment & 0x7FFFFFFF); // UGAVALID
+            }
+            
+            /* Drives which can't unmap report zero limits here */
+            this->unmap_supported = (this->caps.max_unmap_blocks > 0 && this->caps.max_unmap_descriptors > 0 && !this->quirks.Has(DeviceQuirkFlags_NoUnmap));
+            FSP_USB_LOG("%s: block limits -> max transfer 0x%08X | optimal transfer 0x%08X | max unmap 0x%08X (%u descriptors).", __func__, this->caps.max_transfer_blocks, this->caps.optimal_transfer_blocks, this->caps.max_unmap_blocks, this->caps.max_unmap_descriptors);
+        }
+        
+        if (has_characteristics && this->ReadVPDPage(SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS, vpd, &vpd_len) && vpd_len >= 0x06) {
+            this->caps.has_characteristics = true;
+            this->caps.rotation_rate = (u16)((vpd[4] << 8) | vpd[5]);
+            FSP_USB_LOG("%s: block device characteristics -> rotation rate 0x%04X.", __func__, this->caps.rotation_rate);
+        }
+    }
+
+    bool SCSIBlock::ModeSense(u8 page_control, u8 page, u8 *out, u32 *out_len) {
+        u8 lun = this->device->GetDeviceLUN();
+        SCSICommandStatus status = {};
+        
+        while(true) {
+            memset(out, 0, SCSI_MODE_SENSE_MAX_LEN);
+            
+            if (this->mode_sense_6) {
+                SCSIModeSense6Command mode_sense_6(page_control, page, SCSI_MODE_SENSE_MAX_LEN, lun);
+                status = this->device->TransferCommand(mode_sense_6, out);
+            } else {
+                SCSIModeSense10Command mode_sense_10(page_control, page, SCSI_MODE_SENSE_MAX_LEN, lun);
+                status = this->device->TransferCommand(mode_sense_10, out);
+            }
+            
+            if (status.status == SCSI_CMD_STATUS_SUCCESS) break;
+            
+            u8 sense_key = this->RequestSenseKey(status);
+            FSP_USB_LOG("%s: ModeSense%s command failed for page 0x%02X (0x%02X). Sense key: 0x%02X.", __func__, (this->mode_sense_6 ? "6" : "10"), page, status.status, sense_key);
+            
+            /* Older devices only know the 6-byte variant, which we can only tell before any MODE SENSE went through */
+            if (sense_key != SCSI_SENSE_ILLEGAL_REQUEST || this->mode_sense_6 || this->caps.has_mode_pages) {
+                return false;
+            }
+            
+            this->mode_sense_6 = true;
+        }
+        
+        /* The device may return less than the mode data length says, if we asked for too little */
+        u32 header_len = (this->mode_sense_6 ? SCSI_MODE_SENSE_6_HEADER_LEN : SCSI_MODE_SENSE_10_HEADER_LEN);
+        u32 received = (SCSI_MODE_SENSE_MAX_LEN - std::min(status.data_residue, (u32)SCSI_MODE_SENSE_MAX_LEN));
+        u32 data_len = (this->mode_sense_6 ? (out[0] + 1) : (((out[0] << 8) | out[1]) + 2));
+        
+        *out_len = std::min(data_len, received);
+        return *out_len >= header_len;
+    }
+
+    u8 *SCSIBlock::FindModePage(u8 *data, u32 data_len, u8 page, u32 min_page_len) {
+        u32 header_len = (this->mode_sense_6 ? SCSI_MODE_SENSE_6_HEADER_LEN : SCSI_MODE_SENSE_10_HEADER_LEN);
+        u32 block_desc_len = (this->mode_sense_6 ? data[3] : ((data[6] << 8) | data[7]));
+        u32 offset = (header_len + block_desc_len);
+        
+        while((offset + 2) <= data_len) {
+            u8 *page_data = (data + offset);
+            bool sub_page = (page_data[0] & 0x40);
+            if (sub_page && (offset + 4) > data_len) break;
+            
+            u32 page_len = (sub_page ? (((page_data[2] << 8) | page_data[3]) + 4) : (page_data[1] + 2));
+            if ((offset + page_len) > data_len) break;
+            
+            if (!sub_page && (page_data[0] & 0x3F) == page) {
+                return (page_len >= min_page_len ? page_data : nullptr);
+            }
+            
+            offset += page_len;
+        }
+        
+        return nullptr;
+    }
+
+    bool SCSIBlock::ModeSelect(u8 *page_data, u32 page_len) {
+        u8 lun = this->device->GetDeviceLUN();
+        u8 param_list[SCSI_MODE_SENSE_MAX_LEN] = {0};
+        u32 header_len = (this->mode_sense_6 ? SCSI_MODE_SENSE_6_HEADER_LEN : SCSI_MODE_SENSE_10_HEADER_LEN);
+        SCSICommandStatus status;
+        
+        if ((header_len + page_len) > SCSI_MODE_SENSE_MAX_LEN) return false;
+        
+        /* The mode data length is reserved here, and we don't send any block descriptors */
+        memcpy(param_list + header_len, page_data, page_len);
+        param_list[header_len] &= 0x3F; // PS is reserved too
+        
+        if (this->mode_sense_6) {
+            SCSIModeSelect6Command mode_select_6((u8)(header_len + page_len), lun);
+            status = this->device->TransferCommand(mode_select_6, param_list);
+        } else {
+            SCSIModeSelect10Command mode_select_10((u16)(header_len + page_len), lun);
+            status = this->device->TransferCommand(mode_select_10, param_list);
+        }
+        
+        if (status.status != SCSI_CMD_STATUS_SUCCESS) {
+            u8 sense_key = this->RequestSenseKey(status);
+            FSP_USB_LOG("%s: ModeSelect%s command failed (0x%02X). Sense key: 0x%02X.", __func__, (this->mode_sense_6 ? "6" : "10"), status.status, sense_key);
+            return false;
+        }
+        
+        return true;
+    }
+
+    void SCSIBlock::EnableWriteCache(u8 *caching_page) {
+        u8 mode_data[SCSI_MODE_SENSE_MAX_LEN] = {0};
+        u32 mode_len = 0;
+        
+        /* Only try it if the device says WCE can actually be changed */
+        if (!this->ModeSense(SCSI_MODE_PC_CHANGEABLE, SCSI_MODE_PAGE_CACHING, mode_data, &mode_len)) return;
+        
+        u8 *changeable = this->FindModePage(mode_data, mode_len, SCSI_MODE_PAGE_CACHING, 3);
+        if (changeable == nullptr || !(changeable[2] & SCSI_MODE_CACHING_WCE)) {
+            FSP_USB_LOG("%s: write cache setting can't be changed.", __func__);
+            return;
+        }
+        
+        u8 page[SCSI_MODE_SENSE_MAX_LEN] = {0};
+        u32 page_len = (caching_page[1] + 2);
+        memcpy(page, caching_page, page_len);
+        page[2] |= SCSI_MODE_CACHING_WCE;
+        
+        if (!this->ModeSelect(page, page_len)) return;
+        
+        /* Read it back, since some devices happily take MODE SELECT and ignore it */
+        if (this->ModeSense(SCSI_MODE_PC_CURRENT, SCSI_MODE_PAGE_CACHING, mode_data, &mode_len)) {
+            u8 *current = this->FindModePage(mode_data, mode_len, SCSI_MODE_PAGE_CACHING, 3);
+            if (current != nullptr) this->caps.write_cache_enabled = (current[2] & SCSI_MODE_CACHING_WCE);
+        }
+        
+        FSP_USB_LOG("%s: write cache %s.", __func__, (this->caps.write_cache_enabled ? "enabled" : "still disabled"));
+    }
+
+    void SCSIBlock::QueryModePages() {
+        u8 mode_data[SCSI_MODE_SENSE_MAX_LEN] = {0};
+        u32 mode_len = 0;
+        
+        if (this->quirks.Has(DeviceQuirkFlags_NoModeSense)) {
+            FSP_USB_LOG("%s: skipping mode pages.", __func__);
+            return;
+        }
+        
+        if (!this->ModeSense(SCSI_MODE_PC_CURRENT, SCSI_MODE_PAGE_ALL, mode_data, &mode_len)) {
+            /* Not fatal, we'll just assume the medium is writable and the device may have a write cache */
+            FSP_USB_LOG("%s: no mode pages available.", __func__);
+            return;
+        }
+        
+        this->caps.has_mode_pages = true;
+        this->caps.write_protected = (mode_data[this->mode_sense_6 ? 2 : 3] & SCSI_MODE_DEVICE_SPECIFIC_WP);
+        
+        u8 *control = this->FindModePage(mode_data, mode_len, SCSI_MODE_PAGE_CONTROL, 5);
+        if (control != nullptr && (control[4] & SCSI_MODE_CONTROL_SWP)) this->caps.write_protected = true;
+        
+        /* Not every device lists the caching page along with all the others */
+        u8 *caching = this->FindModePage(mode_data, mode_len, SCSI_MODE_PAGE_CACHING, 3);
+        if (caching == nullptr && this->ModeSense(SCSI_MODE_PC_CURRENT, SCSI_MODE_PAGE_CACHING, mode_data, &mode_len)) {
+            caching = this->FindModePage(mode_data, mode_len, SCSI_MODE_PAGE_CACHING, 3);
+        }
+        
+        if (caching != nullptr) {
+            this->caps.has_caching_page = true;
+            this->caps.write_cache_enabled = (caching[2] & SCSI_MODE_CACHING_WCE);
+            this->caps.read_cache_disabled = (caching[2] & SCSI_MODE_CACHING_RCD);
+            
+            /* A volatile write cache loses whatever wasn't flushed on power loss, so it's only turned on for devices listed for it */
+            if (this->quirks.Has(DeviceQuirkFlags_EnableWriteCache) && !this->caps.write_cache_enabled && !this->caps.write_protected && this->sync_cache_supported) {
+                this->EnableWriteCache(caching);
+            }
+        }
+        
+        FSP_USB_LOG("%s: mode pages -> %s | write cache %s | read cache %s.", __func__, (this->caps.write_protected ? "write-protected" : "writable"), (this->caps.has_caching_page ? (this->caps.write_cache_enabled ? "enabled" : "disabled") : "unknown"), (this->caps.read_cache_disabled ? "disabled" : "enabled"));
+    }
+
+    u32 SCSIBlock::GetCommandMaxBlocks(u64 sector_offset, u32 num_sectors) {
+        u32 max_blocks = std::min(num_sectors, this->max_transfer_blocks);
+        
+        /* READ(10)/WRITE(10) can only address 32-bit LBAs and move up to 0xFFFF blocks, the 16-byte variants take the rest */
+        if ((sector_offset + max_blocks) <= SCSI_MAX_BLOCK_10) {
+            max_blocks = std::min(max_blocks, (u32)SCSI_MAX_TRANSFER_BLOCKS_10);
+        }
+        
+        /* Split on the device's preferred granularity if a command has to be cut anyway */
+        u16 granularity = this->caps.optimal_transfer_granularity;
+        if (max_blocks < num_sectors && granularity > 1) {
+            u32 misalignment = (u32)((sector_offset + max_blocks) % granularity);
+            if (misalignment < max_blocks) max_blocks -= misalignment;
+        }
+        
+        return max_blocks;
+    }
+
+    int SCSIBlock::TransferSectors(u8 *buffer, u64 sector_offset, u32 num_sectors, SCSIDirection dir) {
         if(!this->Ok()) {
             return 0;
         }
         
-        FSP_USB_LOG("%s: LBA address -> 0x%016lX | sector count -> 0x%08X.", __func__, sector_offset, num_sectors);
+        FSP_USB_LOG("%s: LBA address -> 0x%016lX | sector count -> 0x%08X | direction -> %s.", __func__, sector_offset, num_sectors, (dir == SCSIDirection::In ? "in" : "out"));
         
-        if ((sector_offset + num_sectors) > SCSI_MAX_BLOCK_10) {
-            FSP_USB_LOG("%s: end LBA address exceeds U32_MAX. Sending Read16 command.", __func__);
-            SCSIRead16Command read_16(sector_offset, this->block_size, num_sectors, this->device->GetDeviceLUN());
-            this->device->TransferCommand(read_16, buffer);
-        } else {
-            FSP_USB_LOG("%s: sending Read10 command.", __func__);
-            SCSIRead10Command read_10((u32)sector_offset, this->block_size, (u16)num_sectors, this->device->GetDeviceLUN());
-            this->device->TransferCommand(read_10, buffer);
+        u8 lun = this->device->GetDeviceLUN();
+        u32 done_sectors = 0;
+        
+        while(done_sectors < num_sectors) {
+            /* Split the request in the largest commands the device takes, and hand them to the transport back-to-back */
+            std::unique_ptr<SCSICommand> cmds[SCSI_MAX_BATCHED_COMMANDS];
+            SCSICommand *cmd_ptrs[SCSI_MAX_BATCHED_COMMANDS];
+            u8 *buffers[SCSI_MAX_BATCHED_COMMANDS];
+            u32 cmd_sectors[SCSI_MAX_BATCHED_COMMANDS];
+            SCSICommandStatus statuses[SCSI_MAX_BATCHED_COMMANDS];
+            u32 cmd_count = 0;
+            u32 batch_sectors = done_sectors;
+            
+            while(cmd_count < SCSI_MAX_BATCHED_COMMANDS && batch_sectors < num_sectors) {
+                u64 lba = (sector_offset + batch_sectors);
+                u32 count = this->GetCommandMaxBlocks(lba, num_sectors - batch_sectors);
+                bool use_16 = ((lba + count) > SCSI_MAX_BLOCK_10);
+                
+                if (dir == SCSIDirection::In) {
+                    if (use_16) {
+                        cmds[cmd_count] = std::make_unique<SCSIRead16Command>(lba, this->block_size, count, lun);
+                    } else {
+                        cmds[cmd_count] = std::make_unique<SCSIRead10Command>((u32)lba, this->block_size, (u16)count, lun);
+                    }
+                } else {
+                    if (use_16) {
+                        cmds[cmd_count] = std::make_unique<SCSIWrite16Command>(lba, this->block_size, count, lun);
+                    } else {
+                        cmds[cmd_count] = std::make_unique<SCSIWrite10Command>((u32)lba, this->block_size, (u16)count, lun);
+                    }
+                }
+                
+                FSP_USB_LOG("%s: command #%u -> %s%s | LBA address -> 0x%016lX | sector count -> 0x%08X.", __func__, cmd_count, (dir == SCSIDirection::In ? "Read" : "Write"), (use_16 ? "16" : "10"), lba, count);
+                
+                cmd_ptrs[cmd_count] = cmds[cmd_count].get();
+                buffers[cmd_count] = (buffer + ((u64)batch_sectors * this->block_size));
+                cmd_sectors[cmd_count] = count;
+                batch_sectors += count;
+                cmd_count++;
+            }
+            
+            this->device->TransferCommands(cmd_ptrs, buffers, cmd_count, statuses);
+            
+            for(u32 i = 0; i < cmd_count; i++) {
+                if (statuses[i].status != SCSI_CMD_STATUS_SUCCESS) {
+                    FSP_USB_LOG("%s: command #%u failed (0x%02X).", __func__, i, statuses[i].status);
+                    return done_sectors;
+                }
+                
+                /* A short command still completed every whole block before its residue, report those so the caller can resume from there */
+                u32 cmd_bytes = (cmd_sectors[i] * this->block_size);
+                u32 residue = std::min(statuses[i].data_residue, cmd_bytes);
+                if (residue > 0) {
+                    u32 good_sectors = ((cmd_bytes - residue) / this->block_size);
+                    FSP_USB_LOG("%s: command #%u was short (residue 0x%X), %u of %u sectors transferred.", __func__, i, residue, good_sectors, cmd_sectors[i]);
+                    return (done_sectors + good_sectors);
+                }
+                
+                done_sectors += cmd_sectors[i];
+            }
         }
         
-        return num_sectors;
+        return done_sectors;
+    }
+
+    int SCSIBlock::ReadSectors(u8 *buffer, u64 sector_offset, u32 num_sectors) {
+        return this->TransferSectors(buffer, sector_offset, num_sectors, SCSIDirection::In);
     }
 
     int SCSIBlock::WriteSectors(const u8 *buffer, u64 sector_offset, u32 num_sectors) {
-        if(!this->Ok()) {
+        if (this->caps.write_protected) {
+            FSP_USB_LOG("%s: medium is write-protected.", __func__);
             return 0;
         }
         
-        FSP_USB_LOG("%s: LBA address -> 0x%016lX | sector count -> 0x%08X.", __func__, sector_offset, num_sectors);
+        return this->TransferSectors((u8*)buffer, sector_offset, num_sectors, SCSIDirection::Out);
+    }
+
+    u8 SCSIBlock::RequestSenseKey(const SCSICommandStatus &status) {
+        /* UAS hands us the sense data together with the failed status, a REQUEST SENSE afterwards would only report NO SENSE */
+        if (status.sense_len > 2) {
+            return (status.sense[2] & 0x0F);
+        }
         
-        if ((sector_offset + num_sectors) > SCSI_MAX_BLOCK_10) {
-            FSP_USB_LOG("%s: end LBA address exceeds U32_MAX. Sending Write16 command.", __func__);
-            SCSIWrite16Command write_16(sector_offset, this->block_size, num_sectors, this->device->GetDeviceLUN());
-            this->device->TransferCommand(write_16, (u8*)buffer);
+        SCSIRequestSenseCommand request_sense(SCSI_REQUEST_SENSE_REPLY_LEN, this->device->GetDeviceLUN());
+        u8 request_sense_response[SCSI_REQUEST_SENSE_REPLY_LEN] = {0};
+        
+        auto rs_status = this->device->TransferCommand(request_sense, request_sense_response);
+        if (rs_status.status != SCSI_CMD_STATUS_SUCCESS) {
+            FSP_USB_LOG("%s: RequestSense command failed (0x%02X).", __func__, rs_status.status);
+            return SCSI_SENSE_NO_SENSE;
+        }
+        
+        return (request_sense_response[2] & 0x0F);
+    }
+
+    bool SCSIBlock::SynchronizeCache() {
+        if(!this->Ok()) {
+            return false;
+        }
+        
+        if(!this->sync_cache_supported || this->caps.write_protected) {
+            return true;
+        }
+        
+        /* Write-through drives have nothing cached to flush */
+        if(this->caps.has_caching_page && !this->caps.write_cache_enabled) {
+            return true;
+        }
+        
+        u8 lun = this->device->GetDeviceLUN();
+        SCSICommandStatus status;
+        
+        if ((this->capacity / this->block_size) > SCSI_MAX_BLOCK_10) {
+            SCSISynchronizeCache16Command sync_cache_16(0, 0, lun);
+            status = this->device->TransferCommand(sync_cache_16, nullptr);
         } else {
-            FSP_USB_LOG("%s: sending Write10 command.", __func__);
-            SCSIWrite10Command write_10((u32)sector_offset, this->block_size, (u16)num_sectors, this->device->GetDeviceLUN());
-            this->device->TransferCommand(write_10, (u8*)buffer);
+            SCSISynchronizeCache10Command sync_cache_10(0, 0, lun);
+            status = this->device->TransferCommand(sync_cache_10, nullptr);
+        }
+        
+        if (status.status == SCSI_CMD_STATUS_SUCCESS) {
+            return true;
+        }
+        
+        /* Drives without a write cache may not implement the command at all, in which case there's nothing to flush */
+        u8 sense_key = this->RequestSenseKey(status);
+        FSP_USB_LOG("%s: SynchronizeCache command failed (0x%02X). Sense key: 0x%02X.", __func__, status.status, sense_key);
+        
+        if (sense_key == SCSI_SENSE_ILLEGAL_REQUEST) {
+            this->sync_cache_supported = false;
+            return true;
+        }
+        
+        return false;
+    }
+
+    bool SCSIBlock::AlignUnmapExtent(DiscardExtent &extent) {
+        /* Only whole granules can be unmapped, partial ones at the edges are left alone */
+        u64 granularity = this->caps.unmap_granularity;
+        if (granularity <= 1) {
+            return extent.blocks > 0;
+        }
+        
+        u64 alignment = (this->caps.unmap_granularity_alignment % granularity);
+        u64 start = std::max(extent.lba, alignment);
+        u64 end = (extent.lba + extent.blocks);
+        if (end <= start) {
+            return false;
+        }
+        
+        u64 aligned_start = ((((start - alignment) + granularity - 1) / granularity) * granularity) + alignment;
+        u64 aligned_end = ((((end - alignment) / granularity) * granularity) + alignment);
+        if (aligned_end <= aligned_start) {
+            return false;
+        }
+        
+        extent.lba = aligned_start;
+        extent.blocks = (aligned_end - aligned_start);
+        return true;
+    }
+
+    bool SCSIBlock::Unmap(const DiscardExtent *extents, u32 count) {
+        if(!this->Ok() || !this->unmap_supported || count == 0 || count > SCSI_UNMAP_MAX_DESCRIPTORS) {
+            return false;
+        }
+        
+        u8 param_list[SCSI_UNMAP_HEADER_LEN + (SCSI_UNMAP_MAX_DESCRIPTORS * SCSI_UNMAP_DESCRIPTOR_LEN)] = {0};
+        u16 desc_len = (u16)(count * SCSI_UNMAP_DESCRIPTOR_LEN);
+        u16 param_len = (u16)(SCSI_UNMAP_HEADER_LEN + desc_len);
+        
+        /* SBC-3 5.28.2: the data length excludes its own field */
+        cdb::PutBE<2>(param_list, param_len - 2);
+        cdb::PutBE<2>(param_list + 2, desc_len);
+        
+        for(u32 i = 0; i < count; i++) {
+            u8 *desc = (param_list + SCSI_UNMAP_HEADER_LEN + (i * SCSI_UNMAP_DESCRIPTOR_LEN));
+            cdb::PutBE<8>(desc, extents[i].lba);
+            cdb::PutBE<4>(desc + 8, extents[i].blocks);
+        }
+        
+        SCSIUnmapCommand unmap(param_len, this->device->GetDeviceLUN());
+        auto status = this->device->TransferCommand(unmap, param_list);
+        if (status.status == SCSI_CMD_STATUS_SUCCESS) {
+            return true;
+        }
+        
+        u8 sense_key = this->RequestSenseKey(status);
+        FSP_USB_LOG("%s: Unmap command failed (0x%02X). Sense key: 0x%02X.", __func__, status.status, sense_key);
+        
+        /* Some bridges advertise limits but don't pass the command through, don't bother again */
+        if (sense_key == SCSI_SENSE_ILLEGAL_REQUEST) {
+            this->unmap_supported = false;
+        }
+        
+        return false;
+    }
+
+    u32 SCSIBlock::Discard(DiscardQueue &queue, u32 max_commands) {
+        u32 issued = 0;
+        
+        if (!this->unmap_supported) {
+            queue.Clear();
+            return 0;
+        }
+        
+        /* Pack as many queued extents in each command as the Block Limits VPD page allows */
+        u64 max_blocks = std::min((u64)this->caps.max_unmap_blocks, (u64)0xFFFFFFFF);
+        u32 max_descriptors = std::min(this->caps.max_unmap_descriptors, (u32)SCSI_UNMAP_MAX_DESCRIPTORS);
+        
+        while(issued < max_commands && !queue.IsEmpty() && this->unmap_supported) {
+            DiscardExtent extents[SCSI_UNMAP_MAX_DESCRIPTORS];
+            u32 count = 0;
+            u64 total_blocks = 0;
+            
+            while(count < max_descriptors && total_blocks < max_blocks && queue.Pop(&extents[count], max_blocks - total_blocks)) {
+                if (this->AlignUnmapExtent(extents[count])) {
+                    total_blocks += extents[count].blocks;
+                    count++;
+                }
+            }
+            
+            if (count == 0) {
+                continue;
+            }
+            
+            FSP_USB_LOG("%s: unmapping %u extents (0x%lX blocks), 0x%lX blocks left queued.", __func__, count, total_blocks, queue.GetPendingBlocks());
+            if (!this->Unmap(extents, count)) {
+                break;
+            }
+            
+            issued++;
         }
         
-        return num_sectors;
+        return issued;
     }
-}
\ No newline at end of file
+}
@@ -1,8 +1,14 @@
 
 #pragma once
 #include "fspusb_utils.hpp"
+#include "fspusb_transfer_policy.hpp"
+#include "fspusb_recovery.hpp"
+#include "fspusb_discard.hpp"
+#include "fspusb_bot_interface.hpp"
+#include "fspusb_quirks.hpp"
 
 #define SCSI_CBW_SIZE                           31
+#define SCSI_CBW_HEADER_SIZE                    15
 #define SCSI_CBW_SIGNATURE                      0x43425355
 #define SCSI_CBW_IN                             0x80
 #define SCSI_CBW_OUT                            0
@@ -10,7 +16,10 @@
 #define SCSI_CSW_SIZE                           13
 #define SCSI_CSW_SIGNATURE                      0x53425355
 
-#define SCSI_TAG                                0xDEADBEEF
+#define SCSI_TAG_INITIAL                        1
+#define SCSI_TAG_LUN_SHIFT                      24      // LUNs sharing an interface get their own tag ranges
+#define SCSI_STALE_TAG_WINDOW                   0x10
+#define SCSI_STALE_CSW_MAX_SKIP                 2
 
 #define SCSI_CMD_STATUS_SUCCESS                 0
 #define SCSI_CMD_STATUS_FAILED                  1
@@ -24,6 +33,46 @@
 #define SCSI_REQUEST_SENSE_REPLY_LEN            0x12
 #define SCSI_REQUEST_SENSE_CB_LEN               0x06
 
+#define SCSI_INQUIRY_CMD                        0x12
+#define SCSI_INQUIRY_REPLY_LEN                  0x24
+#define SCSI_INQUIRY_CB_LEN                     0x06
+#define SCSI_INQUIRY_EVPD                       0x01
+
+#define SCSI_VPD_HEADER_LEN                     0x04
+#define SCSI_VPD_MAX_LEN                        0x100
+#define SCSI_VPD_SUPPORTED_PAGES                0x00
+#define SCSI_VPD_BLOCK_LIMITS                   0xB0
+#define SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS   0xB1
+
+#define SCSI_VERSION_SPC_3                      0x05
+
+#define SCSI_MODE_SENSE_6_CMD                   0x1A
+#define SCSI_MODE_SENSE_6_CB_LEN                0x06
+#define SCSI_MODE_SENSE_6_HEADER_LEN            0x04
+
+#define SCSI_MODE_SENSE_10_CMD                  0x5A
+#define SCSI_MODE_SENSE_10_CB_LEN               0x0A
+#define SCSI_MODE_SENSE_10_HEADER_LEN           0x08
+
+#define SCSI_MODE_SELECT_6_CMD                  0x15
+#define SCSI_MODE_SELECT_6_CB_LEN               0x06
+
+#define SCSI_MODE_SELECT_10_CMD                 0x55
+#define SCSI_MODE_SELECT_10_CB_LEN              0x0A
+
+#define SCSI_MODE_SENSE_MAX_LEN                 0xC0    // Some USB bridges break with anything else when asked for all pages
+#define SCSI_MODE_PC_CURRENT                    0x00
+#define SCSI_MODE_PC_CHANGEABLE                 0x01
+#define SCSI_MODE_PAGE_CACHING                  0x08
+#define SCSI_MODE_PAGE_CONTROL                  0x0A
+#define SCSI_MODE_PAGE_ALL                      0x3F
+#define SCSI_MODE_DEVICE_SPECIFIC_WP            0x80
+#define SCSI_MODE_SELECT_PF                     0x10
+#define SCSI_MODE_CACHING_PAGE_LEN              0x14
+#define SCSI_MODE_CACHING_WCE                   0x04
+#define SCSI_MODE_CACHING_RCD                   0x01
+#define SCSI_MODE_CONTROL_SWP                   0x08
+
 #define SCSI_READ_CAPACITY_10_CMD               0x25
 #define SCSI_READ_CAPACITY_10_REPLY_LEN         0x08
 #define SCSI_READ_CAPACITY_10_CB_LEN            0x0A
@@ -45,6 +94,18 @@
 #define SCSI_WRITE_16_CMD                       0x8A
 #define SCSI_WRITE_16_CB_LEN                    0x10
 
+#define SCSI_SYNCHRONIZE_CACHE_10_CMD           0x35
+#define SCSI_SYNCHRONIZE_CACHE_10_CB_LEN        0x0A
+
+#define SCSI_SYNCHRONIZE_CACHE_16_CMD           0x91
+#define SCSI_SYNCHRONIZE_CACHE_16_CB_LEN        0x10
+
+#define SCSI_UNMAP_CMD                          0x42
+#define SCSI_UNMAP_CB_LEN                       0x0A
+#define SCSI_UNMAP_HEADER_LEN                   0x08
+#define SCSI_UNMAP_DESCRIPTOR_LEN               0x10
+#define SCSI_UNMAP_MAX_DESCRIPTORS              0x20
+
 #define SCSI_SENSE_NO_SENSE                     0x00
 #define SCSI_SENSE_RECOVERED_ERROR              0x01
 #define SCSI_SENSE_NOT_READY                    0x02
@@ -59,9 +120,25 @@
 #define SCSI_SENSE_VOLUME_OVERFLOW              0x0D
 #define SCSI_SENSE_MISCOMPARE                   0x0E
 
+#define SCSI_ASC_MEDIUM_NOT_PRESENT             0x3A
+
 #define SCSI_TRANSFER_RETRIES                   3
 
+// Every command attempt (CBW, data and CSW) has to complete within its deadline, or its transfers get cancelled
+// The base covers a drive spinning up, the rest allows for the data stage going no slower than the minimum rate
+#define SCSI_COMMAND_TIMEOUT_BASE_NS            5000000000  // 5 S
+#define SCSI_COMMAND_TIMEOUT_MIN_RATE           0x100000    // 1 MiB/s
+#define SCSI_FLUSH_TIMEOUT_NS                   30000000000 // 30 S, cache flushes and unmaps may take a while
+
+#define SCSI_DATA_PIPELINE_DEPTH                2
+
 #define SCSI_MAX_BLOCK_10                       (u64)0xFFFFFFFF
+#define SCSI_MAX_TRANSFER_BLOCKS_10             0xFFFF
+
+#define SCSI_DEFAULT_MAX_TRANSFER_SIZE          0x1E000     // 120 KiB
+#define SCSI_DEFAULT_MAX_TRANSFER_SIZE_SS       0x100000    // 1 MiB
+
+#define SCSI_MAX_BATCHED_COMMANDS               8
 
 namespace fspusb::impl {
 
@@ -71,26 +148,6 @@ namespace fspusb::impl {
         Out
     };
 
-    class SCSIBuffer {
-
-        public:
-            static constexpr size_t BufferSize = SCSI_CBW_SIZE;
-
-        private:
-            u32 idx = 0;
-            u8 storage[BufferSize];
-
-        public:
-            SCSIBuffer();
-            void Write8(u8 val);
-            void WritePadding(u32 len);
-            void Write16BE(u16 val);
-            void Write32(u32 val);
-            void Write32BE(u32 val);
-            void Write64BE(u64 val);
-            u8 *GetStorage();
-    };
-
     class SCSICommand {
 
         private:
@@ -99,106 +156,203 @@ namespace fspusb::impl {
             u8 flags;
             u8 lun;
             u8 cb_length;
+            u8 opcode;
             SCSIDirection direction;
 
         public:
-            SCSICommand(u32 data_tr_len, SCSIDirection dir, u8 ln, u8 cb_len);
-            virtual SCSIBuffer ProduceBuffer() = 0;
+            SCSICommand(u8 op, u32 data_tr_len, SCSIDirection dir, u8 ln, u8 cb_len);
+
+            /* Writes the whole command block (cb_length bytes) */
+            virtual void EncodeCommandBlock(u8 *out) = 0;
+
+            /* Updates a command block already holding a command with the same opcode, by default it's just encoded again */
+            virtual void PatchCommandBlock(u8 *out);
+
+            /* How long the device may take to complete the command, scaled by its data length by default */
+            virtual u64 GetTimeout();
+
             u32 GetDataTransferLength();
             void SetDataTransferLength(u32 data_len);
             SCSIDirection GetDirection();
+            u8 GetCommandBlockLength();
+            u8 GetOpcode();
+            void SetTag(u32 cmd_tag);
             void ToBytes(u8 *out);
-            void WriteHeader(SCSIBuffer &out);
+            void ToCommandBlock(u8 *out);
     };
 
     class SCSITestUnitReadyCommand : public SCSICommand {
 
-        private:
-            u8 opcode;
-            
         public:
             SCSITestUnitReadyCommand(u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
     };
     
     class SCSIRequestSenseCommand : public SCSICommand 
     {
         private:
             u8 allocation_length;
-            u8 opcode;
 
         public:
             SCSIRequestSenseCommand(u8 alloc_len, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
     };
 
-    class SCSIReadCapacity10Command : public SCSICommand {
+    class SCSIInquiryCommand : public SCSICommand {
 
         private:
-            u8 opcode;
-            
+            u16 allocation_length;
+            u8 evpd;
+            u8 page_code;
+
+        public:
+            SCSIInquiryCommand(u16 alloc_len, bool vpd, u8 page, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+    };
+
+    class SCSIReadCapacity10Command : public SCSICommand {
+
         public:
             SCSIReadCapacity10Command(u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
     };
 
     class SCSIReadCapacity16Command : public SCSICommand {
 
         private:
             u8 allocation_length;
-            u8 opcode;
             
         public:
             SCSIReadCapacity16Command(u8 alloc_len, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
     };
 
     class SCSIRead10Command : public SCSICommand {
 
         private:
-            u8 opcode;
             u32 block_address;
             u16 transfer_blocks;
             
         public:
             SCSIRead10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual void PatchCommandBlock(u8 *out) override;
     };
 
     class SCSIRead16Command : public SCSICommand {
 
         private:
-            u8 opcode;
             u64 block_address;
             u32 transfer_blocks;
             
         public:
             SCSIRead16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual void PatchCommandBlock(u8 *out) override;
     };
 
     class SCSIWrite10Command : public SCSICommand {
 
         private:
-            u8 opcode;
             u32 block_address;
             u16 transfer_blocks;
             
         public:
             SCSIWrite10Command(u32 block_addr, u32 block_sz, u16 xfer_blocks, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual void PatchCommandBlock(u8 *out) override;
     };
 
     class SCSIWrite16Command : public SCSICommand {
 
         private:
-            u8 opcode;
             u64 block_address;
             u32 transfer_blocks;
             
         public:
             SCSIWrite16Command(u64 block_addr, u32 block_sz, u32 xfer_blocks, u8 lun);
-            virtual SCSIBuffer ProduceBuffer();
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual void PatchCommandBlock(u8 *out) override;
+    };
+
+    /* LBA 0 with a block count of 0 flushes the whole medium */
+    class SCSISynchronizeCache10Command : public SCSICommand {
+
+        private:
+            u32 block_address;
+            u16 sync_blocks;
+            
+        public:
+            SCSISynchronizeCache10Command(u32 block_addr, u16 num_blocks, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual u64 GetTimeout() override;
+    };
+
+    class SCSISynchronizeCache16Command : public SCSICommand {
+
+        private:
+            u64 block_address;
+            u32 sync_blocks;
+            
+        public:
+            SCSISynchronizeCache16Command(u64 block_addr, u32 num_blocks, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual u64 GetTimeout() override;
+    };
+
+    class SCSIUnmapCommand : public SCSICommand {
+
+        private:
+            u16 parameter_list_length;
+            
+        public:
+            SCSIUnmapCommand(u16 param_len, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+            virtual u64 GetTimeout() override;
+    };
+
+    class SCSIModeSense6Command : public SCSICommand {
+
+        private:
+            u8 page_control;
+            u8 page_code;
+            u8 allocation_length;
+            
+        public:
+            SCSIModeSense6Command(u8 pc, u8 page, u8 alloc_len, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+    };
+
+    class SCSIModeSense10Command : public SCSICommand {
+
+        private:
+            u8 page_control;
+            u8 page_code;
+            u16 allocation_length;
+            
+        public:
+            SCSIModeSense10Command(u8 pc, u8 page, u16 alloc_len, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+    };
+
+    class SCSIModeSelect6Command : public SCSICommand {
+
+        private:
+            u8 parameter_list_length;
+            
+        public:
+            SCSIModeSelect6Command(u8 param_len, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
+    };
+
+    class SCSIModeSelect10Command : public SCSICommand {
+
+        private:
+            u16 parameter_list_length;
+            
+        public:
+            SCSIModeSelect10Command(u16 param_len, u8 lun);
+            virtual void EncodeCommandBlock(u8 *out) override;
     };
 
     struct SCSICommandStatus {
@@ -206,39 +360,133 @@ namespace fspusb::impl {
         u32 tag;
         u32 data_residue;
         u8 status;
+        u8 sense_len; // Sense data the transport got along with the status (UAS Sense IU), 0 if it has to be requested
+        u8 sense[SCSI_REQUEST_SENSE_REPLY_LEN];
+    };
+
+    /* What the device told us about itself at attach time (INQUIRY + VPD pages) */
+    struct SCSIDriveCapabilities {
+        u8 device_type;
+        u8 version;
+        bool removable;
+        char vendor_id[0x9];
+        char product_id[0x11];
+        char product_revision[0x5];
+        
+        /* Block Limits VPD page, block counts (zero = not reported) */
+        bool has_block_limits;
+        u16 optimal_transfer_granularity;
+        u32 max_transfer_blocks;
+        u32 optimal_transfer_blocks;
+        u32 max_unmap_blocks;
+        u32 max_unmap_descriptors;
+        u32 unmap_granularity;
+        u32 unmap_granularity_alignment;
+        
+        /* Block Device Characteristics VPD page */
+        bool has_characteristics;
+        u16 rotation_rate; // 1 = non-rotating medium, 0 = not reported, otherwise RPM
+        
+        /* MODE SENSE header, caching and control mode pages */
+        bool has_mode_pages;
+        bool write_protected;
+        bool has_caching_page;
+        bool write_cache_enabled;
+        bool read_cache_disabled;
+        
+        bool IsRotational() {
+            return this->has_characteristics && this->rotation_rate > 1;
+        }
+    };
+
+    struct SCSIDataStageTransfer {
+        u32 xfer_id;
+        u8 *xfer_buffer;
+        u8 *data;
+        u32 size;
+        bool direct;
+    };
+
+    u32 GetDefaultMaxTransferSize(UsbHsClientIfSession *iface);
+
+    /* Common interface for the transports SCSIBlock can send commands through (Bulk-Only, UAS) */
+    class SCSITransport {
+
+        public:
+            virtual ~SCSITransport() {}
+            virtual SCSICommandStatus TransferCommand(SCSICommand &c, u8 *buffer) = 0;
+            virtual void TransferCommands(SCSICommand **cmds, u8 **buffers, u32 count, SCSICommandStatus *out_statuses);
+            virtual bool Ok() = 0;
+            virtual u8 GetDeviceLUN() = 0;
+            virtual u32 GetMaxTransferSize() = 0;
     };
 
-    class SCSIDevice {
+    /* Bulk-Only Transport */
+    class SCSIDevice : public SCSITransport {
 
         public:
             static constexpr size_t BufferSize = USB_TRANSFER_MEMORY_BLOCK_SIZE;
+            static constexpr size_t BounceSlotSize = (BufferSize * USB_TRANSFER_MEMORY_MAX_MULTIPLIER) / SCSI_DATA_PIPELINE_DEPTH;
 
         private:
-            u8 *buf_a; // Used to send SCSI commands
-            u8 *buf_b; // Used to send/receive data
-            u8 *buf_c; // Used to receive SCSI status
+            std::shared_ptr<BulkOnlyInterface> bot_interface;
             UsbHsClientIfSession *client;
             UsbHsClientEpSession *in_endpoint;
             UsbHsClientEpSession *out_endpoint;
+            u8 *buf_a; // Owned by the interface, see BulkOnlyInterface
+            u8 *buf_b;
+            u8 *buf_c;
             bool ok;
             u8 dev_lun;
+            u64 data_bytes_transferred;
+            u64 data_bytes_copied;
+            TransferSizePolicy transfer_policy;
+            BOTRecovery recovery;
+            u32 next_tag;
+            u32 current_tag;
+            u64 deadline_tick;
+
+            bool IsStaleTag(u32 tag);
+            u64 GetRemainingTime();
+            void CancelTransfers(UsbHsClientEpSession *endpoint);
+            UsbHsClientEpSession *GetDataEndpoint(SCSIDirection dir);
+            u32 GetDataStageChunkSize(SCSIDirection dir, u8 *buffer, u32 remaining, bool *out_direct);
+            BOTError TransferData(SCSICommand &c, u8 *buffer, u32 *total_transferred, SCSICommandStatus *out_status, bool *out_got_status, u32 *out_stalled_size);
         
         public:
-            SCSIDevice(UsbHsClientIfSession *iface, UsbHsClientEpSession *in_ep, UsbHsClientEpSession *out_ep, u8 lun);
-            ~SCSIDevice();
-            void AllocateBuffers();
-            void FreeBuffers();
-            SCSICommandStatus ReadStatus();
-            void PushCommand(SCSICommand &cmd, u32 diff);
-            SCSICommandStatus TransferCommand(SCSICommand &c, u8 *buffer);
+            SCSIDevice(std::shared_ptr<BulkOnlyInterface> bot_iface, u8 lun, const DeviceQuirks &quirks);
+            virtual ~SCSIDevice();
+            BOTError ReadStatus(SCSICommandStatus *out_status);
+            BOTError PushCommand(SCSICommand &cmd);
+            virtual SCSICommandStatus TransferCommand(SCSICommand &c, u8 *buffer) override;
 
-            bool Ok() {
+            virtual bool Ok() override {
                 return this->ok;
             }
 
-            u8 GetDeviceLUN() {
+            virtual u8 GetDeviceLUN() override {
                 return this->dev_lun;
             }
+
+            virtual u32 GetMaxTransferSize() override {
+                return GetDefaultMaxTransferSize(this->client);
+            }
+
+            u64 GetDataBytesTransferred() {
+                return this->data_bytes_transferred;
+            }
+
+            u64 GetDataBytesCopied() {
+                return this->data_bytes_copied;
+            }
+
+            TransferSizePolicy &GetTransferPolicy() {
+                return this->transfer_policy;
+            }
+
+            const BOTRecoveryCounters &GetRecoveryCounters() {
+                return this->recovery.GetCounters();
+            }
     };
 
     class SCSIBlock {
@@ -246,18 +494,60 @@ namespace fspusb::impl {
         private:
             u64 capacity;
             u32 block_size;
-            SCSIDevice *device;
+            u32 max_transfer_blocks;
+            bool sync_cache_supported;
+            bool unmap_supported;
+            bool mode_sense_6;
+            DeviceQuirks quirks;
+            SCSIDriveCapabilities caps;
+            SCSITransport *device;
             bool ok;
 
+            void Inquiry();
+            u8 RequestSenseKey(const SCSICommandStatus &status);
+            bool ReadVPDPage(u8 page, u8 *out, u16 *out_len);
+            void QueryVPDPages();
+            bool ModeSense(u8 page_control, u8 page, u8 *out, u32 *out_len);
+            u8 *FindModePage(u8 *data, u32 data_len, u8 page, u32 min_page_len);
+            bool ModeSelect(u8 *page_data, u32 page_len);
+            void EnableWriteCache(u8 *caching_page);
+            void QueryModePages();
+            u32 GetCommandMaxBlocks(u64 sector_offset, u32 num_sectors);
+            int TransferSectors(u8 *buffer, u64 sector_offset, u32 num_sectors, SCSIDirection dir);
+            bool AlignUnmapExtent(DiscardExtent &extent);
+            bool Unmap(const DiscardExtent *extents, u32 count);
+
         public:
-            SCSIBlock(SCSIDevice *dev);
+            SCSIBlock(SCSITransport *dev, const DeviceQuirks &dev_quirks);
             int ReadSectors(u8 *buffer, u64 sector_offset, u32 num_sectors);
             int WriteSectors(const u8 *buffer, u64 sector_offset, u32 num_sectors);
+            bool SynchronizeCache();
+            u32 Discard(DiscardQueue &queue, u32 max_commands);
+
+            bool IsUnmapSupported() {
+                return this->unmap_supported;
+            }
+
+            bool IsWriteProtected() {
+                return this->caps.write_protected;
+            }
 
             u32 GetBlockSize() {
                 return this->block_size;
             }
 
+            u64 GetBlockCount() {
+                return ((this->block_size > 0) ? (this->capacity / this->block_size) : 0);
+            }
+
+            u32 GetMaxTransferBlocks() {
+                return this->max_transfer_blocks;
+            }
+
+            SCSIDriveCapabilities &GetCapabilities() {
+                return this->caps;
+            }
+
             bool Ok() {
                 if(this->device == nullptr) {
                     return false;
@@ -269,13 +559,13 @@ namespace fspusb::impl {
     class SCSIDriveContext {
 
         private:
-            SCSIDevice *device;
+            SCSITransport *device;
             SCSIBlock *block;
 
         public:
-            SCSIDriveContext(UsbHsClientIfSession *interface, UsbHsClientEpSession *in_ep, UsbHsClientEpSession *out_ep, u8 lun) : device(nullptr), block(nullptr) {
-                this->device = new SCSIDevice(interface, in_ep, out_ep, lun);
-                this->block = new SCSIBlock(this->device);
+            /* Takes ownership of the transport */
+            SCSIDriveContext(SCSITransport *transport, const DeviceQuirks &quirks) : device(transport), block(nullptr) {
+                this->block = new SCSIBlock(this->device, quirks);
             }
 
             ~SCSIDriveContext() {
@@ -289,7 +579,7 @@ namespace fspusb::impl {
                 }
             }
 
-            SCSIDevice *GetDevice() {
+            SCSITransport *GetDevice() {
                 return this->device;
             }
 
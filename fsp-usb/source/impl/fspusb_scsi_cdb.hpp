@@ -0,0 +1,107 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+#include <array>
+
+/* Compile-time CBW / CDB encoding, written straight into the transfer buffer */
+
+#define SCSI_CBW_SIGNATURE_OFFSET               0x00
+#define SCSI_CBW_TAG_OFFSET                     0x04
+#define SCSI_CBW_DATA_TRANSFER_LENGTH_OFFSET    0x08
+#define SCSI_CBW_FLAGS_OFFSET                   0x0C
+#define SCSI_CBW_LUN_OFFSET                     0x0D
+#define SCSI_CBW_CB_LENGTH_OFFSET               0x0E
+#define SCSI_CBW_CB_OFFSET                      0x0F
+#define SCSI_CBW_CB_MAX_LEN                     0x10
+
+namespace fspusb::impl::cdb {
+
+    template<size_t Size>
+    constexpr void PutBE(u8 *out, u64 val) {
+        static_assert(Size > 0 && Size <= sizeof(u64));
+        for(size_t i = 0; i < Size; i++) {
+            out[i] = (u8)(val >> (8 * (Size - 1 - i)));
+        }
+    }
+
+    constexpr void PutLE32(u8 *out, u32 val) {
+        for(size_t i = 0; i < sizeof(u32); i++) {
+            out[i] = (u8)(val >> (8 * i));
+        }
+    }
+
+    template<size_t Size>
+    constexpr u64 GetBE(const u8 *in) {
+        u64 val = 0;
+        for(size_t i = 0; i < Size; i++) {
+            val = ((val << 8) | in[i]);
+        }
+        return val;
+    }
+
+    template<size_t Size>
+    constexpr bool Equals(const std::array<u8, Size> &a, const std::array<u8, Size> &b) {
+        for(size_t i = 0; i < Size; i++) {
+            if(a[i] != b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Where a command's LBA and transfer / allocation length fields live (a size of 0 means the command has no such field) */
+    template<u8 Opcode, u8 Length, u8 LBAOffset, u8 LBASize, u8 LengthOffset, u8 LengthSize, u8 ServiceAction = 0>
+    struct CommandBlockLayout {
+        static constexpr u8 OperationCode = Opcode;
+        static constexpr u8 BlockLength = Length;
+
+        /* CDB groups from SPC-4 4.2.5.1 */
+        static_assert(Length == 6 || Length == 10 || Length == 12 || Length == 16, "Invalid CDB length");
+        static_assert(Length <= SCSI_CBW_CB_MAX_LEN, "CDB doesn't fit in a CBW");
+        static_assert(LBASize == 0 || (LBAOffset > 0 && (LBAOffset + LBASize) <= Length), "LBA field out of bounds");
+        static_assert(LengthSize == 0 || (LengthOffset > 0 && (LengthOffset + LengthSize) <= Length), "Length field out of bounds");
+        static_assert(LBASize == 0 || LengthSize == 0 || (LBAOffset + LBASize) <= LengthOffset || (LengthOffset + LengthSize) <= LBAOffset, "LBA and length fields overlap");
+        static_assert(ServiceAction == 0 || (LBAOffset != 1 && LengthOffset != 1), "Service action byte is taken");
+
+        /* Only the fields which change between commands of the same kind */
+        static constexpr void Patch(u8 *out, u64 lba, u32 length) {
+            if constexpr(LBASize > 0) {
+                PutBE<LBASize>(out + LBAOffset, lba);
+            }
+            if constexpr(LengthSize > 0) {
+                PutBE<LengthSize>(out + LengthOffset, length);
+            }
+        }
+
+        static constexpr void Encode(u8 *out, u64 lba, u32 length) {
+            out[0] = Opcode;
+            for(size_t i = 1; i < Length; i++) {
+                out[i] = 0;
+            }
+            if constexpr(ServiceAction != 0) {
+                out[1] = ServiceAction;
+            }
+            Patch(out, lba, length);
+        }
+
+        static constexpr std::array<u8, Length> Make(u64 lba, u32 length) {
+            std::array<u8, Length> cb = {};
+            Encode(cb.data(), lba, length);
+            return cb;
+        }
+    };
+
+    constexpr void PatchCommandBlockWrapper(u8 *out, u32 tag, u32 data_transfer_length) {
+        PutLE32(out + SCSI_CBW_TAG_OFFSET, tag);
+        PutLE32(out + SCSI_CBW_DATA_TRANSFER_LENGTH_OFFSET, data_transfer_length);
+    }
+
+    constexpr void EncodeCommandBlockWrapper(u8 *out, u32 signature, u32 tag, u32 data_transfer_length, u8 flags, u8 lun, u8 cb_length) {
+        PutLE32(out + SCSI_CBW_SIGNATURE_OFFSET, signature);
+        PatchCommandBlockWrapper(out, tag, data_transfer_length);
+        out[SCSI_CBW_FLAGS_OFFSET] = flags;
+        out[SCSI_CBW_LUN_OFFSET] = lun;
+        out[SCSI_CBW_CB_LENGTH_OFFSET] = cb_length;
+    }
+
+}
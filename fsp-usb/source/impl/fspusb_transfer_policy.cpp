@@ -0,0 +1,137 @@
+#include "fspusb_transfer_policy.hpp"
+#include <array>
+
+namespace fspusb::impl {
+
+    namespace {
+
+        struct TransferSizeRecord {
+            u16 vid;
+            u16 pid;
+            u32 chunk_size;
+            u32 max_chunk_size;
+            bool used;
+        };
+
+        ams::os::Mutex g_transfer_size_record_lock;
+        std::array<TransferSizeRecord, TransferSizeRecordMax> g_transfer_size_records = {};
+        u32 g_transfer_size_record_next = 0;
+
+        TransferSizeRecord *FindTransferSizeRecord(u16 vid, u16 pid) {
+            for(auto &record: g_transfer_size_records) {
+                if(record.used && record.vid == vid && record.pid == pid) {
+                    return &record;
+                }
+            }
+            return nullptr;
+        }
+
+    }
+
+    TransferSizePolicy::TransferSizePolicy(u16 vendor_id, u16 product_id) : vid(vendor_id), pid(product_id), chunk_size(USB_TRANSFER_CHUNK_SIZE_MIN), max_chunk_size(USB_TRANSFER_CHUNK_SIZE_MAX), device_limit(USB_TRANSFER_CHUNK_SIZE_MAX), success_bytes(0), clean_count(0), failed_size(0), failure_count(0), backoff_size(0) {
+        std::scoped_lock lk(g_transfer_size_record_lock);
+
+        /* Start from whatever worked for this device model the last time it was plugged in */
+        auto record = FindTransferSizeRecord(this->vid, this->pid);
+        if(record != nullptr) {
+            this->chunk_size = record->chunk_size;
+            this->max_chunk_size = record->max_chunk_size;
+            FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): using remembered chunk size -> 0x%X | max chunk size -> 0x%X.", __func__, this->vid, this->pid, this->chunk_size, this->max_chunk_size);
+        }
+    }
+
+    void TransferSizePolicy::Save() {
+        std::scoped_lock lk(g_transfer_size_record_lock);
+
+        auto record = FindTransferSizeRecord(this->vid, this->pid);
+        if(record == nullptr) {
+            /* Overwrite the oldest record once the table is full */
+            record = &g_transfer_size_records[g_transfer_size_record_next];
+            g_transfer_size_record_next = ((g_transfer_size_record_next + 1) % TransferSizeRecordMax);
+        }
+
+        record->vid = this->vid;
+        record->pid = this->pid;
+        record->chunk_size = this->chunk_size;
+        record->max_chunk_size = this->max_chunk_size;
+        record->used = true;
+    }
+
+    void TransferSizePolicy::SetDeviceLimit(u32 limit) {
+        /* Never go below the size every device has been working fine with */
+        limit = std::max(limit & ~(USB_TRANSFER_MEMORY_BLOCK_SIZE - 1), (u32)USB_TRANSFER_CHUNK_SIZE_MIN);
+        this->device_limit = std::min(this->device_limit, limit);
+        this->max_chunk_size = std::min(this->max_chunk_size, this->device_limit);
+        this->chunk_size = std::min(this->chunk_size, this->max_chunk_size);
+    }
+
+    void TransferSizePolicy::NotifySuccess(u32 size, u32 limit) {
+        if(size >= this->failed_size) {
+            this->failed_size = 0;
+            this->failure_count = 0;
+        }
+
+        /* A smaller chunk going through confirms the size we stepped down from was the problem, so it stays below it from now on */
+        /* Chunks capped below the current size (bounced ones, mostly) count as long as they were as big as they could get */
+        if(this->backoff_size > 0) {
+            if(size >= std::min(this->chunk_size, limit)) {
+                this->backoff_size = 0;
+                this->max_chunk_size = this->chunk_size;
+                FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): chunk of 0x%X bytes succeeded after backing off, max chunk size -> 0x%X.", __func__, this->vid, this->pid, size, this->max_chunk_size);
+                this->Save();
+            }
+            return;
+        }
+
+        if(this->chunk_size < this->max_chunk_size) {
+            /* Bounced and short chunks are capped below the current size, so what counts is the amount of data, not full-size chunks */
+            this->success_bytes += size;
+            if(this->success_bytes >= ((u64)this->chunk_size * TransferSizeGrowthThreshold)) {
+                this->success_bytes = 0;
+                this->chunk_size = std::min(this->chunk_size * 2, this->max_chunk_size);
+                FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): growing chunk size -> 0x%X.", __func__, this->vid, this->pid, this->chunk_size);
+                this->Save();
+            }
+            return;
+        }
+
+        /* A lowered ceiling may have come from a bad cable or hub rather than the device, so it gets raised again after a while */
+        if(this->max_chunk_size < this->device_limit) {
+            this->clean_count++;
+            if(this->clean_count >= TransferSizeRecoveryThreshold) {
+                this->clean_count = 0;
+                this->max_chunk_size = std::min(this->max_chunk_size * 2, this->device_limit);
+                FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): raising max chunk size -> 0x%X.", __func__, this->vid, this->pid, this->max_chunk_size);
+                this->Save();
+            }
+        }
+    }
+
+    void TransferSizePolicy::NotifyFailure(u32 size, bool size_error) {
+        this->success_bytes = 0;
+        this->clean_count = 0;
+        if(size <= USB_TRANSFER_CHUNK_SIZE_MIN) {
+            /* Not a size issue */
+            return;
+        }
+
+        if(size != this->failed_size) {
+            this->failed_size = size;
+            this->failure_count = 0;
+        }
+
+        /* Babble and timeouts point at the chunk size right away, anything else only once it keeps failing at the same size */
+        this->failure_count++;
+        if(!size_error && this->failure_count < TransferSizeFailureThreshold) {
+            return;
+        }
+
+        /* Step down for now, the ceiling is only lowered once the smaller size actually works */
+        this->failed_size = 0;
+        this->failure_count = 0;
+        this->backoff_size = size;
+        this->chunk_size = std::min(this->chunk_size, std::max(size / 2, (u32)USB_TRANSFER_CHUNK_SIZE_MIN));
+        FSP_USB_LOG("%s (VID 0x%04X, PID 0x%04X): chunk of 0x%X bytes failed, backing off -> 0x%X.", __func__, this->vid, this->pid, size, this->chunk_size);
+    }
+
+}
@@ -0,0 +1,52 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+
+namespace fspusb::impl {
+
+    /* Amount of VID/PID pairs whose tuned transfer size we remember */
+    constexpr u32 TransferSizeRecordMax = 0x20;
+
+    /* Chunk sizes worth of clean data needed before trying a bigger one */
+    constexpr u32 TransferSizeGrowthThreshold = 8;
+
+    /* Consecutive failures at one size needed before trying a smaller one, unless the failure itself points at the size */
+    constexpr u32 TransferSizeFailureThreshold = 3;
+
+    /* Clean chunks at a lowered ceiling needed before giving the next size up another chance */
+    constexpr u32 TransferSizeRecoveryThreshold = 0x100;
+
+    class TransferSizePolicy {
+
+        private:
+            u16 vid;
+            u16 pid;
+            u32 chunk_size;
+            u32 max_chunk_size;
+            u32 device_limit;
+            u64 success_bytes;
+            u32 clean_count;
+            u32 failed_size;
+            u32 failure_count;
+            u32 backoff_size; // Size we stepped down from, until a smaller chunk goes through
+
+            void Save();
+
+        public:
+            TransferSizePolicy(u16 vendor_id, u16 product_id);
+
+            void SetDeviceLimit(u32 limit);
+            /* limit is the biggest chunk that could have been posted there (bounced chunks never get past the bounce slot size) */
+            void NotifySuccess(u32 size, u32 limit);
+            void NotifyFailure(u32 size, bool size_error);
+
+            u32 GetChunkSize() {
+                return this->chunk_size;
+            }
+
+            u32 GetMaxChunkSize() {
+                return this->max_chunk_size;
+            }
+    };
+
+}
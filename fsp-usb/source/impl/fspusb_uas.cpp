@@ -0,0 +1,236 @@
+#include "fspusb_uas.hpp"
+#include "fspusb_request.hpp"
+#include "fspusb_scsi_cdb.hpp"
+
+namespace fspusb::impl {
+
+    UASDevice::UASDevice(UsbHsClientIfSession *iface, UsbHsClientEpSession *cmd_ep, UsbHsClientEpSession *status_ep, UsbHsClientEpSession *data_in_ep, UsbHsClientEpSession *data_out_ep, u8 lun) : cmd_buf(nullptr), data_buf(nullptr), status_buf(nullptr), client(iface), cmd_endpoint(cmd_ep), status_endpoint(status_ep), data_in_endpoint(data_in_ep), data_out_endpoint(data_out_ep), ok(true), dev_lun(lun), next_tag(1) {
+        this->AllocateBuffers();
+    }
+
+    UASDevice::~UASDevice() {
+        this->FreeBuffers();
+    }
+
+    void UASDevice::AllocateBuffers() {
+        if(this->cmd_buf == nullptr) {
+            this->cmd_buf = (u8*)AllocUSBTransferMemoryBlock(1);
+        }
+        if(this->data_buf == nullptr) {
+            this->data_buf = (u8*)AllocUSBTransferMemoryBlock(USB_TRANSFER_MEMORY_MAX_MULTIPLIER);
+        }
+        if(this->status_buf == nullptr) {
+            this->status_buf = (u8*)AllocUSBTransferMemoryBlock(1);
+        }
+    }
+
+    void UASDevice::FreeBuffers() {
+        if(this->cmd_buf != nullptr) {
+            FreeUSBTransferMemoryBlock(this->cmd_buf);
+        }
+        if(this->data_buf != nullptr) {
+            FreeUSBTransferMemoryBlock(this->data_buf);
+        }
+        if(this->status_buf != nullptr) {
+            FreeUSBTransferMemoryBlock(this->status_buf);
+        }
+    }
+
+    u16 UASDevice::AllocateTag() {
+        /* Tags only need to be unique among the commands in flight, skip zero and the reserved 0xFFFF one */
+        u16 tag = this->next_tag;
+        this->next_tag = ((this->next_tag >= 0xFFFE) ? 1 : (this->next_tag + 1));
+        return tag;
+    }
+
+    Result UASDevice::PostTransfer(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferred, u64 timeout_ns) {
+        Result rc = PostUSBBuffer(this->client, endpoint, buffer, size, transferred, true, timeout_ns);
+        
+        /* There's no reset recovery for UAS, so this takes the device down, but the endpoint shouldn't be left with a transfer posted */
+        if (rc == KERNELRESULT(TimedOut)) {
+            Result cancel_rc = CancelUSBTransfers(this->client, endpoint, 1);
+            FSP_USB_LOG("%s (interface ID %d): transfer timed out, CancelUSBTransfers returned 0x%08X on endpoint 0x%02X.", __func__, this->client->ID, cancel_rc, endpoint->desc.bEndpointAddress);
+        }
+        
+        return rc;
+    }
+
+    bool UASDevice::SendCommandIU(SCSICommand &c, u16 tag) {
+        memset(this->cmd_buf, 0, UAS_COMMAND_IU_SIZE);
+        
+        this->cmd_buf[0] = UAS_IU_COMMAND;
+        this->cmd_buf[2] = (u8)(tag >> 8);
+        this->cmd_buf[3] = (u8)(tag & 0xFF);
+        // Byte 4 (task attribute) is left as SIMPLE, byte 6 (additional CDB length) as zero
+        // LUN in SAM single-level format
+        this->cmd_buf[9] = this->dev_lun;
+        c.ToCommandBlock(this->cmd_buf + UAS_COMMAND_IU_CDB_OFFSET);
+        
+        u32 out_len = 0;
+        Result rc = this->PostTransfer(this->cmd_endpoint, this->cmd_buf, UAS_COMMAND_IU_SIZE, &out_len, c.GetTimeout());
+        FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (out_len -> %u) for tag 0x%04X.", __func__, this->client->ID, rc, out_len, tag);
+        
+        return (R_SUCCEEDED(rc) && out_len == UAS_COMMAND_IU_SIZE);
+    }
+
+    bool UASDevice::ReadStatusIU(u32 *out_len, u64 timeout_ns) {
+        *out_len = 0;
+        Result rc = this->PostTransfer(this->status_endpoint, this->status_buf, BufferSize, out_len, timeout_ns);
+        FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (in_len -> %u).", __func__, this->client->ID, rc, *out_len);
+        
+        return (R_SUCCEEDED(rc) && *out_len >= UAS_READY_IU_SIZE);
+    }
+
+    bool UASDevice::TransferData(UASCommandSlot &slot) {
+        SCSIDirection dir = slot.cmd->GetDirection();
+        UsbHsClientEpSession *endpoint = ((dir == SCSIDirection::In) ? this->data_in_endpoint : this->data_out_endpoint);
+        u32 transfer_length = slot.cmd->GetDataTransferLength();
+        u32 block_size = (u32)(BufferSize * USB_TRANSFER_MEMORY_MAX_MULTIPLIER);
+        u32 &total_transferred = slot.transferred;
+        
+        if (slot.buffer == nullptr) return false;
+        
+        while(total_transferred < transfer_length) {
+            u8 *cur_buffer = (slot.buffer + total_transferred);
+            u32 cur_transfer_size = std::min(transfer_length - total_transferred, block_size);
+            bool direct = IsUSBTransferMemoryUsable(cur_buffer, cur_transfer_size);
+            u8 *xfer_buffer = (direct ? cur_buffer : this->data_buf);
+            
+            if (!direct && dir == SCSIDirection::Out) memcpy(this->data_buf, cur_buffer, cur_transfer_size);
+            
+            u32 transferred = 0;
+            Result rc = this->PostTransfer(endpoint, xfer_buffer, cur_transfer_size, &transferred, slot.cmd->GetTimeout());
+            FSP_USB_LOG("%s (interface ID %d): PostUSBBuffer returned 0x%08X (transferred -> %u) for tag 0x%04X.", __func__, this->client->ID, rc, transferred, slot.tag);
+            
+            if (R_FAILED(rc)) return false;
+            
+            if (!direct && dir == SCSIDirection::In) memcpy(cur_buffer, this->data_buf, transferred);
+            total_transferred += transferred;
+            
+            // The device ended the data phase early, the sense IU will tell us why
+            if (transferred != cur_transfer_size) break;
+        }
+        
+        return true;
+    }
+
+    SCSICommandStatus UASDevice::TransferCommand(SCSICommand &c, u8 *buffer) {
+        SCSICommand *cmds[1] = { &c };
+        u8 *buffers[1] = { buffer };
+        SCSICommandStatus status;
+        
+        this->TransferCommands(cmds, buffers, 1, &status);
+        
+        return status;
+    }
+
+    void UASDevice::TransferCommands(SCSICommand **cmds, u8 **buffers, u32 count, SCSICommandStatus *out_statuses) {
+        UASCommandSlot slots[UAS_MAX_COMMANDS_IN_FLIGHT] = {};
+        u32 submitted = 0, completed = 0, in_flight = 0;
+        
+        for(u32 i = 0; i < count; i++) {
+            memset(&out_statuses[i], 0, sizeof(SCSICommandStatus));
+            out_statuses[i].status = SCSI_CMD_STATUS_FAILED;
+        }
+        
+        if (!this->ok) {
+            FSP_USB_LOG("%s (interface ID %d): not OK to proceed.", __func__, this->client->ID);
+            return;
+        }
+        
+        while(this->ok && completed < count) {
+            /* Keep the device's queue fed with tagged commands */
+            while(in_flight < UAS_MAX_COMMANDS_IN_FLIGHT && submitted < count) {
+                UASCommandSlot *slot = nullptr;
+                for(auto &s: slots) {
+                    if (!s.busy) {
+                        slot = &s;
+                        break;
+                    }
+                }
+                
+                slot->cmd = cmds[submitted];
+                slot->buffer = buffers[submitted];
+                slot->index = submitted;
+                slot->transferred = 0;
+                slot->tag = this->AllocateTag();
+                
+                if (!this->SendCommandIU(*slot->cmd, slot->tag)) {
+                    this->ok = false;
+                    break;
+                }
+                
+                slot->busy = true;
+                in_flight++;
+                submitted++;
+            }
+            
+            if (!this->ok) break;
+            
+            /* Status IUs can come back for any of the commands in flight, so wait as long as the slowest one may take */
+            u64 status_timeout = 0;
+            for(auto &s: slots) {
+                if (s.busy) status_timeout = std::max(status_timeout, s.cmd->GetTimeout());
+            }
+            
+            u32 status_len = 0;
+            if (!this->ReadStatusIU(&status_len, status_timeout)) {
+                this->ok = false;
+                break;
+            }
+            
+            u8 iu_id = this->status_buf[0];
+            u16 tag = (u16)((this->status_buf[2] << 8) | this->status_buf[3]);
+            
+            UASCommandSlot *slot = nullptr;
+            for(auto &s: slots) {
+                if (s.busy && s.tag == tag) {
+                    slot = &s;
+                    break;
+                }
+            }
+            
+            if (slot == nullptr) {
+                FSP_USB_LOG("%s (interface ID %d): ignoring IU 0x%02X for unknown tag 0x%04X.", __func__, this->client->ID, iu_id, tag);
+                continue;
+            }
+            
+            switch(iu_id) {
+                case UAS_IU_READ_READY:
+                case UAS_IU_WRITE_READY:
+                    if (!this->TransferData(*slot)) this->ok = false;
+                    break;
+                case UAS_IU_SENSE:
+                case UAS_IU_RESPONSE: {
+                    auto &status = out_statuses[slot->index];
+                    status.signature = SCSI_CSW_SIGNATURE;
+                    status.tag = tag;
+                    /* Sense IU status byte is the SCSI status, anything but GOOD is a failure */
+                    status.status = ((iu_id == UAS_IU_SENSE && status_len >= UAS_SENSE_IU_MIN_SIZE && this->status_buf[6] == 0) ? SCSI_CMD_STATUS_SUCCESS : SCSI_CMD_STATUS_FAILED);
+                    /* UAS has no residue field, so it comes from what actually went over the data pipes */
+                    status.data_residue = ((slot->buffer != nullptr) ? (slot->cmd->GetDataTransferLength() - slot->transferred) : 0);
+                    
+                    /* Sense IU carries the sense data right away (length at 14-15, data from 16), there's no contingent allegiance left for REQUEST SENSE */
+                    if (iu_id == UAS_IU_SENSE && status_len > UAS_SENSE_IU_MIN_SIZE && status.status != SCSI_CMD_STATUS_SUCCESS) {
+                        u32 sense_len = (u32)cdb::GetBE<2>(this->status_buf + UAS_SENSE_IU_LENGTH_OFFSET);
+                        sense_len = std::min(sense_len, std::min<u32>(status_len - UAS_SENSE_IU_MIN_SIZE, sizeof(status.sense)));
+                        memcpy(status.sense, this->status_buf + UAS_SENSE_IU_MIN_SIZE, sense_len);
+                        status.sense_len = (u8)sense_len;
+                    }
+                    
+                    FSP_USB_LOG("%s (interface ID %d): tag 0x%04X completed with IU 0x%02X (status 0x%02X).", __func__, this->client->ID, tag, iu_id, status.status);
+                    
+                    slot->busy = false;
+                    in_flight--;
+                    completed++;
+                    break;
+                }
+                default:
+                    FSP_USB_LOG("%s (interface ID %d): unexpected IU 0x%02X for tag 0x%04X.", __func__, this->client->ID, iu_id, tag);
+                    this->ok = false;
+                    break;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,83 @@
+
+#pragma once
+#include "fspusb_scsi.hpp"
+
+#define UAS_IU_COMMAND                  0x01
+#define UAS_IU_SENSE                    0x03
+#define UAS_IU_RESPONSE                 0x04
+#define UAS_IU_TASK_MANAGEMENT          0x05
+#define UAS_IU_READ_READY               0x06
+#define UAS_IU_WRITE_READY              0x07
+
+#define UAS_COMMAND_IU_SIZE             0x20
+#define UAS_COMMAND_IU_CDB_OFFSET       0x10
+#define UAS_SENSE_IU_MIN_SIZE           0x10
+#define UAS_SENSE_IU_LENGTH_OFFSET      0x0E
+#define UAS_RESPONSE_IU_SIZE            0x08
+#define UAS_READY_IU_SIZE               0x04
+
+#define UAS_PIPE_ID_COMMAND             0x01
+#define UAS_PIPE_ID_STATUS              0x02
+#define UAS_PIPE_ID_DATA_IN             0x03
+#define UAS_PIPE_ID_DATA_OUT            0x04
+
+#define UAS_MAX_COMMANDS_IN_FLIGHT      4
+
+namespace fspusb::impl {
+
+    struct UASCommandSlot {
+        SCSICommand *cmd;
+        u8 *buffer;
+        u32 index;
+        u32 transferred;
+        u16 tag;
+        bool busy;
+    };
+
+    /* USB Attached SCSI transport (without bulk streams, as usb:hs doesn't expose them) */
+    class UASDevice : public SCSITransport {
+
+        public:
+            static constexpr size_t BufferSize = USB_TRANSFER_MEMORY_BLOCK_SIZE;
+
+        private:
+            u8 *cmd_buf; // Used to send command IUs
+            u8 *data_buf; // Used to send/receive data
+            u8 *status_buf; // Used to receive status IUs
+            UsbHsClientIfSession *client;
+            UsbHsClientEpSession *cmd_endpoint;
+            UsbHsClientEpSession *status_endpoint;
+            UsbHsClientEpSession *data_in_endpoint;
+            UsbHsClientEpSession *data_out_endpoint;
+            bool ok;
+            u8 dev_lun;
+            u16 next_tag;
+
+            u16 AllocateTag();
+            Result PostTransfer(UsbHsClientEpSession *endpoint, void *buffer, u32 size, u32 *transferred, u64 timeout_ns);
+            bool SendCommandIU(SCSICommand &c, u16 tag);
+            bool ReadStatusIU(u32 *out_len, u64 timeout_ns);
+            bool TransferData(UASCommandSlot &slot);
+
+        public:
+            UASDevice(UsbHsClientIfSession *iface, UsbHsClientEpSession *cmd_ep, UsbHsClientEpSession *status_ep, UsbHsClientEpSession *data_in_ep, UsbHsClientEpSession *data_out_ep, u8 lun);
+            virtual ~UASDevice();
+            void AllocateBuffers();
+            void FreeBuffers();
+            virtual SCSICommandStatus TransferCommand(SCSICommand &c, u8 *buffer) override;
+            virtual void TransferCommands(SCSICommand **cmds, u8 **buffers, u32 count, SCSICommandStatus *out_statuses) override;
+
+            virtual bool Ok() override {
+                return this->ok;
+            }
+
+            virtual u8 GetDeviceLUN() override {
+                return this->dev_lun;
+            }
+
+            virtual u32 GetMaxTransferSize() override {
+                return GetDefaultMaxTransferSize(this->client);
+            }
+    };
+
+}
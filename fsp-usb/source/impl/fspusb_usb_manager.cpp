@@ -15,9 +15,215 @@ namespace fspusb::impl {
     
     std::array<bool, DriveMax> g_usb_manager_mounted_index_array;
 
+    Result PrepareInterface(UsbHsClientIfSession *iface, s32 i, const DeviceQuirks &quirks, bool *out_reset_needed) {
+        Result rc = 0;
+        
+        /* Retrieve device configuration */
+        u8 conf = GetUSBConfiguration(iface); // Might fail, in which case just zero is returned
+        FSP_USB_LOG("%s: enumerated interface #%d (ID %d) config -> 0x%02X | desirable config -> 0x%02X.", __func__, i, iface->ID, conf, iface->inf.config_desc.bConfigurationValue);
+        
+        /* Change the current configuration if it doesn't match our desired one */
+        if (conf != iface->inf.config_desc.bConfigurationValue) {
+            FSP_USB_LOG("%s: changing config for enumerated interface #%d (ID %d).", __func__, i, iface->ID);
+            rc = SetUSBConfiguration(iface, iface->inf.config_desc.bConfigurationValue, quirks.GetSettleDelay(USB_SET_CONFIG_SETTLE_DELAY_NS));
+            *out_reset_needed = true;
+            if (R_FAILED(rc)) {
+                FSP_USB_LOG("%s: SetUSBConfiguration returned 0x%08X.", __func__, rc);
+                return rc;
+            }
+        }
+        
+        /* Check if there's an alternate interface available and set it */
+        /* Some devices use the default pipes as interrupt pipes - we actually want to use bulk pipes */
+        /* UAS interfaces are usually an alternate setting of the Bulk-Only one, too */
+        FSP_USB_LOG("%s: enumerated interface #%d (ID %d) alternate setting -> 0x%02X.", __func__, i, iface->ID, iface->inf.inf.interface_desc.bAlternateSetting);
+        
+        if (iface->inf.inf.interface_desc.bAlternateSetting != 0) {
+            FSP_USB_LOG("%s: setting alternate setting for enumerated interface #%d (ID %d).", __func__, i, iface->ID);
+            rc = SetUSBAlternativeInterface(iface, iface->inf.inf.interface_desc.bAlternateSetting, quirks.GetSettleDelay(USB_SET_INTERFACE_SETTLE_DELAY_NS));
+            *out_reset_needed = true;
+            if (R_FAILED(rc)) {
+                FSP_USB_LOG("%s: SetUSBAlternativeInterface returned 0x%08X.", __func__, rc);
+            }
+        }
+        
+        return rc;
+    }
+
+    bool IsUASStreamsRequired(UsbHsInterface *iface) {
+        /* usb:hs has no bulk stream support, which SuperSpeed UAS devices need */
+        for(u32 j = 0; j < 15; j++) {
+            auto in_comp = &iface->inf.input_ss_endpoint_companion_descs[j];
+            auto out_comp = &iface->inf.output_ss_endpoint_companion_descs[j];
+            if ((in_comp->bLength > 0 && (in_comp->bmAttributes & 0x1F)) || (out_comp->bLength > 0 && (out_comp->bmAttributes & 0x1F))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    usb_endpoint_descriptor *FindEndpointDescriptor(UsbHsClientIfSession *iface, u8 ep_addr) {
+        auto descs = ((ep_addr & USB_ENDPOINT_IN) ? iface->inf.inf.input_endpoint_descs : iface->inf.inf.output_endpoint_descs);
+        for(u32 j = 0; j < 15; j++) {
+            if (descs[j].bLength > 0 && descs[j].bEndpointAddress == ep_addr) {
+                return &descs[j];
+            }
+        }
+        return nullptr;
+    }
+
+    bool MountUASInterface(UsbHsClientIfSession *iface, s32 i, const DeviceQuirks &quirks) {
+        u8 pipe_ep_addrs[4] = {0};
+        UsbHsClientEpSession eps[4];
+        Result ep_rcs[4] = {1, 1, 1, 1};
+        bool reset_needed = false, fail = true;
+        
+        Result rc = PrepareInterface(iface, i, quirks, &reset_needed);
+        if (R_SUCCEEDED(rc)) {
+            /* Command, status, data-in and data-out pipes, in pipe ID order */
+            rc = GetUSBPipeUsageEndpoints(iface, pipe_ep_addrs, 4);
+            FSP_USB_LOG("%s: enumerated interface #%d (ID %d) UAS pipes -> 0x%02X 0x%02X 0x%02X 0x%02X.", __func__, i, iface->ID, pipe_ep_addrs[0], pipe_ep_addrs[1], pipe_ep_addrs[2], pipe_ep_addrs[3]);
+        }
+        
+        if (R_SUCCEEDED(rc)) {
+            bool eps_ok = true;
+            for(u32 p = 0; p < 4; p++) {
+                auto epd = FindEndpointDescriptor(iface, pipe_ep_addrs[p]);
+                if (epd != nullptr) {
+                    ep_rcs[p] = usbHsIfOpenUsbEp(iface, &eps[p], 1, epd->wMaxPacketSize, epd);
+                }
+                if (epd == nullptr || R_FAILED(ep_rcs[p])) {
+                    eps_ok = false;
+                    break;
+                }
+            }
+            
+            if (eps_ok) {
+                /* Since FATFS reads from drives in the vector and we need to mount it, push it to the vector first */
+                auto drv = std::make_unique<Drive>(*iface, eps[0], eps[1], eps[2], eps[3], 0, quirks);
+                g_usb_manager_drives.push_back(std::move(drv));
+                
+                auto &drive_ref = g_usb_manager_drives.back();
+                rc = drive_ref->Mount();
+                if (R_SUCCEEDED(rc)) {
+                    fail = false;
+                } else {
+                    drive_ref->Dispose(false);
+                    g_usb_manager_drives.pop_back();
+                }
+            }
+        }
+        
+        FSP_USB_LOG("%s: %s UAS drive on enumerated interface #%d (ID %d).", __func__, (fail ? "failed to mount" : "successfully mounted"), i, iface->ID);
+        
+        if (fail) {
+            for(u32 p = 0; p < 4; p++) {
+                if (R_SUCCEEDED(ep_rcs[p])) usbHsEpClose(&eps[p]);
+            }
+        }
+        
+        return !fail;
+    }
+
+    void UpdateBulkOnlyInterface(UsbHsClientIfSession *iface, s32 i, const DeviceQuirks &quirks) {
+        UsbHsClientEpSession inep;
+        UsbHsClientEpSession outep;
+        Result ep1res = 1, ep2res = 1;
+        bool fail = false, bulk_reset = false, owned = false;
+        Result rc;
+        
+        for(u32 j = 0; j < 15; j++) {
+            auto epd = &iface->inf.inf.input_endpoint_descs[j];
+            if (epd->bLength > 0) {
+                ep1res = usbHsIfOpenUsbEp(iface, &outep, SCSI_DATA_PIPELINE_DEPTH, epd->wMaxPacketSize, epd);
+                break;
+            }
+        }
+        
+        for(u32 j = 0; j < 15; j++) {
+            auto epd = &iface->inf.inf.output_endpoint_descs[j];
+            if (epd->bLength > 0) {
+                ep2res = usbHsIfOpenUsbEp(iface, &inep, SCSI_DATA_PIPELINE_DEPTH, epd->wMaxPacketSize, epd);
+                break;
+            }
+        }
+        
+        /* Check if we opened our I/O endpoints */
+        if (R_SUCCEEDED(ep1res) && R_SUCCEEDED(ep2res)) {
+            rc = PrepareInterface(iface, i, quirks, &bulk_reset);
+            if (R_SUCCEEDED(rc)) {
+                if (bulk_reset) {
+                    /* Perform a bulk storage reset, if needed */
+                    FSP_USB_LOG("%s: performing bulk-only mass storage reset on enumerated interface #%d (ID %d).", __func__, i, iface->ID);
+                    rc = ResetBulkStorage(iface, &inep, &outep);
+                }
+                
+                if (R_SUCCEEDED(rc)) {
+                    /* Retrieve max LUN count from this drive */
+                    u8 max_lun = (quirks.Has(DeviceQuirkFlags_NoGetMaxLUN) ? 1 : GetMaxLUN(iface));
+                    FSP_USB_LOG("%s: enumerated interface #%d (ID %d) max LUN count -> %u.", __func__, i, iface->ID, max_lun);
+                    
+                    /* Clear possible STALL status from bulk pipes */
+                    /* Not all devices support the max LUN request */
+                    ClearEndpointHalt(iface, &inep);
+                    ClearEndpointHalt(iface, &outep);
+                    
+                    /* From here on the USB objects belong to the shared interface, which closes them once no drive uses it anymore */
+                    auto bot_iface = std::make_shared<BulkOnlyInterface>(*iface, inep, outep);
+                    owned = true;
+                    
+                    /* Mount every LUN we can, each one as its own drive (multi-slot card readers) */
+                    u32 mounted_luns = 0;
+                    for(u8 j = 0; j < max_lun; j++) {
+                        /* Since FATFS reads from drives in the vector and we need to mount it, push it to the vector first */
+                        /* Then, if it didn't mount correctly, pop it from the vector */
+                        auto drv = std::make_unique<Drive>(bot_iface, j, quirks);
+                        g_usb_manager_drives.push_back(std::move(drv));
+                        
+                        auto &drive_ref = g_usb_manager_drives.back();
+                        rc = drive_ref->Mount();
+                        if (R_SUCCEEDED(rc)) {
+                            mounted_luns++;
+                            continue;
+                        }
+                        
+                        FSP_USB_LOG("%s: failed to mount LUN %u on enumerated interface #%d (ID %d).", __func__, j, i, iface->ID);
+                        drive_ref->Dispose(false);
+                        g_usb_manager_drives.pop_back();
+                    }
+                    
+                    fail = (mounted_luns == 0);
+                    FSP_USB_LOG("%s: %s on enumerated interface #%d (ID %d) (%u of %u LUNs).", __func__, (fail ? "failed to mount any drive" : "successfully mounted drives"), i, iface->ID, mounted_luns, max_lun);
+                } else {
+                    fail = true;
+                    FSP_USB_LOG("%s: ResetBulkStorage returned 0x%08X.", __func__, rc);
+                }
+            } else {
+                fail = true;
+            }
+        } else {
+            fail = true;
+            
+            if (R_FAILED(ep1res)) {
+                FSP_USB_LOG("%s: usbHsIfOpenUsbEp returned 0x%08X on output endpoint from enumerated interface #%d (ID %d).", __func__, ep1res, i, iface->ID);
+            }
+            
+            if (R_FAILED(ep2res)) {
+                FSP_USB_LOG("%s: usbHsIfOpenUsbEp returned 0x%08X on input endpoint from enumerated interface #%d (ID %d).", __func__, ep2res, i, iface->ID);
+            }
+        }
+        
+        if (fail && !owned) {
+            if (R_SUCCEEDED(ep1res)) usbHsEpClose(&outep);
+            if (R_SUCCEEDED(ep2res)) usbHsEpClose(&inep);
+            usbHsIfClose(iface);
+        }
+    }
+
     void UpdateDrives() {
         std::scoped_lock lk(g_usb_manager_lock);
 
+        u64 start_tick = armGetSystemTick();
         UsbHsInterface iface_block[DriveMax];
         size_t iface_block_size = DriveMax * sizeof(UsbHsInterface);
         memset(iface_block, 0, iface_block_size);
@@ -73,126 +279,68 @@ namespace fspusb::impl {
             return;
         }
         
-        for(s32 i = 0; i < iface_count; i++) {
-            UsbHsClientIfSession iface;
-            UsbHsClientEpSession inep;
-            UsbHsClientEpSession outep;
-            Result ep1res = 1, ep2res = 1;
-            bool fail = false, bulk_reset = false;
-            
-            rc = usbHsAcquireUsbIf(&iface, &iface_block[i]);
-            if (R_FAILED(rc)) {
-                FSP_USB_LOG("%s: usbHsAcquireUsbIf returned 0x%08X for enumerated interface #%d.", __func__, rc, i);
-                continue;
-            }
-            
-            for(u32 j = 0; j < 15; j++) {
-                auto epd = &iface.inf.inf.input_endpoint_descs[j];
-                if (epd->bLength > 0) {
-                    ep1res = usbHsIfOpenUsbEp(&iface, &outep, 1, epd->wMaxPacketSize, epd);
-                    break;
+        /* Interfaces which were claimed through UAS this time, so their Bulk-Only alternate setting is skipped */
+        std::vector<UsbHsInterface*> uas_claimed;
+        
+        /* Try UAS interfaces first, then Bulk-Only ones */
+        for(u32 pass = 0; pass < 2; pass++) {
+            for(s32 i = 0; i < iface_count; i++) {
+                u8 protocol = iface_block[i].inf.interface_desc.bInterfaceProtocol;
+                bool is_uas = (protocol == MASS_STORAGE_USB_ATTACHED_SCSI);
+                
+                if ((protocol != MASS_STORAGE_BULK_ONLY && !is_uas) || (is_uas != (pass == 0))) {
+                    continue;
                 }
-            }
-            
-            for(u32 j = 0; j < 15; j++) {
-                auto epd = &iface.inf.inf.output_endpoint_descs[j];
-                if (epd->bLength > 0) {
-                    ep2res = usbHsIfOpenUsbEp(&iface, &inep, 1, epd->wMaxPacketSize, epd);
-                    break;
+                
+                auto quirks = GetDeviceQuirks(iface_block[i].device_desc.idVendor, iface_block[i].device_desc.idProduct);
+                if (is_uas && quirks.Has(DeviceQuirkFlags_NoUAS)) {
+                    FSP_USB_LOG("%s: enumerated interface #%d (ID %d) has a broken UAS implementation, leaving it to Bulk-Only.", __func__, i, iface_block[i].inf.ID);
+                    continue;
                 }
-            }
-            
-            /* Check if we opened our I/O endpoints */
-            if (R_SUCCEEDED(ep1res) && R_SUCCEEDED(ep2res)) {
-                /* Retrieve device configuration */
-                u8 conf = GetUSBConfiguration(&iface); // Might fail, in which case just zero is returned
-                FSP_USB_LOG("%s: enumerated interface #%d (ID %d) config -> 0x%02X | desirable config -> 0x%02X.", __func__, i, iface.ID, conf, iface.inf.config_desc.bConfigurationValue);
                 
-                /* Change the current configuration if it doesn't match our desired one */
-                if (conf != iface.inf.config_desc.bConfigurationValue) {
-                    FSP_USB_LOG("%s: changing config for enumerated interface #%d (ID %d).", __func__, i, iface.ID);
-                    rc = SetUSBConfiguration(&iface, iface.inf.config_desc.bConfigurationValue);
-                    bulk_reset = true;
+                if (is_uas && IsUASStreamsRequired(&iface_block[i])) {
+                    FSP_USB_LOG("%s: enumerated interface #%d (ID %d) needs UAS bulk streams, leaving it to Bulk-Only.", __func__, i, iface_block[i].inf.ID);
+                    continue;
                 }
                 
-                if (R_SUCCEEDED(rc)) {
-                    /* Check if there's an alternate interface available and set it */
-                    /* Some devices use the default pipes as interrupt pipes - we actually want to use bulk pipes */
-                    FSP_USB_LOG("%s: enumerated interface #%d (ID %d) alternate setting -> 0x%02X.", __func__, i, iface.ID, iface.inf.inf.interface_desc.bAlternateSetting);
-                    
-                    if (iface.inf.inf.interface_desc.bAlternateSetting != 0) {
-                        FSP_USB_LOG("%s: setting alternate setting for enumerated interface #%d (ID %d).", __func__, i, iface.ID);
-                        rc = SetUSBAlternativeInterface(&iface, iface.inf.inf.interface_desc.bAlternateSetting);
-                        bulk_reset = true;
-                    }
-                    
-                    if (R_SUCCEEDED(rc)) {
-                        if (bulk_reset) {
-                            /* Perform a bulk storage reset, if needed */
-                            FSP_USB_LOG("%s: performing bulk-only mass storage reset on enumerated interface #%d (ID %d).", __func__, i, iface.ID);
-                            rc = ResetBulkStorage(&iface, &inep, &outep);
-                        }
-                        
-                        if (R_SUCCEEDED(rc)) {
-                            /* Retrieve max LUN count from this drive */
-                            u8 max_lun = GetMaxLUN(&iface);
-                            FSP_USB_LOG("%s: enumerated interface #%d (ID %d) max LUN count -> %u.", __func__, i, iface.ID, max_lun);
-                            
-                            /* Clear possible STALL status from bulk pipes */
-                            /* Not all devices support the max LUN request */
-                            ClearEndpointHalt(&iface, &inep);
-                            ClearEndpointHalt(&iface, &outep);
-                            
-                            /* Try to mount each LUN until one of them succeeds */
-                            fail = true;
-                            for(u8 j = 0; j < max_lun; j++) {
-                                /* Since FATFS reads from drives in the vector and we need to mount it, push it to the vector first */
-                                /* Then, if it didn't mount correctly, pop from the vector and close the interface */
-                                auto drv = std::make_unique<Drive>(iface, inep, outep, j);
-                                g_usb_manager_drives.push_back(std::move(drv));
-                                
-                                auto &drive_ref = g_usb_manager_drives.back();
-                                rc = drive_ref->Mount();
-                                if (R_SUCCEEDED(rc)) {
-                                    fail = false;
-                                    break;
-                                }
-                                
-                                /* Don't close the opened USB objects at this stage */
-                                drive_ref->Dispose(false);
-                                g_usb_manager_drives.pop_back();
-                            }
-                            
-                            FSP_USB_LOG("%s: %s drive on enumerated interface #%d (ID %d).", __func__, (fail ? "failed to mount" : "successfully mounted"), i, iface.ID);
-                        } else {
-                            fail = true;
-                            FSP_USB_LOG("%s: ResetBulkStorage returned 0x%08X.", __func__, rc);
-                        }
-                    } else {
-                        fail = true;
-                        FSP_USB_LOG("%s: SetUSBAlternativeInterface returned 0x%08X.", __func__, rc);
+                bool claimed = false;
+                for(auto uas_iface: uas_claimed) {
+                    if (uas_iface->busID == iface_block[i].busID && uas_iface->deviceID == iface_block[i].deviceID && uas_iface->inf.interface_desc.bInterfaceNumber == iface_block[i].inf.interface_desc.bInterfaceNumber) {
+                        claimed = true;
+                        break;
                     }
-                } else {
-                    fail = true;
-                    FSP_USB_LOG("%s: SetUSBConfiguration returned 0x%08X.", __func__, rc);
                 }
-            } else {
-                fail = true;
+                if (claimed) {
+                    continue;
+                }
                 
-                if (R_FAILED(ep1res)) {
-                    FSP_USB_LOG("%s: usbHsIfOpenUsbEp returned 0x%08X on output endpoint from enumerated interface #%d (ID %d).", __func__, ep1res, i, iface.ID);
+                UsbHsClientIfSession iface;
+                rc = usbHsAcquireUsbIf(&iface, &iface_block[i]);
+                if (R_FAILED(rc)) {
+                    FSP_USB_LOG("%s: usbHsAcquireUsbIf returned 0x%08X for enumerated interface #%d.", __func__, rc, i);
+                    continue;
                 }
                 
-                if (R_FAILED(ep2res)) {
-                    FSP_USB_LOG("%s: usbHsIfOpenUsbEp returned 0x%08X on input endpoint from enumerated interface #%d (ID %d).", __func__, ep2res, i, iface.ID);
+                if (is_uas) {
+                    if (MountUASInterface(&iface, i, quirks)) {
+                        uas_claimed.push_back(&iface_block[i]);
+                    } else {
+                        usbHsIfClose(&iface);
+                    }
+                } else {
+                    UpdateBulkOnlyInterface(&iface, i, quirks);
                 }
             }
-            
-            if (fail) {
-                if (R_SUCCEEDED(ep1res)) usbHsEpClose(&outep);
-                if (R_SUCCEEDED(ep2res)) usbHsEpClose(&inep);
-                usbHsIfClose(&iface);
-            }
+        }
+        
+        FSP_USB_LOG("%s: drive update finished in %lu mS (acquired drive count -> %lu).", __func__, armTicksToNs(armGetSystemTick() - start_tick) / 1000000, g_usb_manager_drives.size());
+    }
+
+    void ProcessIdleDrives() {
+        std::scoped_lock lk(g_usb_manager_lock);
+        
+        for(auto &drive: g_usb_manager_drives) {
+            drive->DoIdleWork();
         }
     }
 
@@ -201,10 +349,12 @@ namespace fspusb::impl {
         s32 idx;
         
         while(true) {
-            // Wait until one of our events is triggered
+            // Wait until one of our events is triggered, or check for idle drives every now and then
             idx = 0;
-            rc = waitMulti(&idx, -1, waiterForEvent(usbHsGetInterfaceStateChangeEvent()), waiterForEvent(&g_usb_manager_interface_available_event), waiterForEvent(&g_usb_manager_thread_exit_event));
-            if (R_SUCCEEDED(rc)) {
+            rc = waitMulti(&idx, ManagerIdleCheckIntervalNs, waiterForEvent(usbHsGetInterfaceStateChangeEvent()), waiterForEvent(&g_usb_manager_interface_available_event), waiterForEvent(&g_usb_manager_thread_exit_event));
+            if (rc == KERNELRESULT(TimedOut)) {
+                ProcessIdleDrives();
+            } else if (R_SUCCEEDED(rc)) {
                 FSP_USB_LOG("%s: triggered event index -> %d (%s).", __func__, idx, (idx == 0 ? "interface state change" : (idx == 1 ? "filtered interface available" : "exit")));
                 
                 /* Clear InterfaceStateChangeEvent if it was triggered (not an autoclear event) */
@@ -264,13 +414,16 @@ namespace fspusb::impl {
         memset(&g_usb_manager_interface_available_event, 0, sizeof(Event));
         memset(&g_usb_manager_thread_exit_event, 0, sizeof(Event));
 
+        /* Reads sdmc:/config/fsp-usb/quirks.ini (mounting the SD card for it if this isn't a debug build) */
+        LoadDeviceQuirks();
+
         auto rc = usbHsInitialize();
         if(R_SUCCEEDED(rc)) {
             g_usb_manager_device_filter = {};
-            g_usb_manager_device_filter.Flags = UsbHsInterfaceFilterFlags_bInterfaceClass | UsbHsInterfaceFilterFlags_bInterfaceSubClass | UsbHsInterfaceFilterFlags_bInterfaceProtocol;
+            /* Both Bulk-Only and UAS interfaces are wanted, so the protocol is checked in UpdateDrives */
+            g_usb_manager_device_filter.Flags = UsbHsInterfaceFilterFlags_bInterfaceClass | UsbHsInterfaceFilterFlags_bInterfaceSubClass;
             g_usb_manager_device_filter.bInterfaceClass = USB_CLASS_MASS_STORAGE;
             g_usb_manager_device_filter.bInterfaceSubClass = MASS_STORAGE_SCSI_COMMANDS;
-            g_usb_manager_device_filter.bInterfaceProtocol = MASS_STORAGE_BULK_ONLY;
             
             rc = usbHsCreateInterfaceAvailableEvent(&g_usb_manager_interface_available_event, true, 0, &g_usb_manager_device_filter);
             if(R_SUCCEEDED(rc)) {
@@ -343,7 +496,7 @@ namespace fspusb::impl {
     bool IsDriveInterfaceIdValid(s32 drive_interface_id) {
         std::scoped_lock lk(g_usb_manager_lock);
         for(auto &drive: g_usb_manager_drives) {
-            if(drive_interface_id == drive->GetInterfaceId()) {
+            if(drive_interface_id == drive->GetDriveId()) {
                 return true;
             }
         }
@@ -353,7 +506,7 @@ namespace fspusb::impl {
     u32 GetDriveMountedIndex(s32 drive_interface_id) {
         std::scoped_lock lk(g_usb_manager_lock);
         for(auto &drive: g_usb_manager_drives) {
-            if (drive_interface_id == drive->GetInterfaceId()) {
+            if (drive_interface_id == drive->GetDriveId()) {
                 return drive->GetMountedIndex();
             }
         }
@@ -364,7 +517,7 @@ namespace fspusb::impl {
         std::scoped_lock lk(g_usb_manager_lock);
         if (drive_idx < g_usb_manager_drives.size()) {
             auto &drive = g_usb_manager_drives.at(drive_idx);
-            return drive->GetInterfaceId();
+            return drive->GetDriveId();
         }
         return 0;
     }
@@ -372,7 +525,7 @@ namespace fspusb::impl {
     void DoWithDrive(s32 drive_interface_id, std::function<void(DrivePointer&)> fn) {
         std::scoped_lock lk(g_usb_manager_lock);
         for(auto &drive: g_usb_manager_drives) {
-            if(drive_interface_id == drive->GetInterfaceId()) {
+            if(drive_interface_id == drive->GetDriveId()) {
                 fn(drive);
                 break;
             }
@@ -7,11 +7,14 @@
 #define USB_CLASS_MASS_STORAGE      0x08
 #define MASS_STORAGE_SCSI_COMMANDS  0x06
 #define MASS_STORAGE_BULK_ONLY      0x50
+#define MASS_STORAGE_USB_ATTACHED_SCSI  0x62
 
 namespace fspusb::impl {
 
     constexpr u32 InvalidMountedIndex = 0xFF;
 
+    constexpr s64 ManagerIdleCheckIntervalNs = 1'000'000'000;
+
     Result InitializeManager();
     void FinalizeManager();
     void DoUpdateDrives();
@@ -19,6 +22,7 @@ namespace fspusb::impl {
     bool FindAndMountAtIndex(u32 *out_mounted_idx);
     void UnmountAtIndex(u32 mounted_idx);
     size_t GetAcquiredDriveCount();
+    /* Drive "interface IDs" are the drive IDs from Drive::GetDriveId, which only match the interface ID for LUN 0 */
     bool IsDriveInterfaceIdValid(s32 drive_interface_id);
     u32 GetDriveMountedIndex(s32 drive_interface_id);
     s32 GetDriveInterfaceId(u32 drive_idx);
@@ -18,8 +18,11 @@
 #define FSP_USB_LOG(fmt, ...)
 #endif
 
-#define USB_TRANSFER_MEMORY_BLOCK_SIZE      0x1000  // 1 KiB
-#define USB_TRANSFER_MEMORY_MAX_MULTIPLIER  8       // 32 KiB
+#define USB_TRANSFER_MEMORY_BLOCK_SIZE      0x1000  // 4 KiB
+#define USB_TRANSFER_MEMORY_MAX_MULTIPLIER  32      // 128 KiB
+
+#define USB_TRANSFER_CHUNK_SIZE_MIN         0x8000      // 32 KiB
+#define USB_TRANSFER_CHUNK_SIZE_MAX         0x100000    // 1 MiB
 
 namespace fspusb::impl {
 
@@ -0,0 +1,131 @@
+#include "fspusb_write_back.hpp"
+#include <algorithm>
+
+namespace fspusb::impl {
+
+    WriteBackBuffer::WriteBackBuffer() : buffer(nullptr), sectors(nullptr), block_size(0), slot_count(0), used_count(0), counters() {}
+
+    WriteBackBuffer::~WriteBackBuffer() {
+        this->Finalize();
+    }
+
+    bool WriteBackBuffer::Initialize(u32 block_sz, size_t max_sz) {
+        this->Finalize();
+
+        u32 slot_cnt = ((block_sz > 0) ? (u32)(max_sz / block_sz) : 0);
+        if(slot_cnt == 0) {
+            return false;
+        }
+
+        /* Not having a buffer isn't fatal, every write just goes straight to the drive */
+        this->buffer = new (std::nothrow) u8[(size_t)slot_cnt * block_sz];
+        this->sectors = new (std::nothrow) u64[slot_cnt];
+        if(this->buffer == nullptr || this->sectors == nullptr) {
+            this->Finalize();
+            return false;
+        }
+
+        this->block_size = block_sz;
+        this->slot_count = slot_cnt;
+        this->counters = {};
+        return true;
+    }
+
+    void WriteBackBuffer::Finalize() {
+        if(this->buffer != nullptr) {
+            delete[] this->buffer;
+            this->buffer = nullptr;
+        }
+        if(this->sectors != nullptr) {
+            delete[] this->sectors;
+            this->sectors = nullptr;
+        }
+        this->block_size = 0;
+        this->slot_count = 0;
+        this->used_count = 0;
+    }
+
+    u32 WriteBackBuffer::Find(u64 sector) {
+        /* Slot of the first buffered sector at or after this one */
+        return (u32)(std::lower_bound(this->sectors, this->sectors + this->used_count, sector) - this->sectors);
+    }
+
+    void WriteBackBuffer::Move(u32 dst, u32 src, u32 count) {
+        if(dst == src || count == 0) return;
+        memmove(this->sectors + dst, this->sectors + src, (size_t)count * sizeof(u64));
+        memmove(this->buffer + ((size_t)dst * this->block_size), this->buffer + ((size_t)src * this->block_size), (size_t)count * this->block_size);
+    }
+
+    bool WriteBackBuffer::Add(const u8 *data, u64 sector, u32 count) {
+        if(!this->IsEnabled() || count == 0) return false;
+
+        u64 end = (sector + count);
+        u32 first = this->Find(sector);
+        u32 last = this->Find(end);
+
+        /* The caller flushes and tries again, or writes it through */
+        u32 dirty = (last - first);
+        if((this->used_count - dirty + count) > this->slot_count) {
+            return false;
+        }
+
+        /* Everything already buffered in the range gets replaced, so only what comes after it has to make room */
+        this->Move(first + count, last, this->used_count - last);
+        this->used_count = (this->used_count - dirty + count);
+
+        for(u32 i = 0; i < count; i++) {
+            this->sectors[first + i] = (sector + i);
+        }
+        memcpy(this->buffer + ((size_t)first * this->block_size), data, (size_t)count * this->block_size);
+
+        this->counters.buffered_writes++;
+        this->counters.absorbed_sectors += dirty;
+        return true;
+    }
+
+    void WriteBackBuffer::Remove(u64 sector, u32 count) {
+        if(count == 0 || this->used_count == 0) return;
+
+        /* These sectors are about to be written with newer data, so the buffered one must not be written afterwards */
+        u32 first = this->Find(sector);
+        u32 last = this->Find(sector + count);
+        this->Move(first, last, this->used_count - last);
+        this->used_count -= (last - first);
+    }
+
+    void WriteBackBuffer::Overlay(u8 *out, u64 sector, u32 count) {
+        if(count == 0 || this->used_count == 0) return;
+
+        /* Whatever was just read from the drive is older than what we still have buffered */
+        u64 end = (sector + count);
+        for(u32 i = this->Find(sector); i < this->used_count && this->sectors[i] < end; i++) {
+            memcpy(out + ((size_t)(this->sectors[i] - sector) * this->block_size), this->buffer + ((size_t)i * this->block_size), this->block_size);
+        }
+    }
+
+    bool WriteBackBuffer::Flush(const WriteFunction &write_fn) {
+        /* In LBA order, one command per run of adjacent sectors. Anything which fails stays buffered for the next try */
+        u32 done = 0;
+        bool ok = true;
+        while(done < this->used_count) {
+            u32 count = 1;
+            while((done + count) < this->used_count && this->sectors[done + count] == (this->sectors[done] + count)) {
+                count++;
+            }
+
+            if(!write_fn(this->buffer + ((size_t)done * this->block_size), this->sectors[done], count)) {
+                ok = false;
+                break;
+            }
+
+            this->counters.flushed_commands++;
+            this->counters.flushed_sectors += count;
+            done += count;
+        }
+
+        this->Move(0, done, this->used_count - done);
+        this->used_count -= done;
+        return ok;
+    }
+
+}
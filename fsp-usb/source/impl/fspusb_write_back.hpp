@@ -0,0 +1,68 @@
+
+#pragma once
+#include "fspusb_utils.hpp"
+#include <functional>
+
+namespace fspusb::impl {
+
+    /* Per drive, allocated in one go when the drive gets mounted */
+    constexpr u32 WriteBackDefaultSize = 0x10000;
+
+    /* Writes this big already make for a decent command on their own, so they go straight to the drive */
+    constexpr u32 WriteBackBypassSize = 0x4000;
+
+    struct WriteBackCounters {
+        u64 buffered_writes;
+        u64 absorbed_sectors; // Rewritten while still dirty, so they only go to the drive once
+        u64 flushed_commands;
+        u64 flushed_sectors;
+    };
+
+    /* Dirty sectors waiting to be written, kept sorted so that adjacent ones end up next to each other in the buffer */
+    class WriteBackBuffer {
+
+        public:
+            /* Writes sectors straight to the drive */
+            using WriteFunction = std::function<bool(const u8*, u64, u32)>;
+
+        private:
+            u8 *buffer; // One block per slot, in the same order as sectors
+            u64 *sectors;
+            u32 block_size;
+            u32 slot_count;
+            u32 used_count;
+            WriteBackCounters counters;
+
+            u32 Find(u64 sector);
+            void Move(u32 dst, u32 src, u32 count);
+
+        public:
+            WriteBackBuffer();
+            ~WriteBackBuffer();
+
+            bool Initialize(u32 block_sz, size_t max_sz);
+            void Finalize();
+
+            bool Add(const u8 *data, u64 sector, u32 count);
+            void Remove(u64 sector, u32 count);
+            void Overlay(u8 *out, u64 sector, u32 count);
+            bool Flush(const WriteFunction &write_fn);
+
+            bool IsEnabled() {
+                return this->buffer != nullptr;
+            }
+
+            bool IsEmpty() {
+                return this->used_count == 0;
+            }
+
+            size_t GetPendingSize() {
+                return ((size_t)this->used_count * this->block_size);
+            }
+
+            const WriteBackCounters &GetCounters() {
+                return this->counters;
+            }
+    };
+
+}